@@ -60,9 +60,15 @@ void Config::load() {
         wndHeight      = getIntValue(root, "wndHeight", 600);
         enableSound    = getBoolValue(root, "enableSound", true);
         enableMouse    = getBoolValue(root, "enableMouse", true);
+        asyncEspIo     = getBoolValue(root, "asyncEspIo", false);
+        espVirtualTime = getBoolValue(root, "espVirtualTime", false);
         fontScale2x    = getBoolValue(root, "fontScale2x", false);
         enableDebugger = getBoolValue(root, "enableDebugger", false);
 
+        tcpConnectTimeout   = getIntValue(root, "tcpConnectTimeout", 5000);
+        tcpReadTimeout      = getIntValue(root, "tcpReadTimeout", 0);
+        tcpReuseConnections = getBoolValue(root, "tcpReuseConnections", false);
+
         displayScaling = (DisplayScaling)getIntValue(root, "displayScaling", (int)DisplayScaling::Linear);
 
         Keyboard::instance()->setKeyLayout((KeyLayout)getIntValue(root, "keyLayout", 0));
@@ -140,9 +146,15 @@ void Config::save() {
     cJSON_AddNumberToObject(root, "wndHeight", wndHeight);
     cJSON_AddBoolToObject(root, "enableSound", enableSound);
     cJSON_AddBoolToObject(root, "enableMouse", enableMouse);
+    cJSON_AddBoolToObject(root, "asyncEspIo", asyncEspIo);
+    cJSON_AddBoolToObject(root, "espVirtualTime", espVirtualTime);
     cJSON_AddBoolToObject(root, "fontScale2x", fontScale2x);
     cJSON_AddBoolToObject(root, "enableDebugger", enableDebugger);
 
+    cJSON_AddNumberToObject(root, "tcpConnectTimeout", tcpConnectTimeout);
+    cJSON_AddNumberToObject(root, "tcpReadTimeout", tcpReadTimeout);
+    cJSON_AddBoolToObject(root, "tcpReuseConnections", tcpReuseConnections);
+
     cJSON_AddNumberToObject(root, "displayScaling", (int)displayScaling);
 
     cJSON_AddNumberToObject(root, "keyLayout", (int)Keyboard::instance()->getKeyLayout());
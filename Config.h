@@ -40,6 +40,12 @@ public:
     bool fontScale2x    = false;
     bool enableDebugger = false;
     bool showEspInfo    = false;
+    bool asyncEspIo     = false;
+    bool espVirtualTime = false;
+
+    int  tcpConnectTimeout   = 5000; // ms
+    int  tcpReadTimeout      = 0;    // ms
+    bool tcpReuseConnections = false;
 
     DisplayScaling displayScaling = DisplayScaling::Linear;
 };
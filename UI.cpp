@@ -41,12 +41,34 @@ public:
     int                 emulationSpeed = 1;
     bool                escapePressed  = false;
     ImVec2              menuBarSize;
+    SDCardIoStats       sdIoStatsPrev;
+    double              sdIoStatsTime = 0;
+    double              sdIoRate      = 0;
+    TcpStats            tcpStatsPrev;
+    double              tcpStatsTime = 0;
+    double              tcpRxRate    = 0;
+    double              tcpTxRate    = 0;
+
+    // Copy of the VFS state, updated whenever the I/O thread isn't busy
+    std::string                             espInfoPath;
+    std::map<uint8_t, VFSContext::FileInfo> espInfoFi;
+    std::map<uint8_t, VFSContext::DirInfo>  espInfoDi;
+    SDCardImageInfo                         espInfoImage;
+    bool                                    espInfoHasImage   = false;
+    char                                    espBenchPath[256] = {0};
+    std::string                             espBenchResult;
+    std::string                             espQueueBenchResult;
 
     void start(const std::string &typeInStr) override {
         auto config = Config::instance();
 
         memset(&gamePadData, 0, sizeof(gamePadData));
         setSDCardPath(config->sdCardPath);
+#ifndef _WIN32
+        setHttpCachePath(config->appDataPath + "/httpcache");
+#endif
+        UartProtocol::instance()->setAsyncIo(config->asyncEspIo);
+        setTcpConfig(config->tcpConnectTimeout, config->tcpReadTimeout, config->tcpReuseConnections);
 
         if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER | SDL_INIT_GAMECONTROLLER) != 0) {
             SDL_Log("Unable to initialize SDL: %s", SDL_GetError());
@@ -91,6 +113,7 @@ public:
 
         // Run main loop
         FPGA::instance()->init();
+        FreeRtosMock_setVirtualTime(config->espVirtualTime);
         FreeRtosMock_init();
         app_main();
         auto emuState = EmuState::get();
@@ -281,17 +304,18 @@ public:
                     if (emuState) {
                         emuState->setDebuggerEnabled(config->enableDebugger);
 
-                        // Increase emulation speed while pasting text
                         int emuSpeed = config->enableDebugger ? emulationSpeed : 1;
-                        if (!emuState->pasteIsDone())
-                            emuSpeed = 16;
 
                         bool enableSound = config->enableSound;
                         if (emuSpeed != 1)
                             enableSound = false;
 
-                        for (int i = 0; i < emuSpeed; i++)
+                        for (int i = 0; i < emuSpeed; i++) {
                             emuState->emulateFrame(enableSound ? abuf : nullptr, SAMPLES_PER_BUFFER);
+                            FreeRtosMock_advance(SAMPLES_PER_BUFFER * 1000000ULL / SAMPLERATE);
+                        }
+                    } else {
+                        FreeRtosMock_advance(SAMPLES_PER_BUFFER * 1000000ULL / SAMPLERATE);
                     }
 
                     Audio::instance()->putBuffer(abuf);
@@ -343,6 +367,18 @@ public:
                         if (path) {
                             config->sdCardPath = path;
                             stripTrailingSlashes(config->sdCardPath);
+
+                            std::lock_guard lock(UartProtocol::instance()->ioMutex);
+                            setSDCardPath(config->sdCardPath);
+                        }
+                    }
+                    if (ImGui::MenuItem("Select SD card image...", "")) {
+                        char const *lFilterPatterns[1] = {"*.img"};
+                        auto        path               = tinyfd_openFileDialog("Select SD card image", "", 1, lFilterPatterns, "FAT16/FAT32 disk images", 0);
+                        if (path) {
+                            config->sdCardPath = path;
+
+                            std::lock_guard lock(UartProtocol::instance()->ioMutex);
                             setSDCardPath(config->sdCardPath);
                         }
                     }
@@ -352,6 +388,8 @@ public:
                     }
                     if (ImGui::MenuItem(ejectLabel.c_str(), "", false, !config->sdCardPath.empty())) {
                         config->sdCardPath.clear();
+
+                        std::lock_guard lock(UartProtocol::instance()->ioMutex);
                         setSDCardPath("");
                     }
                     ImGui::Separator();
@@ -359,6 +397,19 @@ public:
                         emuState->fileMenu();
                     ImGui::MenuItem("Enable sound", "", &config->enableSound);
                     ImGui::MenuItem("Enable mouse", "", &config->enableMouse);
+                    if (ImGui::MenuItem("Asynchronous ESP file I/O", "", &config->asyncEspIo))
+                        UartProtocol::instance()->setAsyncIo(config->asyncEspIo);
+                    if (ImGui::MenuItem("Run ESP on emulated time", "", &config->espVirtualTime))
+                        FreeRtosMock_setVirtualTime(config->espVirtualTime);
+                    if (ImGui::BeginMenu("TCP connections")) {
+                        bool changed = false;
+                        changed |= ImGui::SliderInt("Connect timeout (ms)", &config->tcpConnectTimeout, 100, 30000);
+                        changed |= ImGui::SliderInt("Read timeout (ms)", &config->tcpReadTimeout, 0, 5000);
+                        changed |= ImGui::MenuItem("Reuse connections", "", &config->tcpReuseConnections);
+                        if (changed)
+                            setTcpConfig(config->tcpConnectTimeout, config->tcpReadTimeout, config->tcpReuseConnections);
+                        ImGui::EndMenu();
+                    }
                     ImGui::Separator();
                     if (ImGui::MenuItem("Reset Aquarius+ (warm)", "")) {
                         if (emuState)
@@ -416,6 +467,15 @@ public:
                     if (ImGui::MenuItem("Paste text from clipboard", "") && emuState) {
                         emuState->pasteText(platformIO.Platform_GetClipboardTextFn(ImGui::GetCurrentContext()));
                     }
+                    {
+                        size_t done = 0, total = 0;
+                        if (emuState && emuState->pasteProgress(done, total)) {
+                            char tmp[64];
+                            snprintf(tmp, sizeof(tmp), "Cancel paste (%u/%u)", (unsigned)done, (unsigned)total);
+                            if (ImGui::MenuItem(tmp, ""))
+                                emuState->pasteCancel();
+                        }
+                    }
                     ImGui::Separator();
                     for (int i = 0; i < (int)KeyLayout::Count; i++) {
                         char tmp[64];
@@ -645,9 +705,95 @@ public:
     void wndEspInfo(bool *p_open) {
         bool open = ImGui::Begin("ESP info", p_open, 0);
         if (open) {
+            {
+                std::unique_lock lock(UartProtocol::instance()->ioMutex, std::try_to_lock);
+                if (lock.owns_lock()) {
+                    auto vfsCtx = VFSContext::getDefault();
+                    espInfoPath = vfsCtx->getCurrentPath();
+                    espInfoFi   = vfsCtx->fi;
+                    espInfoDi   = vfsCtx->di;
+
+                    espInfoHasImage = getSDCardImageInfo(&espInfoImage);
+                }
+            }
+
             ImGui::SeparatorText("Current path");
-            auto curPath = VFSContext::getDefault()->getCurrentPath();
-            ImGui::Text("%s", curPath.empty() ? "/" : curPath.c_str());
+            ImGui::Text("%s", espInfoPath.empty() ? "/" : espInfoPath.c_str());
+#ifndef _WIN32
+            ImGui::SeparatorText("Path name cache");
+            {
+                auto     stats = getSDCardNameCacheStats();
+                uint64_t total = stats.hits + stats.misses;
+                ImGui::Text("Hits: %llu, misses: %llu (%.1f%% hit rate)", (unsigned long long)stats.hits, (unsigned long long)stats.misses, total ? (100.0 * stats.hits / total) : 0.0);
+                ImGui::Text("Invalidations: %llu, cached directories: %u", (unsigned long long)stats.invalidations, (unsigned)stats.dirs);
+            }
+#endif
+            if (espInfoHasImage) {
+                ImGui::SeparatorText("SD card image");
+                ImGui::Text("FAT%u, %u clusters of %u bytes%s", espInfoImage.fatBits, (unsigned)espInfoImage.clusters, espInfoImage.clusterSize, espInfoImage.readOnly ? " (read-only)" : "");
+                ImGui::Text("Cached directories: %u, write-backs: %llu", espInfoImage.cachedDirs, (unsigned long long)espInfoImage.writeBacks);
+            }
+            ImGui::SeparatorText("SD card I/O");
+            {
+                auto   stats = getSDCardIoStats();
+                double now   = ImGui::GetTime();
+                if (now - sdIoStatsTime >= 1.0) {
+                    sdIoRate      = sdIoStatsTime > 0 ? (stats.bytesRead - sdIoStatsPrev.bytesRead) / (now - sdIoStatsTime) : 0;
+                    sdIoStatsPrev = stats;
+                    sdIoStatsTime = now;
+                }
+                ImGui::Text("Read: %.1f KB/s, %llu bytes total", sdIoRate / 1024.0, (unsigned long long)stats.bytesRead);
+                ImGui::Text("Reads: %llu, %.2f syscalls/read", (unsigned long long)stats.reads, stats.reads ? (double)stats.readSyscalls / stats.reads : 0.0);
+                ImGui::Text("Open files: %u", stats.openFiles);
+            }
+            ImGui::SeparatorText("TCP");
+            {
+                auto   stats = getTcpStats();
+                double now   = ImGui::GetTime();
+                if (now - tcpStatsTime >= 1.0) {
+                    tcpRxRate     = tcpStatsTime > 0 ? (stats.bytesRx - tcpStatsPrev.bytesRx) / (now - tcpStatsTime) : 0;
+                    tcpTxRate     = tcpStatsTime > 0 ? (stats.bytesTx - tcpStatsPrev.bytesTx) / (now - tcpStatsTime) : 0;
+                    tcpStatsPrev = stats;
+                    tcpStatsTime = now;
+                }
+                ImGui::Text("Receive: %.1f KB/s, %llu bytes total", tcpRxRate / 1024.0, (unsigned long long)stats.bytesRx);
+                ImGui::Text("Send: %.1f KB/s, %llu bytes total", tcpTxRate / 1024.0, (unsigned long long)stats.bytesTx);
+                ImGui::Text("Connections: %u open, %u idle, %llu made, %llu reused", stats.openConnections, stats.idleConnections, (unsigned long long)stats.connects, (unsigned long long)stats.reused);
+                ImGui::Text("Timeouts: %llu, recv calls: %llu", (unsigned long long)stats.timeouts, (unsigned long long)stats.recvCalls);
+            }
+#ifndef _WIN32
+            ImGui::SeparatorText("HTTP");
+            {
+                auto stats = getHttpStats();
+                ImGui::Text("Requests: %llu, %llu bytes, %llu connections", (unsigned long long)stats.requests, (unsigned long long)stats.bytes, (unsigned long long)stats.connections);
+                ImGui::Text("Disk cache hits: %llu", (unsigned long long)stats.cacheHits);
+
+                if (!stats.recent.empty() && ImGui::BeginTable("TableHttp", 5, ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersV | ImGuiTableFlags_BordersOuter)) {
+                    ImGui::TableSetupColumn("Status", ImGuiTableColumnFlags_WidthFixed);
+                    ImGui::TableSetupColumn("Bytes", ImGuiTableColumnFlags_WidthFixed);
+                    ImGui::TableSetupColumn("Time (ms)", ImGuiTableColumnFlags_WidthFixed);
+                    ImGui::TableSetupColumn("KB/s", ImGuiTableColumnFlags_WidthFixed);
+                    ImGui::TableSetupColumn("URL", ImGuiTableColumnFlags_WidthStretch);
+                    ImGui::TableSetupScrollFreeze(0, 1);
+                    ImGui::TableHeadersRow();
+
+                    for (auto it = stats.recent.rbegin(); it != stats.recent.rend(); ++it) {
+                        ImGui::TableNextRow();
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%d", it->status);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%u", (unsigned)it->bytes);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.1f%s", it->latencyMs, it->reused ? "" : " (new)");
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.1f", it->latencyMs > 0 ? it->bytes / it->latencyMs * 1000.0 / 1024.0 : 0.0);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%s", it->url.c_str());
+                    }
+                    ImGui::EndTable();
+                }
+            }
+#endif
             ImGui::SeparatorText("File descriptors");
             if (ImGui::BeginTable("Table", 4, ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersV | ImGuiTableFlags_BordersOuter)) {
                 ImGui::TableSetupColumn("#", ImGuiTableColumnFlags_WidthFixed);
@@ -657,7 +803,7 @@ public:
                 ImGui::TableSetupScrollFreeze(0, 1);
                 ImGui::TableHeadersRow();
 
-                for (auto &entry : VFSContext::getDefault()->fi) {
+                for (auto &entry : espInfoFi) {
                     ImGui::TableNextRow();
                     ImGui::TableNextColumn();
                     ImGui::Text("%u", entry.first);
@@ -679,7 +825,7 @@ public:
                 ImGui::TableSetupScrollFreeze(0, 1);
                 ImGui::TableHeadersRow();
 
-                for (auto &entry : VFSContext::getDefault()->di) {
+                for (auto &entry : espInfoDi) {
                     ImGui::TableNextRow();
                     ImGui::TableNextColumn();
                     ImGui::Text("%u", entry.first);
@@ -691,6 +837,129 @@ public:
 
                 ImGui::EndTable();
             }
+            ImGui::SeparatorText("Command statistics");
+            {
+                auto up = UartProtocol::instance();
+                if (ImGui::Button("Reset")) {
+                    up->resetStats();
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Export JSON...")) {
+                    static const char *lFilterPatterns[1] = {"*.json"};
+                    char              *path               = tinyfd_saveFileDialog("Export statistics", "espstats.json", 1, lFilterPatterns, "JSON files");
+                    if (path) {
+                        auto json = up->getStatsJson();
+                        if (FILE *f = fopen(path, "wb")) {
+                            fwrite(json.data(), 1, json.size(), f);
+                            fclose(f);
+                        }
+                    }
+                }
+                ImGui::SameLine();
+                ImGui::TextDisabled("Histogram buckets: <1us, <2us, <4us, ... <256ms, >=256ms");
+
+                uint64_t bytesIn  = 0;
+                uint64_t bytesOut = 0;
+                for (auto &stats : up->cmdStats) {
+                    bytesIn += stats.bytesIn;
+                    bytesOut += stats.bytesOut;
+                }
+                ImGui::Text("Bytes in: %llu, out: %llu", (unsigned long long)bytesIn, (unsigned long long)bytesOut);
+                ImGui::Text("High-water: command buffer %u, response buffer %u", up->rxHighWater.load(), up->txHighWater.load());
+
+                auto statsTable = [](const char *id, const char *firstColumn, UartProtocol::CmdStats *table, int numEntries, const std::function<std::string(int)> &getName) {
+                    if (!ImGui::BeginTable(id, 6, ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersV | ImGuiTableFlags_BordersOuter))
+                        return;
+
+                    ImGui::TableSetupColumn(firstColumn, ImGuiTableColumnFlags_WidthFixed);
+                    ImGui::TableSetupColumn("Count", ImGuiTableColumnFlags_WidthFixed);
+                    ImGui::TableSetupColumn("Avg (us)", ImGuiTableColumnFlags_WidthFixed);
+                    ImGui::TableSetupColumn("Bytes in", ImGuiTableColumnFlags_WidthFixed);
+                    ImGui::TableSetupColumn("Bytes out", ImGuiTableColumnFlags_WidthFixed);
+                    ImGui::TableSetupColumn("Histogram", ImGuiTableColumnFlags_WidthStretch);
+                    ImGui::TableSetupScrollFreeze(0, 1);
+                    ImGui::TableHeadersRow();
+
+                    for (int idx = 0; idx < numEntries; idx++) {
+                        auto    &stats = table[idx];
+                        unsigned count = stats.count;
+                        if (count == 0)
+                            continue;
+
+                        float buckets[UartProtocol::LATENCY_BUCKETS];
+                        for (int i = 0; i < UartProtocol::LATENCY_BUCKETS; i++)
+                            buckets[i] = (float)stats.buckets[i];
+
+                        ImGui::TableNextRow();
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%s", getName(idx).c_str());
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%u", count);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.1f", (double)stats.totalUs / count);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%llu", (unsigned long long)stats.bytesIn);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%llu", (unsigned long long)stats.bytesOut);
+                        ImGui::TableNextColumn();
+                        ImGui::PushID(idx);
+                        ImGui::PlotHistogram("", buckets, UartProtocol::LATENCY_BUCKETS, 0, nullptr, 0.0f, FLT_MAX, ImVec2(-FLT_MIN, ImGui::GetTextLineHeight()));
+                        ImGui::PopID();
+                    }
+                    ImGui::EndTable();
+                };
+
+                statsTable("Table3", "Command", up->cmdStats, 256, [](int cmd) {
+                    auto name = UartProtocol::getCommandName(cmd);
+                    if (name)
+                        return std::string(name);
+                    char tmp[8];
+                    snprintf(tmp, sizeof(tmp), "$%02X", cmd);
+                    return std::string(tmp);
+                });
+                ImGui::TextDisabled("File command execution time per storage backend");
+                statsTable("Table4", "Backend", up->backendStats, UartProtocol::BACKEND_COUNT, [](int backend) {
+                    return std::string(UartProtocol::getBackendName(backend));
+                });
+            }
+            ImGui::SeparatorText("Read benchmark");
+            {
+                ImGui::SetNextItemWidth(-FLT_MIN);
+                ImGui::InputTextWithHint("##benchPath", "Large file on the SD card, e.g. /demos/video.bin", espBenchPath, sizeof(espBenchPath));
+                for (int bytewise = 0; bytewise < 2; bytewise++) {
+                    if (bytewise)
+                        ImGui::SameLine();
+                    if (ImGui::Button(bytewise ? "Run (per byte)" : "Run (spans)")) {
+                        double result = UartProtocol::instance()->benchmarkRead(espBenchPath, bytewise != 0);
+                        char   tmp[64];
+                        if (result < 0)
+                            snprintf(tmp, sizeof(tmp), "Error %d", (int)result);
+                        else
+                            snprintf(tmp, sizeof(tmp), "%.1f MB/s (%s)", result / (1024.0 * 1024.0), bytewise ? "per byte" : "spans");
+                        espBenchResult = tmp;
+                    }
+                }
+                if (!espBenchResult.empty()) {
+                    ImGui::SameLine();
+                    ImGui::Text("%s", espBenchResult.c_str());
+                }
+            }
+            ImGui::SeparatorText("Queue benchmark");
+            {
+                if (ImGui::Button("Run##queue")) {
+                    espQueueBenchResult.clear();
+                    for (unsigned threads : {1, 2, 4}) {
+                        char tmp[64];
+                        snprintf(tmp, sizeof(tmp), "%s%ux%u: %.2fM msg/s", espQueueBenchResult.empty() ? "" : ", ", threads, threads, FreeRtosMock_benchmarkQueue(threads, threads) / 1e6);
+                        espQueueBenchResult += tmp;
+                    }
+                }
+                ImGui::SameLine();
+                if (espQueueBenchResult.empty())
+                    ImGui::TextDisabled("Senders x receivers contending for one FreeRTOS queue");
+                else
+                    ImGui::Text("%s", espQueueBenchResult.c_str());
+            }
         }
         ImGui::End();
     }
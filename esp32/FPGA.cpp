@@ -256,6 +256,27 @@ public:
 #endif
     }
 
+    // Single command with payload and optional response
+    void spiCommand(uint8_t cmd, const void *data, size_t length, void *rxBuf = nullptr, size_t rxLength = 0) {
+#ifndef EMULATOR
+        spiSel(true);
+        spiTx(&cmd, 1);
+        if (length > 0)
+            spiTx(data, length);
+        if (rxLength > 0)
+            spiRx(rxBuf, rxLength);
+        spiSel(false);
+#else
+        if (rxLength > 0)
+            memset(rxBuf, 0, rxLength);
+
+        auto emuState = EmuState::get();
+        if (emuState) {
+            emuState->spiTransaction(cmd, static_cast<const uint8_t *>(data), length, static_cast<uint8_t *>(rxBuf), rxLength);
+        }
+#endif
+    }
+
 #ifdef CONFIG_MACHINE_TYPE_MORPHBOOK
     uint64_t getKeys() override {
         uint64_t result;
@@ -290,11 +311,8 @@ public:
             // Sysinfo
             {
                 uint8_t rxData[8];
-                uint8_t cmd[] = {CMD_GET_SYSINFO, 0};
-                spiSel(true);
-                spiTx(cmd, sizeof(cmd));
-                spiRx(rxData, 8);
-                spiSel(false);
+                uint8_t dummy = 0;
+                spiCommand(CMD_GET_SYSINFO, &dummy, 1, rxData, 8);
 
                 info->coreType     = rxData[0];
                 info->flags        = rxData[1];
@@ -311,22 +329,14 @@ public:
 
             // Name1
             {
-                uint8_t cmd[] = {CMD_GET_NAME1, 0};
-
-                spiSel(true);
-                spiTx(cmd, sizeof(cmd));
-                spiRx(info->name, 8);
-                spiSel(false);
+                uint8_t dummy = 0;
+                spiCommand(CMD_GET_NAME1, &dummy, 1, info->name, 8);
             }
 
             // Name2
             {
-                uint8_t cmd[] = {CMD_GET_NAME2, 0};
-
-                spiSel(true);
-                spiTx(cmd, sizeof(cmd));
-                spiRx(info->name + 8, 8);
-                spiSel(false);
+                uint8_t dummy = 0;
+                spiCommand(CMD_GET_NAME2, &dummy, 1, info->name + 8, 8);
             }
             info->name[16] = 0;
 
@@ -341,29 +351,17 @@ public:
 
     void setOverlayText(const uint16_t buf[1024]) override {
         RecursiveMutexLock lock(mutex);
-        spiSel(true);
-        uint8_t cmd[] = {CMD_OVL_TEXT};
-        spiTx(cmd, sizeof(cmd));
-        spiTx(buf, 2 * 1024);
-        spiSel(false);
+        spiCommand(CMD_OVL_TEXT, buf, 2 * 1024);
     }
 
     void setOverlayFont(const uint8_t buf[2048]) override {
         RecursiveMutexLock lock(mutex);
-        spiSel(true);
-        uint8_t cmd[] = {CMD_OVL_FONT};
-        spiTx(cmd, sizeof(cmd));
-        spiTx(buf, 2048);
-        spiSel(false);
+        spiCommand(CMD_OVL_FONT, buf, 2048);
     }
 
     void setOverlayPalette(const uint16_t buf[16]) override {
         RecursiveMutexLock lock(mutex);
-        spiSel(true);
-        uint8_t cmd[] = {CMD_OVL_PALETTE};
-        spiTx(cmd, sizeof(cmd));
-        spiTx(buf, 2 * 16);
-        spiSel(false);
+        spiCommand(CMD_OVL_PALETTE, buf, 2 * 16);
     }
 
 #ifndef EMULATOR
@@ -156,6 +156,11 @@ public:
         }
     }
 
+    void cancelBypassStart() override {
+        RecursiveMutexLock lock(mutex);
+        bypassStartCancel = true;
+    }
+
     void aqpForceTurbo(bool en) {
         auto               fpga = FPGA::instance();
         RecursiveMutexLock lock(fpga->getMutex());
@@ -21,6 +21,7 @@ enum class FpgaCoreType {
 class FpgaCore {
 public:
     virtual void resetCore() {}
+    virtual void cancelBypassStart() {}
     virtual bool keyScancode(uint8_t modifiers, unsigned scanCode, bool keyDown) { return false; }
     virtual void keyChar(uint8_t ch, bool isRepeat, uint8_t modifiers) {}
     virtual void mouseReport(int dx, int dy, uint8_t buttonMask, int dWheel, bool absPos = false) {}
@@ -5,6 +5,10 @@
 #include <driver/uart.h>
 #else
 #include "EmuState.h"
+#include "cJSON.h"
+#include <chrono>
+#include <condition_variable>
+#include <thread>
 #endif
 
 #include "VFS.h"
@@ -44,14 +48,33 @@ public:
     uint8_t       txBuf[256];
     int           txBufIdx = 0;
 #else
-    uint8_t  txBuf[16 + 0x10000];
-    unsigned txBufWrIdx = 0;
-    unsigned txBufRdIdx = 0;
-    unsigned txBufCnt   = 0;
+    // Single producer/single consumer ring, file commands can be answered from the I/O thread
+    uint8_t               txBuf[16 + 0x10000];
+    unsigned              txBufWrIdx = 0;
+    unsigned              txBufRdIdx = 0;
+    std::atomic<unsigned> txBufCnt{0};
+    size_t                txPending = 0; // Response bytes written behind txBufWrIdx, published by txBufFlush()
+
+    bool                              asyncIo = false;
+    std::thread                       ioThread;
+    std::mutex                        ioQueueMutex;
+    std::condition_variable           ioQueueCv;
+    std::deque<std::function<void()>> ioQueue;
+    bool                              ioBusy     = false;
+    bool                              ioDeferred = false;
+
+    // Command the response bytes written by the current thread are attributed to
+    static inline thread_local uint8_t  txCmd          = 0;
+    static inline thread_local uint64_t txBackendBytes = 0;
 #endif
     uint8_t     rxBuf[16 + 0x10000];
     int         rxBufIdx = -1;
     const char *newPath  = nullptr;
+#ifdef EMULATOR
+    uint8_t ioBuf[0x10000]; // Response data of file commands
+#else
+    uint8_t *const ioBuf = rxBuf;
+#endif
 
     UartProtocolInt() {
     }
@@ -118,26 +141,346 @@ public:
     }
 
     uint8_t readCtrl() override {
-        uint8_t result = 0;
-        if (txBufCnt > 0) {
-            result |= 1;
+        return status.load(std::memory_order_relaxed);
+    }
+
+    unsigned readAvailable() override {
+        return txBufCnt.load(std::memory_order_acquire);
+    }
+
+    size_t readData(void *buf, size_t length) override {
+        auto   p      = static_cast<uint8_t *>(buf);
+        size_t result = 0;
+        while (result < length) {
+            size_t spanLen;
+            auto   span = readSpan(&spanLen);
+            if (spanLen == 0)
+                break;
+            spanLen = std::min(spanLen, length - result);
+            memcpy(p + result, span, spanLen);
+            readConsume(spanLen);
+            result += spanLen;
         }
         return result;
     }
 
+    const uint8_t *readSpan(size_t *length) override {
+        *length = std::min((size_t)txBufCnt.load(std::memory_order_acquire), sizeof(txBuf) - txBufRdIdx);
+        return txBuf + txBufRdIdx;
+    }
+
+    void readConsume(size_t length) override {
+        if (length == 0)
+            return;
+
+        txBufRdIdx = (unsigned)((txBufRdIdx + length) % sizeof(txBuf));
+        if (txBufCnt.fetch_sub((unsigned)length, std::memory_order_acq_rel) == length) {
+            status.store(0, std::memory_order_relaxed);
+
+            // The I/O thread might have written data in the meantime
+            if (txBufCnt.load(std::memory_order_acquire) > 0)
+                status.store(1, std::memory_order_relaxed);
+        }
+    }
+
     int txFifoRead() {
-        int result = -1;
-        if (txBufCnt > 0) {
-            result = txBuf[txBufRdIdx++];
-            txBufCnt--;
-            if (txBufRdIdx >= sizeof(txBuf)) {
-                txBufRdIdx = 0;
+        size_t length;
+        auto   span = readSpan(&length);
+        if (length == 0)
+            return -1;
+
+        int result = *span;
+        readConsume(1);
+        return result;
+    }
+
+    // Contiguous free space in the ring, 'offset' bytes past the write position. Data placed there
+    // becomes visible to the reader on txCommit().
+    uint8_t *txSpan(size_t offset, size_t *length) {
+        size_t avail = sizeof(txBuf) - txBufCnt.load(std::memory_order_acquire);
+        if (offset >= avail) {
+            *length = 0;
+            return nullptr;
+        }
+        size_t idx = (txBufWrIdx + offset) % sizeof(txBuf);
+        *length    = std::min(avail - offset, sizeof(txBuf) - idx);
+        return txBuf + idx;
+    }
+
+    void txCommit(size_t length) {
+        txBufWrIdx = (unsigned)((txBufWrIdx + length) % sizeof(txBuf));
+        recordTx(txBufCnt.fetch_add((unsigned)length, std::memory_order_release) + (unsigned)length, length);
+        status.store(1, std::memory_order_relaxed);
+    }
+
+    // ESPCMD_READ with the file data read straight into the response ring, behind the 3 byte header
+    void cmdReadBulk(uint8_t fd, uint16_t size) {
+        auto   vfsCtx = VFSContext::getDefault();
+        size_t done   = 0;
+        int    result = 0;
+        while (done < size) {
+            size_t length;
+            auto   p = txSpan(txPending + 3 + done, &length);
+            length   = std::min(length, size - done);
+            result   = vfsCtx->read(fd, length, p);
+            if (result <= 0)
+                break;
+            done += result;
+            if ((size_t)result < length)
+                break;
+        }
+        if (result < 0 && done == 0) {
+            txWrite(result);
+            return;
+        }
+
+        const uint8_t header[3] = {0, (uint8_t)(done & 0xFF), (uint8_t)(done >> 8)};
+        for (size_t i = 0; i < sizeof(header); i++) {
+            size_t length;
+            *txSpan(txPending + i, &length) = header[i];
+        }
+        txPending += sizeof(header) + done;
+    }
+
+    double benchmarkRead(const std::string &path, bool bytewise) override {
+        waitIoIdle();
+        std::lock_guard lock(ioMutex);
+        txCmd = ESPCMD_READ;
+
+        // Don't interfere with a response the guest hasn't read yet
+        if (txBufCnt.load(std::memory_order_acquire) > 0)
+            return ERR_OTHER;
+
+        auto vfsCtx = VFSContext::getDefault();
+        int  fd     = vfsCtx->open(FO_RDONLY, path);
+        if (fd < 0)
+            return fd;
+
+        static uint8_t dst[0x10000];
+        uint64_t       total = 0;
+        auto           start = std::chrono::steady_clock::now();
+        while (1) {
+            cmdRead(fd, 0xFFFF);
+            txBufFlush();
+
+            uint8_t header[3];
+            if (readData(header, 1) != 1 || header[0] != 0 || readData(header + 1, 2) != 2)
+                break;
+            size_t length = header[1] | (header[2] << 8);
+            if (length == 0)
+                break;
+
+            if (bytewise) {
+                for (size_t i = 0; i < length; i++)
+                    dst[i] = readData();
+            } else {
+                size_t done = 0;
+                while (done < length) {
+                    size_t spanLen;
+                    auto   span = readSpan(&spanLen);
+                    spanLen     = std::min(spanLen, length - done);
+                    memcpy(dst + done, span, spanLen);
+                    readConsume(spanLen);
+                    done += spanLen;
+                }
+            }
+            total += length;
+        }
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        vfsCtx->close(fd);
+
+        // Discard whatever is left of an incomplete response
+        while (readAvailable() > 0) {
+            size_t length;
+            readSpan(&length);
+            readConsume(length);
+        }
+        return elapsed > 0 ? total / elapsed : 0;
+    }
+
+    void setAsyncIo(bool enable) override {
+        if (!enable)
+            waitIoIdle();
+        else if (!ioThread.joinable())
+            ioThread = std::thread(&UartProtocolInt::ioThreadFunc, this);
+        asyncIo = enable;
+    }
+
+    void ioThreadFunc() {
+        std::unique_lock lock(ioQueueMutex);
+        while (1) {
+            ioQueueCv.wait(lock, [this] { return !ioQueue.empty(); });
+            auto fn = std::move(ioQueue.front());
+            ioQueue.pop_front();
+            ioBusy = true;
+            lock.unlock();
+            {
+                std::lock_guard ioLock(ioMutex);
+                fn();
+            }
+            lock.lock();
+            ioBusy = false;
+            ioQueueCv.notify_all();
+        }
+    }
+
+    void waitIoIdle() {
+        std::unique_lock lock(ioQueueMutex);
+        ioQueueCv.wait(lock, [this] { return ioQueue.empty() && !ioBusy; });
+    }
+
+    static void addLatency(CmdStats &stats, std::chrono::steady_clock::time_point start) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+        unsigned bucket = 0;
+        while (bucket < LATENCY_BUCKETS - 1 && us >= (1LL << bucket))
+            bucket++;
+
+        stats.count++;
+        stats.totalUs += us;
+        stats.buckets[bucket]++;
+    }
+
+    void recordLatency(uint8_t cmd, std::chrono::steady_clock::time_point start) {
+        addLatency(cmdStats[cmd], start);
+    }
+
+    static int getBackend(VFS *vfs) {
+        if (vfs == getFatImageVFS())
+            return BACKEND_SDIMAGE;
+        if (vfs == getEspVFS())
+            return BACKEND_ESP;
+        if (vfs == getHttpVFS())
+            return BACKEND_HTTP;
+        if (vfs == getTcpVFS())
+            return BACKEND_TCP;
+        return BACKEND_SDCARD;
+    }
+
+    // Run a file command, attributing its execution time and response bytes to the VFS backend it
+    // accessed. Commands that don't reach a backend (e.g. READDIR) aren't counted.
+    void runTimed(uint8_t cmd, const std::function<void()> &fn) {
+        auto vfsCtx     = VFSContext::getDefault();
+        vfsCtx->lastVfs = nullptr;
+        txCmd           = cmd;
+        txBackendBytes  = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        txBufFlush();
+        if (vfsCtx->lastVfs) {
+            auto &stats = backendStats[getBackend(vfsCtx->lastVfs)];
+            addLatency(stats, start);
+            stats.bytesOut += txBackendBytes;
+        }
+    }
+
+    // Called by the producer after adding 'length' bytes, 'count' being the new fill level
+    void recordTx(unsigned count, size_t length) {
+        cmdStats[txCmd].bytesOut.fetch_add(length, std::memory_order_relaxed);
+        txBackendBytes += length;
+        if (count > txHighWater.load(std::memory_order_relaxed))
+            txHighWater.store(count, std::memory_order_relaxed);
+    }
+
+    void resetStats() override {
+        auto reset = [](CmdStats &stats) {
+            stats.count   = 0;
+            stats.totalUs = 0;
+            for (auto &bucket : stats.buckets)
+                bucket = 0;
+            stats.bytesIn  = 0;
+            stats.bytesOut = 0;
+        };
+        for (auto &stats : cmdStats)
+            reset(stats);
+        for (auto &stats : backendStats)
+            reset(stats);
+        rxHighWater = 0;
+        txHighWater = 0;
+    }
+
+    std::string getStatsJson() override {
+        auto addStats = [](cJSON *obj, const CmdStats &stats) {
+            unsigned count = stats.count;
+            cJSON_AddNumberToObject(obj, "count", count);
+            cJSON_AddNumberToObject(obj, "totalUs", (double)stats.totalUs);
+            cJSON_AddNumberToObject(obj, "avgUs", count ? (double)stats.totalUs / count : 0.0);
+            cJSON_AddNumberToObject(obj, "bytesIn", (double)stats.bytesIn);
+            cJSON_AddNumberToObject(obj, "bytesOut", (double)stats.bytesOut);
+            auto buckets = cJSON_AddArrayToObject(obj, "histogram");
+            for (auto &bucket : stats.buckets)
+                cJSON_AddItemToArray(buckets, cJSON_CreateNumber(bucket));
+        };
+
+        auto     root     = cJSON_CreateObject();
+        uint64_t bytesIn  = 0;
+        uint64_t bytesOut = 0;
+        auto     commands = cJSON_AddObjectToObject(root, "commands");
+        for (int cmd = 0; cmd < 256; cmd++) {
+            auto &stats = cmdStats[cmd];
+            bytesIn += stats.bytesIn;
+            bytesOut += stats.bytesOut;
+            if (stats.count == 0 && stats.bytesIn == 0 && stats.bytesOut == 0)
+                continue;
+
+            char tmp[8];
+            auto name = getCommandName(cmd);
+            if (!name) {
+                snprintf(tmp, sizeof(tmp), "0x%02X", cmd);
+                name = tmp;
             }
+            addStats(cJSON_AddObjectToObject(commands, name), stats);
+        }
+        auto backends = cJSON_AddObjectToObject(root, "backends");
+        for (int i = 0; i < BACKEND_COUNT; i++) {
+            if (backendStats[i].count > 0)
+                addStats(cJSON_AddObjectToObject(backends, getBackendName(i)), backendStats[i]);
         }
+        cJSON_AddNumberToObject(root, "bytesIn", (double)bytesIn);
+        cJSON_AddNumberToObject(root, "bytesOut", (double)bytesOut);
+        cJSON_AddNumberToObject(root, "rxHighWater", rxHighWater);
+        cJSON_AddNumberToObject(root, "txHighWater", txHighWater);
+        cJSON_AddNumberToObject(root, "rxBufferSize", sizeof(rxBuf));
+        cJSON_AddNumberToObject(root, "txBufferSize", sizeof(txBuf));
+
+        std::string result;
+        if (auto str = cJSON_Print(root)) {
+            result = str;
+            cJSON_free(str);
+        }
+        cJSON_Delete(root);
         return result;
     }
 #endif
 
+    static bool isFileCommand(uint8_t cmd) {
+        return cmd >= ESPCMD_OPEN && cmd <= ESPCMD_LSEEK;
+    }
+
+    // Execute a file command, on the I/O thread when asynchronous I/O is enabled. Arguments
+    // pointing into rxBuf have to be copied by 'fn'.
+    void runFileCmd(std::function<void()> fn) {
+#ifdef EMULATOR
+        if (asyncIo) {
+            uint8_t cmd   = rxBuf[0];
+            auto    start = std::chrono::steady_clock::now();
+
+            std::lock_guard lock(ioQueueMutex);
+            ioQueue.push_back([this, fn = std::move(fn), cmd, start] {
+                runTimed(cmd, fn);
+                recordLatency(cmd, start);
+            });
+            ioQueueCv.notify_all();
+            ioDeferred = true;
+            return;
+        }
+        runTimed(rxBuf[0], fn);
+#else
+        fn();
+#endif
+    }
+
 #ifndef EMULATOR
     static void _uartEventTask(void *param) { static_cast<UartProtocolInt *>(param)->uartEventTask(); }
 
@@ -211,6 +554,12 @@ public:
             uart_write_bytes(UART_NUM, txBuf, txBufIdx);
         }
         txBufIdx = 0;
+#else
+        // Publish the whole response at once, the guest must not see part of it
+        if (txPending > 0) {
+            txCommit(txPending);
+            txPending = 0;
+        }
 #endif
     }
 #ifndef EMULATOR
@@ -235,27 +584,55 @@ public:
             txBufPush(data);
         }
 #else
-        if (txBufCnt >= sizeof(txBuf))
+        size_t length;
+        auto   p = txSpan(txPending, &length);
+        if (length == 0)
             return;
-
-        txBuf[txBufWrIdx++] = data;
-        txBufCnt++;
-        if (txBufWrIdx >= sizeof(txBuf)) {
-            txBufWrIdx = 0;
-        }
+        *p = data;
+        txPending++;
 #endif
     }
     void txWrite(const void *buf, size_t length) override {
         auto p = static_cast<const uint8_t *>(buf);
+#ifndef EMULATOR
         while (length--)
             txWrite(*(p++));
+#else
+        // Data that doesn't fit is dropped, like with single byte writes
+        size_t done = 0;
+        while (done < length) {
+            size_t spanLen;
+            auto   span = txSpan(txPending, &spanLen);
+            if (spanLen == 0)
+                break;
+            spanLen = std::min(spanLen, length - done);
+            memcpy(span, p + done, spanLen);
+            txPending += spanLen;
+            done += spanLen;
+        }
+#endif
     }
 
     void receivedByte(uint8_t data) {
+#ifdef EMULATOR
+        // Other commands run on this thread, so let pending file commands finish first
+        if (asyncIo && rxBufIdx == 0 && !isFileCommand(data))
+            waitIoIdle();
+
+        auto start = std::chrono::steady_clock::now();
+        ioDeferred = false;
+#endif
+
         rxBuf[rxBufIdx] = data;
         if (rxBufIdx < (int)sizeof(rxBuf) - 1) {
             rxBufIdx++;
         }
+#ifdef EMULATOR
+        cmdStats[rxBuf[0]].bytesIn.fetch_add(1, std::memory_order_relaxed);
+        if ((unsigned)rxBufIdx > rxHighWater.load(std::memory_order_relaxed))
+            rxHighWater.store(rxBufIdx, std::memory_order_relaxed);
+        txCmd = rxBuf[0];
+#endif
         // ESP_LOG_BUFFER_HEXDUMP(TAG, rxBuf, rxBufIdx, ESP_LOG_INFO);
 
         switch (rxBuf[0]) {
@@ -301,7 +678,7 @@ public:
                 if (data == 0 && rxBufIdx >= 3) {
                     uint8_t     flags   = rxBuf[1];
                     const char *pathArg = (const char *)&rxBuf[2];
-                    cmdOpen(flags, pathArg);
+                    runFileCmd([=, path = std::string(pathArg)] { cmdOpen(flags, path.c_str()); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -309,7 +686,7 @@ public:
             case ESPCMD_CLOSE: {
                 if (rxBufIdx == 2) {
                     uint8_t fd = rxBuf[1];
-                    cmdClose(fd);
+                    runFileCmd([=] { cmdClose(fd); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -318,7 +695,7 @@ public:
                 if (rxBufIdx == 4) {
                     uint8_t  fd   = rxBuf[1];
                     uint16_t size = rxBuf[2] | (rxBuf[3] << 8);
-                    cmdRead(fd, size);
+                    runFileCmd([=] { cmdRead(fd, size); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -329,7 +706,7 @@ public:
                     unsigned    size = rxBuf[2] | (rxBuf[3] << 8);
                     const void *buf  = &rxBuf[4];
                     if (rxBufIdx == (int)(4 + size)) {
-                        cmdWrite(fd, size, buf);
+                        runFileCmd([=, data = std::vector<uint8_t>((const uint8_t *)buf, (const uint8_t *)buf + size)] { cmdWrite(fd, size, data.data()); });
                         rxBufIdx = 0;
                     }
                 }
@@ -339,7 +716,7 @@ public:
                 if (rxBufIdx == 6) {
                     uint8_t  fd     = rxBuf[1];
                     uint32_t offset = (rxBuf[2] << 0) | (rxBuf[3] << 8) | (rxBuf[4] << 16) | (rxBuf[5] << 24);
-                    cmdSeek(fd, offset);
+                    runFileCmd([=] { cmdSeek(fd, offset); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -349,7 +726,7 @@ public:
                     uint8_t fd     = rxBuf[1];
                     int     offset = (int)((rxBuf[2] << 0) | (rxBuf[3] << 8) | (rxBuf[4] << 16) | (rxBuf[5] << 24));
                     int     whence = rxBuf[6];
-                    cmdLSeek(fd, offset, whence);
+                    runFileCmd([=] { cmdLSeek(fd, offset, whence); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -357,7 +734,7 @@ public:
             case ESPCMD_TELL: {
                 if (rxBufIdx == 2) {
                     uint8_t fd = rxBuf[1];
-                    cmdTell(fd);
+                    runFileCmd([=] { cmdTell(fd); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -367,7 +744,7 @@ public:
                 // Wait for zero-termination of path
                 if (data == 0) {
                     const char *pathArg = (const char *)&rxBuf[1];
-                    cmdOpenDirExt(pathArg, 0, 0);
+                    runFileCmd([=, path = std::string(pathArg)] { cmdOpenDirExt(path.c_str(), 0, 0); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -376,7 +753,7 @@ public:
                 // Wait for zero-termination of path
                 if (data == 0) {
                     const char *pathArg = (const char *)&rxBuf[1];
-                    cmdOpenDirExt(pathArg, DE_FLAG_MODE83, 0);
+                    runFileCmd([=, path = std::string(pathArg)] { cmdOpenDirExt(path.c_str(), DE_FLAG_MODE83, 0); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -386,7 +763,7 @@ public:
                     uint8_t     flags     = rxBuf[1];
                     uint16_t    skipCount = rxBuf[2] | (rxBuf[3] << 8);
                     const char *pathArg   = (const char *)&rxBuf[4];
-                    cmdOpenDirExt(pathArg, flags, skipCount);
+                    runFileCmd([=, path = std::string(pathArg)] { cmdOpenDirExt(path.c_str(), flags, skipCount); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -394,7 +771,7 @@ public:
             case ESPCMD_CLOSEDIR: {
                 if (rxBufIdx == 2) {
                     uint8_t dd = rxBuf[1];
-                    cmdCloseDir(dd);
+                    runFileCmd([=] { cmdCloseDir(dd); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -402,7 +779,7 @@ public:
             case ESPCMD_READDIR: {
                 if (rxBufIdx == 2) {
                     uint8_t dd = rxBuf[1];
-                    cmdReadDir(dd);
+                    runFileCmd([=] { cmdReadDir(dd); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -411,7 +788,7 @@ public:
                 // Wait for zero-termination of path
                 if (data == 0) {
                     const char *pathArg = (const char *)&rxBuf[1];
-                    cmdDelete(pathArg);
+                    runFileCmd([=, path = std::string(pathArg)] { cmdDelete(path.c_str()); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -426,7 +803,7 @@ public:
                     if (newPath == nullptr) {
                         newPath = (const char *)&rxBuf[rxBufIdx];
                     } else {
-                        cmdRename(oldPath, newPath);
+                        runFileCmd([=, oldArg = std::string(oldPath), newArg = std::string(newPath)] { cmdRename(oldArg.c_str(), newArg.c_str()); });
                         newPath  = nullptr;
                         rxBufIdx = 0;
                     }
@@ -436,7 +813,7 @@ public:
             case ESPCMD_MKDIR: {
                 // Wait for zero-termination of path
                 if (data == 0) {
-                    cmdMkDir((const char *)&rxBuf[1]);
+                    runFileCmd([=, path = std::string((const char *)&rxBuf[1])] { cmdMkDir(path.c_str()); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -444,7 +821,7 @@ public:
             case ESPCMD_CHDIR: {
                 // Wait for zero-termination of path
                 if (data == 0) {
-                    cmdChDir((const char *)&rxBuf[1]);
+                    runFileCmd([=, path = std::string((const char *)&rxBuf[1])] { cmdChDir(path.c_str()); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -452,18 +829,18 @@ public:
             case ESPCMD_STAT: {
                 // Wait for zero-termination of path
                 if (data == 0) {
-                    cmdStat((const char *)&rxBuf[1]);
+                    runFileCmd([=, path = std::string((const char *)&rxBuf[1])] { cmdStat(path.c_str()); });
                     rxBufIdx = 0;
                 }
                 break;
             }
             case ESPCMD_GETCWD: {
-                cmdGetCwd();
+                runFileCmd([=] { cmdGetCwd(); });
                 rxBufIdx = 0;
                 break;
             }
             case ESPCMD_CLOSEALL: {
-                cmdCloseAll();
+                runFileCmd([=] { cmdCloseAll(); });
                 rxBufIdx = 0;
                 break;
             }
@@ -471,7 +848,7 @@ public:
                 if (rxBufIdx == 4) {
                     uint8_t  fd   = rxBuf[1];
                     uint16_t size = rxBuf[2] | (rxBuf[3] << 8);
-                    cmdReadLine(fd, size);
+                    runFileCmd([=] { cmdReadLine(fd, size); });
                     rxBufIdx = 0;
                 }
                 break;
@@ -501,6 +878,15 @@ public:
             }
         }
 
+#ifdef EMULATOR
+        if (rxBufIdx == 0 && !ioDeferred)
+            recordLatency(rxBuf[0], start);
+
+        // File commands answer from the I/O thread, which owns txPending and flushes it itself
+        if (asyncIo && isFileCommand(rxBuf[0]))
+            return;
+#endif
+
         txBufFlush();
     }
 
@@ -598,26 +984,32 @@ public:
     void cmdRead(uint8_t fd, uint16_t size) {
         DBGF("READ(fd=%u, size=%u)", fd, size);
         txStart();
-        int result = VFSContext::getDefault()->read(fd, size, rxBuf);
+#ifdef EMULATOR
+        if (sizeof(txBuf) - txBufCnt.load(std::memory_order_acquire) - txPending >= 3U + size) {
+            cmdReadBulk(fd, size);
+            return;
+        }
+#endif
+        int result = VFSContext::getDefault()->read(fd, size, ioBuf);
         if (result < 0) {
             txWrite(result);
         } else {
             txWrite(0);
             txWrite((result >> 0) & 0xFF);
             txWrite((result >> 8) & 0xFF);
-            txWrite(rxBuf, result);
+            txWrite(ioBuf, result);
         }
     }
     void cmdReadLine(uint8_t fd, uint16_t size) {
         DBGF("READLINE(fd=%u, size=%u)", fd, size);
         txStart();
-        int result = VFSContext::getDefault()->readline(fd, size, rxBuf);
+        int result = VFSContext::getDefault()->readline(fd, size, ioBuf);
         if (result < 0) {
             txWrite(result);
         } else {
             txWrite(0);
 
-            const uint8_t *p = rxBuf;
+            const uint8_t *p = ioBuf;
             while (*p) {
                 if (*p == '\r' || *p == '\n')
                     break;
@@ -801,6 +1193,53 @@ public:
     }
 };
 
+#ifdef EMULATOR
+const char *UartProtocol::getCommandName(uint8_t cmd) {
+    switch (cmd) {
+        case ESPCMD_RESET: return "RESET";
+        case ESPCMD_VERSION: return "VERSION";
+        case ESPCMD_GETDATETIME: return "GETDATETIME";
+        case ESPCMD_KEYMODE: return "KEYMODE";
+        case ESPCMD_GETMOUSE: return "GETMOUSE";
+        case ESPCMD_GETGAMECTRL: return "GETGAMECTRL";
+        case ESPCMD_GETMIDIDATA: return "GETMIDIDATA";
+        case ESPCMD_OPEN: return "OPEN";
+        case ESPCMD_CLOSE: return "CLOSE";
+        case ESPCMD_READ: return "READ";
+        case ESPCMD_WRITE: return "WRITE";
+        case ESPCMD_SEEK: return "SEEK";
+        case ESPCMD_TELL: return "TELL";
+        case ESPCMD_OPENDIR: return "OPENDIR";
+        case ESPCMD_CLOSEDIR: return "CLOSEDIR";
+        case ESPCMD_READDIR: return "READDIR";
+        case ESPCMD_DELETE: return "DELETE";
+        case ESPCMD_RENAME: return "RENAME";
+        case ESPCMD_MKDIR: return "MKDIR";
+        case ESPCMD_CHDIR: return "CHDIR";
+        case ESPCMD_STAT: return "STAT";
+        case ESPCMD_GETCWD: return "GETCWD";
+        case ESPCMD_CLOSEALL: return "CLOSEALL";
+        case ESPCMD_OPENDIR83: return "OPENDIR83";
+        case ESPCMD_READLINE: return "READLINE";
+        case ESPCMD_OPENDIREXT: return "OPENDIREXT";
+        case ESPCMD_LSEEK: return "LSEEK";
+        case ESPCMD_LOADFPGA: return "LOADFPGA";
+        default: return nullptr;
+    }
+}
+
+const char *UartProtocol::getBackendName(int backend) {
+    switch (backend) {
+        case BACKEND_SDCARD: return "SD card";
+        case BACKEND_SDIMAGE: return "SD card image";
+        case BACKEND_ESP: return "ESP";
+        case BACKEND_HTTP: return "HTTP";
+        case BACKEND_TCP: return "TCP";
+        default: return nullptr;
+    }
+}
+#endif
+
 UartProtocol *UartProtocol::instance() {
     static UartProtocolInt *obj = nullptr;
     if (obj == nullptr) {
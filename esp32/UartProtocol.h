@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Common.h"
+#include <atomic>
 
 enum {
     ESPCMD_RESET       = 0x01, // Indicate to ESP that system has been reset
@@ -47,9 +48,66 @@ public:
 
 #ifdef EMULATOR
     // Emulator interface
-    virtual void    writeCtrl(uint8_t data) = 0;
-    virtual void    writeData(uint8_t data) = 0;
-    virtual uint8_t readCtrl()              = 0;
-    virtual uint8_t readData()              = 0;
+    virtual void     writeCtrl(uint8_t data)            = 0;
+    virtual void     writeData(uint8_t data)            = 0;
+    virtual uint8_t  readCtrl()                         = 0;
+    virtual uint8_t  readData()                         = 0;
+    virtual unsigned readAvailable()                    = 0;
+    virtual size_t   readData(void *buf, size_t length) = 0;
+
+    // Bulk access to the response data: returns the contiguous readable part of the response
+    // buffer, which stays valid until it is consumed with readConsume().
+    virtual const uint8_t *readSpan(size_t *length)   = 0;
+    virtual void           readConsume(size_t length) = 0;
+
+    // Same value as readCtrl(), but cheap enough to be sampled by the cores every instruction
+    uint8_t getStatus() const { return status.load(std::memory_order_relaxed); }
+
+    // Execute file commands on a separate I/O thread, so slow storage doesn't stall the emulation.
+    // The response becomes visible to the guest once the command has completed.
+    virtual void setAsyncIo(bool enable) = 0;
+
+    // Held while file commands execute, lock it before inspecting the VFS state from another thread
+    std::mutex ioMutex;
+
+    // Command latency statistics. Bucket n counts latencies below 2^n microseconds, the last bucket
+    // everything above.
+    enum { LATENCY_BUCKETS = 20 };
+    struct CmdStats {
+        std::atomic<uint32_t> count{0};
+        std::atomic<uint64_t> totalUs{0};
+        std::atomic<uint32_t> buckets[LATENCY_BUCKETS] = {};
+        std::atomic<uint64_t> bytesIn{0};  // Command bytes received from the guest
+        std::atomic<uint64_t> bytesOut{0}; // Response bytes sent to the guest
+    };
+    CmdStats cmdStats[256];
+
+    // File command execution time per VFS backend, not including time spent queued for the I/O
+    // thread. Bytes are the response bytes of these commands.
+    enum Backend {
+        BACKEND_SDCARD,
+        BACKEND_SDIMAGE,
+        BACKEND_ESP,
+        BACKEND_HTTP,
+        BACKEND_TCP,
+        BACKEND_COUNT,
+    };
+    CmdStats backendStats[BACKEND_COUNT];
+
+    // Highest fill level seen of the command and response buffers
+    std::atomic<unsigned> rxHighWater{0};
+    std::atomic<unsigned> txHighWater{0};
+
+    static const char *getCommandName(uint8_t cmd);
+    static const char *getBackendName(int backend);
+    virtual void        resetStats()   = 0;
+    virtual std::string getStatsJson() = 0;
+
+    // Measure throughput of large sequential reads of 'path' through the ESPCMD_READ handler and
+    // response buffer, draining it per byte or in spans. Returns bytes per second or an error code.
+    virtual double benchmarkRead(const std::string &path, bool bytewise) = 0;
+
+protected:
+    std::atomic<uint8_t> status{0};
 #endif
 };
@@ -21,37 +21,115 @@ struct FileEntry {
 };
 #pragma pack(pop)
 
-struct OpenFile {
-    const FileEntry     *fe     = nullptr;
-    unsigned             offset = 0;
-    std::vector<uint8_t> data;
-};
+#include <list>
+#include <unordered_map>
 
-static const FileEntry *findFile(const std::string &_path) {
-    // Skip leading slashes
-    auto idx = _path.find_first_not_of('/');
+// Maximum number of simultaneously open files
+#define ESPVFS_MAX_FDS (4)
+
+// Total size of decompressed files that are kept around after being closed
+#ifdef EMULATOR
+#define ESPVFS_CACHE_SIZE (16 * 1024 * 1024)
+#else
+#define ESPVFS_CACHE_SIZE (0)
+#endif
+
+// Amount of compressed input fed to the decompressor at a time
+#define ESPVFS_XZ_CHUNK (4096)
+
+static std::string toUpper(std::string s) {
+    for (auto &ch : s)
+        ch = toupper(ch);
+    return s;
+}
+
+static std::string stripLeadingSlashes(const std::string &path) {
+    auto idx = path.find_first_not_of('/');
     if (idx == std::string::npos) {
-        idx = _path.size();
+        idx = path.size();
     }
-    auto path = _path.substr(idx);
+    return path.substr(idx);
+}
 
-    // Find file
-    const uint8_t *p = romfs_start;
-    while (1) {
-        const FileEntry *fe = (const FileEntry *)p;
-        if (fe->recSize == 0)
-            break;
-        p += fe->recSize;
+static const FileEntry *findFile(const std::string &_path) {
+    // Index of the romfs table, built on first use
+    static const auto index = []() {
+        std::unordered_map<std::string, const FileEntry *> result;
 
-        if (strcasecmp(path.c_str(), fe->filename) == 0)
-            return fe;
-    }
-    return nullptr;
+        const uint8_t *p = romfs_start;
+        while (1) {
+            const FileEntry *fe = (const FileEntry *)p;
+            if (fe->recSize == 0)
+                break;
+            p += fe->recSize;
+
+            result.emplace(toUpper(fe->filename), fe);
+        }
+        return result;
+    }();
+
+    auto it = index.find(toUpper(stripLeadingSlashes(_path)));
+    return (it != index.end()) ? it->second : nullptr;
 }
 
+// File that is decompressed on demand while it is being read
+struct DecompressedFile {
+    DecompressedFile(const FileEntry *_fe)
+        : fe(_fe) {
+        data.resize(fe->fsize);
+
+        dec        = xz_stream_init();
+        b.in       = romfs_start + fe->offset;
+        b.in_pos   = 0;
+        b.in_size  = 0;
+        b.out      = data.data();
+        b.out_pos  = 0;
+        b.out_size = (unsigned)data.size();
+    }
+    ~DecompressedFile() {
+        if (dec)
+            xz_stream_end(dec);
+    }
+
+    // Make sure the data up to 'end' is available
+    bool decompress(size_t end) {
+        while (dec && b.out_pos < end) {
+            b.in_size = std::min(b.in_size + ESPVFS_XZ_CHUNK, (unsigned)fe->compressedSize);
+
+            auto inPos  = b.in_pos;
+            auto outPos = b.out_pos;
+            auto ret    = xz_stream_run(dec, &b);
+            if (ret == XZ_INTERNAL_OK && (b.in_pos != inPos || b.out_pos != outPos || b.in_size < fe->compressedSize))
+                continue;
+
+            if (ret != XZ_SUCCESS || b.out_pos != b.out_size) {
+                ESP_LOGE("espvfs", "Error decompressing '%s'", fe->filename);
+                error = true;
+            }
+            xz_stream_end(dec);
+            dec = nullptr;
+        }
+        return !error;
+    }
+
+    const FileEntry     *fe;
+    std::vector<uint8_t> data;
+    struct xz_dec       *dec = nullptr;
+    struct xz_buf        b;
+    bool                 error = false;
+};
+
+struct OpenFile {
+    std::shared_ptr<DecompressedFile> file;
+    unsigned                          offset = 0;
+};
+
 class EspVFS : public VFS {
 public:
-    OpenFile openFile;
+    OpenFile openFiles[ESPVFS_MAX_FDS];
+
+    // Recently used files, most recent at the front
+    std::list<std::shared_ptr<DecompressedFile>> cache;
 
     EspVFS() {
     }
@@ -59,49 +137,88 @@ public:
     void init() override {
     }
 
-    int open(uint8_t flags, const std::string &_path) override {
-        (void)flags;
+    std::shared_ptr<DecompressedFile> getFile(const FileEntry *fe) {
+        for (auto it = cache.begin(); it != cache.end(); ++it) {
+            if ((*it)->fe == fe) {
+                auto result = *it;
+                cache.erase(it);
+                cache.push_front(result);
+                return result;
+            }
+        }
 
-        // Skip leading slashes
-        auto idx = _path.find_first_not_of('/');
-        if (idx == std::string::npos) {
-            idx = _path.size();
+        ESP_LOGW("espvfs", "Decompressing '%s' %u -> %u", fe->filename, (unsigned)fe->compressedSize, (unsigned)fe->fsize);
+        auto result = std::make_shared<DecompressedFile>(fe);
+        cache.push_front(result);
+        trimCache();
+        return result;
+    }
+
+    void trimCache() {
+        // Drop least recently used files that aren't open anymore
+        size_t total = 0;
+        for (auto it = cache.begin(); it != cache.end();) {
+            total += (*it)->data.size();
+            if (total > ESPVFS_CACHE_SIZE && it->use_count() == 1) {
+                total -= (*it)->data.size();
+                it = cache.erase(it);
+            } else {
+                ++it;
+            }
         }
-        auto path = _path.substr(idx);
+    }
+
+    OpenFile *getOpenFile(int fd) {
+        if (fd < 0 || fd >= ESPVFS_MAX_FDS || !openFiles[fd].file)
+            return nullptr;
+        return &openFiles[fd];
+    }
+
+    int open(uint8_t flags, const std::string &_path) override {
+        (void)flags;
 
         auto fe = findFile(_path);
         if (!fe)
             return ERR_NOT_FOUND;
 
-        if (openFile.fe)
+        int fd = -1;
+        for (int i = 0; i < ESPVFS_MAX_FDS; i++) {
+            if (!openFiles[i].file) {
+                fd = i;
+                break;
+            }
+        }
+        if (fd < 0)
             return ERR_TOO_MANY_OPEN;
 
-        openFile.fe     = fe;
-        openFile.offset = 0;
-        openFile.data.resize(openFile.fe->fsize);
-
-        ESP_LOGW("espvfs", "Decompressing '%s' %u -> %u", openFile.fe->filename, (unsigned)openFile.fe->compressedSize, (unsigned)openFile.fe->fsize);
-
-        if (xz_decompress((uint8_t *)romfs_start + openFile.fe->offset, openFile.fe->compressedSize, (uint8_t *)openFile.data.data()) != XZ_SUCCESS) {
-            openFile.fe = NULL;
-            openFile.data.clear();
+        auto file = getFile(fe);
+        if (file->error) {
+            // Retry next time
+            cache.remove(file);
             return ERR_OTHER;
         }
-        return 0;
+
+        openFiles[fd].file   = file;
+        openFiles[fd].offset = 0;
+        return fd;
     }
 
     int read(int fd, size_t size, void *buf) override {
-        if (fd == 0) {
-            int remaining = (int)(openFile.data.size() - openFile.offset);
-            if ((int)size > remaining) {
-                size = remaining;
-            }
-            memcpy(buf, openFile.data.data() + openFile.offset, size);
-            openFile.offset += (int)size;
-            return (int)size;
-        } else {
+        auto of = getOpenFile(fd);
+        if (!of)
             return ERR_PARAM;
+
+        auto &file      = *of->file;
+        int   remaining = (int)(file.data.size() - of->offset);
+        if ((int)size > remaining) {
+            size = remaining;
         }
+        if (!file.decompress(of->offset + size))
+            return ERR_OTHER;
+
+        memcpy(buf, file.data.data() + of->offset, size);
+        of->offset += (int)size;
+        return (int)size;
     }
 
     int write(int fd, size_t size, const void *buf) override {
@@ -109,27 +226,31 @@ public:
     }
 
     int seek(int fd, size_t offset) override {
-        if (fd != 0 || !openFile.fe)
+        auto of = getOpenFile(fd);
+        if (!of)
             return ERR_PARAM;
 
-        if (offset > openFile.fe->fsize)
-            offset = openFile.fe->fsize;
+        if (offset > of->file->fe->fsize)
+            offset = of->file->fe->fsize;
 
-        openFile.offset = (unsigned)offset;
+        of->offset = (unsigned)offset;
         return 0;
     }
 
     int tell(int fd) override {
-        if (fd != 0 || !openFile.fe)
+        auto of = getOpenFile(fd);
+        if (!of)
             return ERR_PARAM;
-        return openFile.offset;
+        return of->offset;
     }
 
     int close(int fd) override {
-        if (fd == 0) {
-            openFile.fe = NULL;
-            openFile.data.clear();
-        }
+        auto of = getOpenFile(fd);
+        if (!of)
+            return ERR_PARAM;
+
+        of->file.reset();
+        trimCache();
         return 0;
     }
 
@@ -153,12 +274,7 @@ public:
     }
 
     int stat(const std::string &_path, struct stat *st) override {
-        // Skip leading slashes
-        auto idx = _path.find_first_not_of('/');
-        if (idx == std::string::npos) {
-            idx = _path.size();
-        }
-        auto path = _path.substr(idx);
+        auto path = stripLeadingSlashes(_path);
 
         if (strcasecmp(path.c_str(), "") == 0) {
             memset(st, 0, sizeof(*st));
@@ -0,0 +1,1402 @@
+#include "VFS.h"
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include <algorithm>
+#include <unordered_map>
+
+// FAT16/FAT32 disk image used as SD card. The image is mapped copy-on-write and modified in memory.
+// Modified blocks are written back to the image file when a written file is closed, after each
+// directory change and on unmount. Like FatFs with FF_FS_LOCK, files open for writing can't be
+// opened again, and open files can't be deleted or renamed.
+
+#define DIRTY_BLOCK_SIZE (4096)
+#define MAX_CACHED_DIRS  (1024)
+
+enum {
+    FAT_ATTR_READ_ONLY = 0x01,
+    FAT_ATTR_HIDDEN    = 0x02,
+    FAT_ATTR_SYSTEM    = 0x04,
+    FAT_ATTR_VOLUME_ID = 0x08,
+    FAT_ATTR_DIRECTORY = 0x10,
+    FAT_ATTR_ARCHIVE   = 0x20,
+    FAT_ATTR_LFN       = 0x0F,
+};
+
+#pragma pack(push, 1)
+struct FatDirEntry {
+    uint8_t  name[11];
+    uint8_t  attr;
+    uint8_t  ntRes;
+    uint8_t  crtTimeTenth;
+    uint16_t crtTime;
+    uint16_t crtDate;
+    uint16_t lstAccDate;
+    uint16_t fstClusHi;
+    uint16_t wrtTime;
+    uint16_t wrtDate;
+    uint16_t fstClusLo;
+    uint32_t fileSize;
+};
+
+struct FatLfnEntry {
+    uint8_t  ord;
+    uint16_t name1[5];
+    uint8_t  attr;
+    uint8_t  type;
+    uint8_t  chksum;
+    uint16_t name2[6];
+    uint16_t fstClusLo;
+    uint16_t name3[2];
+};
+#pragma pack(pop)
+
+static_assert(sizeof(FatDirEntry) == 32 && sizeof(FatLfnEntry) == 32, "Invalid directory entry size");
+
+static inline uint16_t rd16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static inline uint32_t rd32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+static std::string toUpper(std::string s) {
+    for (auto &ch : s)
+        ch = toupper(ch);
+    return s;
+}
+
+class FatImageVFS : public VFS {
+public:
+    // Image
+    std::string imagePath;
+    int         imageFd   = -1;
+    uint8_t    *image     = nullptr;
+    size_t      imageSize = 0;
+    bool        readOnly  = false;
+
+    // Volume layout, all offsets in bytes from the start of the image
+    bool     fat32         = false;
+    size_t   fatOffset     = 0;
+    size_t   fatSize       = 0;
+    unsigned numFats       = 0;
+    size_t   rootDirOffset = 0; // FAT16 only
+    unsigned rootEntries   = 0; // FAT16 only
+    uint32_t rootCluster   = 0; // FAT32 only
+    size_t   dataOffset    = 0;
+    size_t   clusterSize   = 0;
+    uint32_t clusterCount  = 0;
+    size_t   fsInfoOffset  = 0; // FAT32 only, 0 if not present
+    uint32_t nextFree      = 2;
+
+    // Write-back
+    std::vector<bool>     dirtyMap;
+    std::vector<uint32_t> dirtyBlocks;
+    uint64_t              writeBacks = 0;
+
+    // Directory index, keyed by first cluster of the directory (0 for the root directory)
+    struct Entry {
+        std::string         name;      // Long name if present, otherwise short name
+        std::string         shortName; // Short name as NAME.EXT
+        uint8_t             attr    = 0;
+        uint32_t            cluster = 0;
+        uint32_t            size    = 0;
+        uint16_t            wrtDate = 0;
+        uint16_t            wrtTime = 0;
+        size_t              offset  = 0; // Offset of the short directory entry in the image
+        std::vector<size_t> lfnSlots;    // Offsets of the long name entries in the image
+    };
+    struct Dir {
+        std::vector<Entry>                      entries;
+        std::unordered_map<std::string, size_t> byName; // Upper case long and short names
+    };
+    std::unordered_map<uint32_t, Dir> dirCache;
+    uint64_t                          version = 0;
+
+    struct OpenFile {
+        uint8_t  flags        = 0;
+        bool     append       = false;
+        size_t   entryOffset  = 0;
+        uint32_t dirCluster   = 0;
+        uint32_t firstCluster = 0;
+        uint32_t size         = 0;
+        uint32_t offset       = 0;
+        uint32_t curCluster   = 0; // Cached position in the cluster chain
+        uint32_t curIndex     = 0;
+        bool     modified     = false;
+    };
+    std::vector<std::unique_ptr<OpenFile>> fds;
+
+    FatImageVFS() {
+    }
+
+    bool isMounted() const { return image != nullptr; }
+
+    bool mount(const std::string &path) {
+        unmount();
+
+#ifndef _WIN32
+        imageFd  = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+        readOnly = false;
+        if (imageFd < 0) {
+            imageFd  = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            readOnly = true;
+        }
+        if (imageFd < 0)
+            return false;
+
+        struct stat st;
+        if (::fstat(imageFd, &st) < 0 || st.st_size < 512) {
+            unmount();
+            return false;
+        }
+        imageSize = (size_t)st.st_size;
+
+        // Private mapping: modifications stay in memory until they are written back
+        void *p = ::mmap(nullptr, imageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, imageFd, 0);
+        if (p == MAP_FAILED) {
+            unmount();
+            return false;
+        }
+        image = static_cast<uint8_t *>(p);
+#else
+        imageFd  = _open(path.c_str(), _O_RDWR | _O_BINARY);
+        readOnly = false;
+        if (imageFd < 0) {
+            imageFd  = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+            readOnly = true;
+        }
+        if (imageFd < 0)
+            return false;
+
+        auto size = _filelengthi64(imageFd);
+        if (size < 512) {
+            unmount();
+            return false;
+        }
+        imageSize = (size_t)size;
+        image     = new uint8_t[imageSize];
+        if (_read(imageFd, image, (unsigned)imageSize) != (int)imageSize) {
+            unmount();
+            return false;
+        }
+#endif
+
+        if (!parseVolume()) {
+            unmount();
+            return false;
+        }
+
+        imagePath = path;
+        dirtyMap.assign((imageSize + DIRTY_BLOCK_SIZE - 1) / DIRTY_BLOCK_SIZE, false);
+        version++;
+        return true;
+    }
+
+    void unmount() {
+        if (image) {
+            flush();
+#ifndef _WIN32
+            ::munmap(image, imageSize);
+#else
+            delete[] image;
+#endif
+        }
+        if (imageFd >= 0) {
+#ifndef _WIN32
+            ::close(imageFd);
+#else
+            _close(imageFd);
+#endif
+        }
+        image     = nullptr;
+        imageFd   = -1;
+        imageSize = 0;
+        imagePath.clear();
+        dirtyMap.clear();
+        dirtyBlocks.clear();
+        dirCache.clear();
+        fds.clear();
+        version++;
+    }
+
+    static bool isValidBootSector(const uint8_t *p) {
+        unsigned bps = rd16(p + 11);
+        unsigned spc = p[13];
+        return (p[0] == 0xEB || p[0] == 0xE9) &&
+               (bps == 512 || bps == 1024 || bps == 2048 || bps == 4096) &&
+               spc != 0 && (spc & (spc - 1)) == 0 &&
+               rd16(p + 14) != 0 && p[16] != 0;
+    }
+
+    bool parseVolume() {
+        // Either a bare volume or a partitioned disk, in which case the first FAT partition is used
+        size_t volOffset = 0;
+        if (!isValidBootSector(image)) {
+            if (image[510] != 0x55 || image[511] != 0xAA)
+                return false;
+
+            bool found = false;
+            for (int i = 0; i < 4 && !found; i++) {
+                auto    pe   = image + 446 + i * 16;
+                uint8_t type = pe[4];
+                if (type == 0x04 || type == 0x06 || type == 0x0B || type == 0x0C || type == 0x0E) {
+                    volOffset = (size_t)rd32(pe + 8) * 512;
+                    found     = volOffset + 512 <= imageSize && isValidBootSector(image + volOffset);
+                }
+            }
+            if (!found)
+                return false;
+        }
+
+        const uint8_t *bs          = image + volOffset;
+        unsigned       bps         = rd16(bs + 11);
+        unsigned       spc         = bs[13];
+        unsigned       rsvdSectors = rd16(bs + 14);
+        numFats                    = bs[16];
+        rootEntries                = rd16(bs + 17);
+        uint32_t totSectors        = rd16(bs + 19) ? rd16(bs + 19) : rd32(bs + 32);
+        uint32_t fatSectors        = rd16(bs + 22) ? rd16(bs + 22) : rd32(bs + 36);
+
+        uint32_t rootDirSectors = (rootEntries * 32 + bps - 1) / bps;
+        uint32_t firstData      = rsvdSectors + numFats * fatSectors + rootDirSectors;
+        if (fatSectors == 0 || totSectors <= firstData)
+            return false;
+
+        clusterCount  = (totSectors - firstData) / spc;
+        clusterSize   = (size_t)bps * spc;
+        fatOffset     = volOffset + (size_t)rsvdSectors * bps;
+        fatSize       = (size_t)fatSectors * bps;
+        rootDirOffset = fatOffset + numFats * fatSize;
+        dataOffset    = volOffset + (size_t)firstData * bps;
+
+        // FAT type is determined by the number of clusters only
+        if (clusterCount < 4085) {
+            printf("FAT12 disk images are not supported\n");
+            return false;
+        }
+        fat32        = clusterCount >= 65525;
+        rootCluster  = fat32 ? rd32(bs + 44) : 0;
+        fsInfoOffset = 0;
+        if (fat32 && rd16(bs + 48) != 0 && rd16(bs + 48) < rsvdSectors) {
+            size_t offset = volOffset + (size_t)rd16(bs + 48) * bps;
+            if (rd32(image + offset) == 0x41615252 && rd32(image + offset + 484) == 0x61417272)
+                fsInfoOffset = offset;
+        }
+
+        // The image may be truncated, only use clusters that are actually present
+        if (dataOffset >= imageSize || fatOffset + numFats * fatSize > imageSize)
+            return false;
+        clusterCount = std::min(clusterCount, (uint32_t)((imageSize - dataOffset) / clusterSize));
+        clusterCount = std::min(clusterCount, (uint32_t)(fatSize / (fat32 ? 4 : 2)) - 2);
+        nextFree     = 2;
+        return true;
+    }
+
+    void markDirty(size_t offset, size_t length) {
+        if (length == 0)
+            return;
+        for (size_t block = offset / DIRTY_BLOCK_SIZE; block <= (offset + length - 1) / DIRTY_BLOCK_SIZE; block++) {
+            if (!dirtyMap[block]) {
+                dirtyMap[block] = true;
+                dirtyBlocks.push_back((uint32_t)block);
+            }
+        }
+    }
+
+    // Write modified blocks back to the image file, merging adjacent blocks into a single write
+    void flush() {
+        if (dirtyBlocks.empty())
+            return;
+
+        std::sort(dirtyBlocks.begin(), dirtyBlocks.end());
+        size_t i = 0;
+        while (i < dirtyBlocks.size()) {
+            size_t j = i + 1;
+            while (j < dirtyBlocks.size() && dirtyBlocks[j] == dirtyBlocks[j - 1] + 1)
+                j++;
+
+            size_t offset = (size_t)dirtyBlocks[i] * DIRTY_BLOCK_SIZE;
+            size_t length = std::min((size_t)(j - i) * DIRTY_BLOCK_SIZE, imageSize - offset);
+#ifndef _WIN32
+            if (::pwrite(imageFd, image + offset, length, (off_t)offset) != (ssize_t)length)
+#else
+            if (_lseeki64(imageFd, offset, SEEK_SET) < 0 || _write(imageFd, image + offset, (unsigned)length) != (int)length)
+#endif
+                printf("Error writing back SD card image\n");
+            writeBacks++;
+            i = j;
+        }
+        for (auto block : dirtyBlocks)
+            dirtyMap[block] = false;
+        dirtyBlocks.clear();
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // File allocation table
+    //////////////////////////////////////////////////////////////////////////
+    bool isValidCluster(uint32_t cluster) const { return cluster >= 2 && cluster < clusterCount + 2; }
+
+    uint32_t getFat(uint32_t cluster) const {
+        if (fat32)
+            return rd32(image + fatOffset + cluster * 4) & 0x0FFFFFFF;
+        return rd16(image + fatOffset + cluster * 2);
+    }
+
+    void setFat(uint32_t cluster, uint32_t value) {
+        for (unsigned i = 0; i < numFats; i++) {
+            auto p = image + fatOffset + i * fatSize;
+            if (fat32) {
+                p += cluster * 4;
+                value = (rd32(p) & 0xF0000000) | (value & 0x0FFFFFFF);
+                p[0]  = value & 0xFF;
+                p[1]  = (value >> 8) & 0xFF;
+                p[2]  = (value >> 16) & 0xFF;
+                p[3]  = (value >> 24) & 0xFF;
+                markDirty(p - image, 4);
+            } else {
+                p += cluster * 2;
+                p[0] = value & 0xFF;
+                p[1] = (value >> 8) & 0xFF;
+                markDirty(p - image, 2);
+            }
+        }
+    }
+
+    uint32_t endOfChain() const { return fat32 ? 0x0FFFFFFF : 0xFFFF; }
+
+    // Next cluster in the chain, 0 at the end of the chain (or when the chain is broken)
+    uint32_t nextCluster(uint32_t cluster) const {
+        uint32_t next = getFat(cluster);
+        return isValidCluster(next) ? next : 0;
+    }
+
+    void invalidateFsInfo() {
+        // Free cluster count is recalculated by the host OS when marked unknown
+        if (fsInfoOffset && rd32(image + fsInfoOffset + 488) != 0xFFFFFFFF) {
+            memset(image + fsInfoOffset + 488, 0xFF, 4);
+            markDirty(fsInfoOffset + 488, 4);
+        }
+    }
+
+    // Allocate a cluster and link it after 'prev' (if non-zero), returns 0 if the disk is full
+    uint32_t allocCluster(uint32_t prev, bool zero) {
+        for (uint32_t i = 0; i < clusterCount; i++) {
+            uint32_t cluster = 2 + (nextFree - 2 + i) % clusterCount;
+            if (getFat(cluster) != 0)
+                continue;
+
+            setFat(cluster, endOfChain());
+            if (prev)
+                setFat(prev, cluster);
+            if (zero) {
+                memset(clusterPtr(cluster), 0, clusterSize);
+                markDirty(clusterOffset(cluster), clusterSize);
+            }
+            nextFree = cluster + 1;
+            invalidateFsInfo();
+            return cluster;
+        }
+        return 0;
+    }
+
+    void freeChain(uint32_t cluster) {
+        uint32_t count = 0;
+        while (isValidCluster(cluster) && count++ < clusterCount) {
+            uint32_t next = getFat(cluster);
+            setFat(cluster, 0);
+            nextFree = std::min(nextFree, cluster);
+            cluster  = next;
+        }
+        invalidateFsInfo();
+    }
+
+    size_t   clusterOffset(uint32_t cluster) const { return dataOffset + (size_t)(cluster - 2) * clusterSize; }
+    uint8_t *clusterPtr(uint32_t cluster) const { return image + clusterOffset(cluster); }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Directories
+    //////////////////////////////////////////////////////////////////////////
+    bool isFixedRoot(uint32_t dirCluster) const { return dirCluster == 0 && !fat32; }
+
+    // Call 'fn' with the image offset of each 32-byte slot of a directory until it returns false
+    template <typename F>
+    void forEachSlot(uint32_t dirCluster, F fn) {
+        if (isFixedRoot(dirCluster)) {
+            for (unsigned i = 0; i < rootEntries; i++) {
+                if (!fn(rootDirOffset + i * 32))
+                    return;
+            }
+            return;
+        }
+
+        uint32_t cluster = dirCluster ? dirCluster : rootCluster;
+        uint32_t count   = 0;
+        while (isValidCluster(cluster) && count++ < clusterCount) {
+            for (size_t i = 0; i < clusterSize; i += 32) {
+                if (!fn(clusterOffset(cluster) + i))
+                    return;
+            }
+            cluster = nextCluster(cluster);
+        }
+    }
+
+    static uint8_t lfnChecksum(const uint8_t *name) {
+        uint8_t sum = 0;
+        for (int i = 0; i < 11; i++)
+            sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+        return sum;
+    }
+
+    static std::string formatShortName(const FatDirEntry *de) {
+        std::string result;
+        for (int i = 0; i < 8 && de->name[i] != ' '; i++) {
+            char ch = (i == 0 && de->name[0] == 0x05) ? (char)0xE5 : de->name[i];
+            result += (de->ntRes & 0x08) ? tolower(ch) : ch;
+        }
+        if (de->name[8] != ' ') {
+            result += '.';
+            for (int i = 8; i < 11 && de->name[i] != ' '; i++)
+                result += (de->ntRes & 0x10) ? tolower(de->name[i]) : de->name[i];
+        }
+        return result;
+    }
+
+    static void appendUtf8(std::string &s, uint16_t ch) {
+        if (ch < 0x80) {
+            s += (char)ch;
+        } else if (ch < 0x800) {
+            s += (char)(0xC0 | (ch >> 6));
+            s += (char)(0x80 | (ch & 0x3F));
+        } else {
+            s += (char)(0xE0 | (ch >> 12));
+            s += (char)(0x80 | ((ch >> 6) & 0x3F));
+            s += (char)(0x80 | (ch & 0x3F));
+        }
+    }
+
+    static std::vector<uint16_t> toUcs2(const std::string &s) {
+        std::vector<uint16_t> result;
+        for (size_t i = 0; i < s.size();) {
+            uint8_t ch = s[i];
+            if (ch < 0x80) {
+                result.push_back(ch);
+                i += 1;
+            } else if ((ch & 0xE0) == 0xC0 && i + 1 < s.size()) {
+                result.push_back(((ch & 0x1F) << 6) | (s[i + 1] & 0x3F));
+                i += 2;
+            } else if ((ch & 0xF0) == 0xE0 && i + 2 < s.size()) {
+                result.push_back(((ch & 0x0F) << 12) | ((s[i + 1] & 0x3F) << 6) | (s[i + 2] & 0x3F));
+                i += 3;
+            } else {
+                // Not valid UTF-8, take byte as is
+                result.push_back(ch);
+                i += 1;
+            }
+        }
+        return result;
+    }
+
+    Dir *getDir(uint32_t dirCluster) {
+        auto it = dirCache.find(dirCluster);
+        if (it != dirCache.end())
+            return &it->second;
+
+        if (dirCache.size() >= MAX_CACHED_DIRS)
+            dirCache.clear();
+
+        auto &dir = dirCache[dirCluster];
+
+        std::vector<uint16_t> lfn;
+        std::vector<size_t>   lfnSlots;
+        uint8_t               lfnChksum = 0;
+        int                   lfnNext   = 0;
+
+        forEachSlot(dirCluster, [&](size_t offset) {
+            auto de = reinterpret_cast<const FatDirEntry *>(image + offset);
+            if (de->name[0] == 0)
+                return false;
+            if (de->name[0] == 0xE5) {
+                lfnNext = 0;
+                return true;
+            }
+
+            if ((de->attr & 0x3F) == FAT_ATTR_LFN) {
+                auto le  = reinterpret_cast<const FatLfnEntry *>(de);
+                int  ord = le->ord & 0x1F;
+                if (le->ord & 0x40) {
+                    lfn.assign(ord * 13, 0xFFFF);
+                    lfnSlots.clear();
+                    lfnChksum = le->chksum;
+                    lfnNext   = ord;
+                }
+                if (ord == 0 || ord != lfnNext || le->chksum != lfnChksum) {
+                    lfnNext = 0;
+                    return true;
+                }
+
+                uint16_t chars[13];
+                memcpy(chars, le->name1, sizeof(le->name1));
+                memcpy(chars + 5, le->name2, sizeof(le->name2));
+                memcpy(chars + 11, le->name3, sizeof(le->name3));
+                std::copy(chars, chars + 13, lfn.begin() + (ord - 1) * 13);
+                lfnSlots.push_back(offset);
+                lfnNext--;
+                return true;
+            }
+
+            Entry entry;
+            entry.shortName = formatShortName(de);
+            entry.attr      = de->attr;
+            entry.cluster   = de->fstClusLo | (fat32 ? (de->fstClusHi << 16) : 0);
+            entry.size      = de->fileSize;
+            entry.wrtDate   = de->wrtDate;
+            entry.wrtTime   = de->wrtTime;
+            entry.offset    = offset;
+
+            if (!lfnSlots.empty() && lfnNext == 0 && lfnChksum == lfnChecksum(de->name)) {
+                for (auto ch : lfn) {
+                    if (ch == 0 || ch == 0xFFFF)
+                        break;
+                    appendUtf8(entry.name, ch);
+                }
+                entry.lfnSlots = lfnSlots;
+            }
+            if (entry.name.empty())
+                entry.name = entry.shortName;
+            lfnSlots.clear();
+            lfnNext = 0;
+
+            if (de->attr & FAT_ATTR_VOLUME_ID)
+                return true;
+
+            dir.byName.emplace(toUpper(entry.name), dir.entries.size());
+            dir.byName.emplace(toUpper(entry.shortName), dir.entries.size());
+            dir.entries.push_back(std::move(entry));
+            return true;
+        });
+        return &dir;
+    }
+
+    void dirChanged(uint32_t dirCluster) {
+        dirCache.erase(dirCluster);
+        version++;
+    }
+
+    // Root directory is returned as a directory entry with cluster 0
+    bool lookup(const std::string &path, Entry *result, uint32_t *parentCluster = nullptr) {
+        std::vector<std::string> parts;
+        splitPath(path, parts);
+
+        Entry cur;
+        cur.attr = FAT_ATTR_DIRECTORY;
+        for (size_t i = 0; i < parts.size(); i++) {
+            if ((cur.attr & FAT_ATTR_DIRECTORY) == 0)
+                return false;
+
+            auto dir = getDir(cur.cluster);
+            auto it  = dir->byName.find(toUpper(parts[i]));
+            if (it == dir->byName.end())
+                return false;
+
+            if (parentCluster)
+                *parentCluster = cur.cluster;
+            cur = dir->entries[it->second];
+        }
+        *result = cur;
+        return true;
+    }
+
+    // Look up the parent directory of 'path', returns the name of the last path element
+    int lookupParent(const std::string &path, uint32_t *dirCluster, std::string *name) {
+        std::vector<std::string> parts;
+        splitPath(path, parts);
+        if (parts.empty())
+            return ERR_PARAM;
+
+        *name = parts.back();
+        parts.pop_back();
+
+        std::string parentPath;
+        for (auto &part : parts)
+            parentPath += part + "/";
+
+        Entry parent;
+        if (!lookup(parentPath, &parent))
+            return ERR_NOT_FOUND;
+        if ((parent.attr & FAT_ATTR_DIRECTORY) == 0)
+            return ERR_NOT_FOUND;
+        *dirCluster = parent.cluster;
+        return 0;
+    }
+
+    static void getFatDateTime(uint16_t *fdate, uint16_t *ftime) {
+        time_t     now = time(nullptr);
+        struct tm *tm  = localtime(&now);
+        *ftime         = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
+        *fdate         = ((tm->tm_year + 1900 - 1980) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
+    }
+
+    static bool isValidShortChar(char ch) {
+        return (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || (ch & 0x80) || strchr("$%'-_@~`!(){}^#&", ch) != nullptr;
+    }
+
+    // Returns true if 'name' can be stored as short name without long name entries
+    static bool toShortName(const std::string &name, uint8_t sfn[11]) {
+        memset(sfn, ' ', 11);
+        auto dotPos = name.find('.');
+        auto base   = name.substr(0, dotPos);
+        auto ext    = (dotPos == std::string::npos) ? std::string() : name.substr(dotPos + 1);
+        if (base.empty() || base.size() > 8 || ext.size() > 3 || (dotPos != std::string::npos && ext.empty()))
+            return false;
+        for (auto ch : base + ext) {
+            if (!isValidShortChar(ch))
+                return false;
+        }
+        memcpy(sfn, base.data(), base.size());
+        memcpy(sfn + 8, ext.data(), ext.size());
+        if (sfn[0] == 0xE5)
+            sfn[0] = 0x05;
+        return true;
+    }
+
+    // Generate a unique short name with numeric tail for a long name
+    void generateShortName(Dir *dir, const std::string &name, uint8_t sfn[11]) {
+        std::string base, ext;
+        auto        dotPos = name.rfind('.');
+        auto        stem   = (dotPos == std::string::npos || dotPos == 0) ? name : name.substr(0, dotPos);
+        if (dotPos != std::string::npos && dotPos != 0)
+            ext = name.substr(dotPos + 1);
+
+        auto convert = [](const std::string &s, size_t maxLen) {
+            std::string result;
+            for (char ch : s) {
+                if (ch == ' ' || ch == '.')
+                    continue;
+                ch = toupper(ch);
+                result += isValidShortChar(ch) && !(ch & 0x80) ? ch : '_';
+                if (result.size() == maxLen)
+                    break;
+            }
+            return result;
+        };
+        base = convert(stem, 8);
+        ext  = convert(ext, 3);
+        if (base.empty())
+            base = "_";
+
+        for (unsigned n = 1; n < 1000000; n++) {
+            auto tail = "~" + std::to_string(n);
+            auto shortBase = base.substr(0, 8 - tail.size()) + tail;
+            auto full      = ext.empty() ? shortBase : shortBase + "." + ext;
+            if (dir->byName.find(full) != dir->byName.end())
+                continue;
+
+            memset(sfn, ' ', 11);
+            memcpy(sfn, shortBase.data(), shortBase.size());
+            memcpy(sfn + 8, ext.data(), ext.size());
+            return;
+        }
+    }
+
+    static bool isValidName(const std::string &name) {
+        if (name.empty() || name == "." || name == ".." || name.size() > 255)
+            return false;
+        for (uint8_t ch : name) {
+            if (ch < 0x20 || strchr("\"*/:<>?\\|", ch) != nullptr)
+                return false;
+        }
+        return true;
+    }
+
+    // Create a directory entry, with long name entries when needed
+    int createEntry(uint32_t dirCluster, const std::string &name, uint8_t attr, uint32_t cluster, uint32_t size, Entry *result) {
+        if (!isValidName(name))
+            return ERR_PARAM;
+
+        auto dir = getDir(dirCluster);
+        if (dir->byName.find(toUpper(name)) != dir->byName.end())
+            return ERR_EXISTS;
+
+        uint8_t sfn[11];
+        bool    needLfn = !toShortName(name, sfn);
+        if (needLfn)
+            generateShortName(dir, name, sfn);
+
+        auto     ucs2     = toUcs2(name);
+        unsigned lfnCount = needLfn ? (unsigned)(ucs2.size() + 12) / 13 : 0;
+        unsigned needed   = lfnCount + 1;
+
+        // Find a run of free slots
+        std::vector<size_t> slots;
+        forEachSlot(dirCluster, [&](size_t offset) {
+            uint8_t first = image[offset];
+            if (first == 0 || first == 0xE5) {
+                slots.push_back(offset);
+                return slots.size() < needed;
+            }
+            slots.clear();
+            return true;
+        });
+
+        // Extend the directory if needed
+        while (slots.size() < needed) {
+            if (isFixedRoot(dirCluster))
+                return ERR_OTHER;
+
+            uint32_t last  = dirCluster ? dirCluster : rootCluster;
+            uint32_t count = 0;
+            while (nextCluster(last) && count++ < clusterCount)
+                last = nextCluster(last);
+
+            uint32_t newCluster = allocCluster(last, true);
+            if (!newCluster)
+                return ERR_OTHER;
+            for (size_t i = 0; i < clusterSize && slots.size() < needed; i += 32)
+                slots.push_back(clusterOffset(newCluster) + i);
+        }
+
+        // Long name entries, last part first
+        uint8_t chksum = lfnChecksum(sfn);
+        for (unsigned i = 0; i < lfnCount; i++) {
+            unsigned ord = lfnCount - i;
+            uint16_t chars[13];
+            for (unsigned j = 0; j < 13; j++) {
+                size_t idx = (ord - 1) * 13 + j;
+                chars[j]   = idx < ucs2.size() ? ucs2[idx] : (idx == ucs2.size() ? 0 : 0xFFFF);
+            }
+
+            FatLfnEntry le;
+            memset(&le, 0, sizeof(le));
+            le.ord    = ord | (i == 0 ? 0x40 : 0);
+            le.attr   = FAT_ATTR_LFN;
+            le.chksum = chksum;
+            memcpy(le.name1, chars, sizeof(le.name1));
+            memcpy(le.name2, chars + 5, sizeof(le.name2));
+            memcpy(le.name3, chars + 11, sizeof(le.name3));
+            memcpy(image + slots[i], &le, sizeof(le));
+            markDirty(slots[i], sizeof(le));
+        }
+
+        FatDirEntry de;
+        memset(&de, 0, sizeof(de));
+        memcpy(de.name, sfn, sizeof(de.name));
+        de.attr      = attr;
+        de.fstClusLo = cluster & 0xFFFF;
+        de.fstClusHi = fat32 ? (cluster >> 16) : 0;
+        de.fileSize  = size;
+        getFatDateTime(&de.wrtDate, &de.wrtTime);
+        de.crtDate = de.lstAccDate = de.wrtDate;
+        de.crtTime                 = de.wrtTime;
+        memcpy(image + slots[lfnCount], &de, sizeof(de));
+        markDirty(slots[lfnCount], sizeof(de));
+
+        dirChanged(dirCluster);
+        if (result) {
+            result->name    = name;
+            result->attr    = attr;
+            result->cluster = cluster;
+            result->size    = size;
+            result->offset  = slots[lfnCount];
+        }
+        return 0;
+    }
+
+    void removeEntry(uint32_t dirCluster, const Entry &entry) {
+        for (auto offset : entry.lfnSlots) {
+            image[offset] = 0xE5;
+            markDirty(offset, 1);
+        }
+        image[entry.offset] = 0xE5;
+        markDirty(entry.offset, 1);
+        dirChanged(dirCluster);
+    }
+
+    FatDirEntry *dirEntryAt(size_t offset) { return reinterpret_cast<FatDirEntry *>(image + offset); }
+
+    void setEntryCluster(FatDirEntry *de, uint32_t cluster) {
+        de->fstClusLo = cluster & 0xFFFF;
+        de->fstClusHi = fat32 ? (cluster >> 16) : 0;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // VFS interface
+    //////////////////////////////////////////////////////////////////////////
+    // Check if the file with the given directory entry is open (for writing)
+    bool isOpen(size_t entryOffset, bool writing = false) const {
+        for (auto &f : fds) {
+            if (f && f->entryOffset == entryOffset && (!writing || (f->flags & FO_ACCMODE) != FO_RDONLY))
+                return true;
+        }
+        return false;
+    }
+
+    OpenFile *getFile(int fd) {
+        if (fd < 0 || fd >= (int)fds.size())
+            return nullptr;
+        return fds[fd].get();
+    }
+
+    int open(uint8_t flags, const std::string &path) override {
+        if (!isMounted())
+            return ERR_NO_DISK;
+
+        bool append = (flags & FO_APPEND) != 0;
+        bool create = false, trunc = false;
+        switch (flags & FO_ACCMODE) {
+            case FO_RDONLY: break;
+            case FO_WRONLY:
+                create = true;
+                trunc  = !append;
+                break;
+            case FO_RDWR:
+                create = append || (flags & FO_TRUNC);
+                trunc  = !append && (flags & FO_TRUNC);
+                break;
+            default: return ERR_PARAM;
+        }
+        bool writing = (flags & FO_ACCMODE) != FO_RDONLY;
+        if (writing && readOnly)
+            return ERR_WRITE_PROTECTED;
+
+        uint32_t    dirCluster;
+        std::string name;
+        int         result = lookupParent(path, &dirCluster, &name);
+        if (result < 0)
+            return result;
+
+        Entry entry;
+        if (lookup(path, &entry)) {
+            if (entry.attr & FAT_ATTR_DIRECTORY)
+                return ERR_PARAM;
+            if (create && (flags & FO_EXCL))
+                return ERR_EXISTS;
+            if (writing && (entry.attr & FAT_ATTR_READ_ONLY))
+                return ERR_WRITE_PROTECTED;
+            if (isOpen(entry.offset, !writing))
+                return ERR_OTHER; // FatFs FR_LOCKED
+        } else {
+            if (!create)
+                return ERR_NOT_FOUND;
+            result = createEntry(dirCluster, name, FAT_ATTR_ARCHIVE, 0, 0, &entry);
+            if (result < 0)
+                return result;
+        }
+
+        // Find free file descriptor
+        int fd = 0;
+        while (fd < (int)fds.size() && fds[fd])
+            fd++;
+        if (fd == (int)fds.size())
+            fds.emplace_back();
+
+        auto f          = std::make_unique<OpenFile>();
+        f->flags        = flags;
+        f->append       = append;
+        f->entryOffset  = entry.offset;
+        f->dirCluster   = dirCluster;
+        f->firstCluster = entry.cluster;
+        f->size         = entry.size;
+
+        if (trunc && (f->size > 0 || f->firstCluster)) {
+            freeChain(f->firstCluster);
+            f->firstCluster = 0;
+            f->size         = 0;
+            f->modified     = true;
+            updateEntry(f.get());
+        }
+        if (append)
+            f->offset = f->size;
+
+        fds[fd] = std::move(f);
+        return fd;
+    }
+
+    void updateEntry(OpenFile *f) {
+        auto de      = dirEntryAt(f->entryOffset);
+        de->fileSize = f->size;
+        setEntryCluster(de, f->firstCluster);
+        getFatDateTime(&de->wrtDate, &de->wrtTime);
+        de->attr |= FAT_ATTR_ARCHIVE;
+        markDirty(f->entryOffset, sizeof(*de));
+    }
+
+    int close(int fd) override {
+        if (!isMounted())
+            return ERR_NO_DISK;
+
+        auto f = getFile(fd);
+        if (f == nullptr)
+            return ERR_PARAM;
+
+        if (f->modified) {
+            updateEntry(f);
+            dirChanged(f->dirCluster);
+            flush();
+        }
+        fds[fd].reset();
+        return 0;
+    }
+
+    // Get cluster containing the given cluster index in the file, optionally extending the file
+    uint32_t getFileCluster(OpenFile *f, uint32_t index, bool extend) {
+        if (!f->firstCluster) {
+            if (!extend)
+                return 0;
+            f->firstCluster = allocCluster(0, false);
+            if (!f->firstCluster)
+                return 0;
+            f->curCluster = f->firstCluster;
+            f->curIndex   = 0;
+        }
+        if (!f->curCluster || f->curIndex > index) {
+            f->curCluster = f->firstCluster;
+            f->curIndex   = 0;
+        }
+        while (f->curIndex < index) {
+            uint32_t next = nextCluster(f->curCluster);
+            if (!next) {
+                if (!extend)
+                    return 0;
+                next = allocCluster(f->curCluster, false);
+                if (!next)
+                    return 0;
+            }
+            f->curCluster = next;
+            f->curIndex++;
+        }
+        return f->curCluster;
+    }
+
+    int readAt(OpenFile *f, size_t size, void *buf) {
+        if ((f->flags & FO_ACCMODE) == FO_WRONLY)
+            return ERR_PARAM;
+        if (f->offset >= f->size)
+            return 0;
+
+        size        = std::min(size, (size_t)(f->size - f->offset));
+        auto   dst  = static_cast<uint8_t *>(buf);
+        size_t done = 0;
+        while (done < size) {
+            uint32_t pos     = f->offset + (uint32_t)done;
+            uint32_t cluster = getFileCluster(f, (uint32_t)(pos / clusterSize), false);
+            if (!cluster)
+                break;
+            size_t inCluster = pos % clusterSize;
+            size_t n         = std::min(size - done, clusterSize - inCluster);
+            memcpy(dst + done, clusterPtr(cluster) + inCluster, n);
+            done += n;
+        }
+        return (int)done;
+    }
+
+    int read(int fd, size_t size, void *buf) override {
+        if (!isMounted())
+            return ERR_NO_DISK;
+
+        auto f = getFile(fd);
+        if (f == nullptr)
+            return ERR_PARAM;
+
+        int result = readAt(f, size, buf);
+        if (result > 0)
+            f->offset += result;
+        return result;
+    }
+
+    int readline(int fd, size_t size, void *buf) override {
+        if (!isMounted())
+            return ERR_NO_DISK;
+
+        auto f = getFile(fd);
+        if (f == nullptr || size == 0)
+            return ERR_PARAM;
+
+        // Same behaviour as fgets(): stop after a newline or size-1 characters
+        auto   dst = static_cast<char *>(buf);
+        size_t len = 0;
+        while (len < size - 1) {
+            char tmp[256];
+            int  result = readAt(f, std::min(sizeof(tmp), size - 1 - len), tmp);
+            if (result < 0)
+                return result;
+            if (result == 0)
+                break;
+
+            auto nl = static_cast<char *>(memchr(tmp, '\n', result));
+            int  n  = nl ? (int)(nl - tmp + 1) : result;
+            memcpy(dst + len, tmp, n);
+            len += n;
+            f->offset += n;
+            if (nl)
+                break;
+        }
+        dst[len] = 0;
+        if (len == 0)
+            return ERR_EOF;
+        return 0;
+    }
+
+    int write(int fd, size_t size, const void *buf) override {
+        if (!isMounted())
+            return ERR_NO_DISK;
+
+        auto f = getFile(fd);
+        if (f == nullptr)
+            return ERR_PARAM;
+        if ((f->flags & FO_ACCMODE) == FO_RDONLY)
+            return ERR_PARAM;
+        if (f->append)
+            f->offset = f->size;
+
+        // Writing beyond the end of the file fills the gap with zeroes
+        while (f->size < f->offset) {
+            static const uint8_t zeroes[512] = {0};
+            uint32_t             offset      = f->offset;
+            f->offset                        = f->size;
+            int result                       = write(fd, std::min((size_t)(offset - f->size), sizeof(zeroes)), zeroes);
+            f->offset                        = offset;
+            if (result <= 0)
+                return ERR_OTHER;
+        }
+
+        auto   src  = static_cast<const uint8_t *>(buf);
+        size_t done = 0;
+        while (done < size) {
+            uint32_t pos     = f->offset + (uint32_t)done;
+            uint32_t cluster = getFileCluster(f, (uint32_t)(pos / clusterSize), true);
+            if (!cluster)
+                break;
+            size_t inCluster = pos % clusterSize;
+            size_t n         = std::min(size - done, clusterSize - inCluster);
+            memcpy(clusterPtr(cluster) + inCluster, src + done, n);
+            markDirty(clusterOffset(cluster) + inCluster, n);
+            done += n;
+        }
+        if (size > 0 && done == 0)
+            return ERR_OTHER; // Disk full
+
+        f->offset += (uint32_t)done;
+        f->size     = std::max(f->size, f->offset);
+        f->modified = true;
+        return (int)done;
+    }
+
+    int seek(int fd, size_t offset) override {
+        if (!isMounted())
+            return ERR_NO_DISK;
+
+        auto f = getFile(fd);
+        if (f == nullptr)
+            return ERR_PARAM;
+
+        f->offset = (uint32_t)offset;
+        return 0;
+    }
+
+    int lseek(int fd, int offset, int whence) override {
+        if (!isMounted())
+            return ERR_NO_DISK;
+
+        auto f = getFile(fd);
+        if (f == nullptr || whence < 0 || whence > 2)
+            return ERR_PARAM;
+
+        int64_t base = 0;
+        switch (whence) {
+            case 0: base = 0; break;
+            case 1: base = f->offset; break;
+            case 2: base = f->size; break;
+        }
+        if (base + offset < 0)
+            return ERR_PARAM;
+
+        f->offset = (uint32_t)(base + offset);
+        return (int)f->offset;
+    }
+
+    int tell(int fd) override {
+        if (!isMounted())
+            return ERR_NO_DISK;
+
+        auto f = getFile(fd);
+        if (f == nullptr)
+            return ERR_PARAM;
+        return (int)f->offset;
+    }
+
+    std::pair<int, DirEnumCtx> direnum(const std::string &path, uint8_t flags) override {
+        if (!isMounted())
+            return std::pair(ERR_NO_DISK, nullptr);
+
+        bool mode83     = (flags & DE_FLAG_MODE83) != 0;
+        bool showHidden = (flags & DE_FLAG_HIDDEN) != 0;
+
+        Entry entry;
+        if (!lookup(path, &entry) || (entry.attr & FAT_ATTR_DIRECTORY) == 0)
+            return std::pair(ERR_NOT_FOUND, nullptr);
+
+        auto result = std::make_shared<std::vector<DirEnumEntry>>();
+        for (auto &e : getDir(entry.cluster)->entries) {
+            if (e.name.empty() || e.name == "." || e.name == "..")
+                continue;
+            if (!showHidden && (e.name[0] == '.' || (e.attr & (FAT_ATTR_HIDDEN | FAT_ATTR_SYSTEM))))
+                continue;
+
+            bool isDir = (e.attr & FAT_ATTR_DIRECTORY) != 0;
+            result->emplace_back(mode83 ? toUpper(e.shortName) : e.name, isDir ? 0 : e.size, isDir ? DE_ATTR_DIR : 0, e.wrtDate, e.wrtTime);
+        }
+        return std::make_pair(0, result);
+    }
+
+    bool getDirVersion(const std::string &path, uint64_t *_version) override {
+        if (!isMounted())
+            return false;
+        *_version = version;
+        return true;
+    }
+
+    int delete_(const std::string &path) override {
+        if (!isMounted())
+            return ERR_NO_DISK;
+        if (readOnly)
+            return ERR_WRITE_PROTECTED;
+
+        Entry    entry;
+        uint32_t dirCluster = 0;
+        if (!lookup(path, &entry, &dirCluster))
+            return ERR_NOT_FOUND;
+        if (entry.offset == 0)
+            return ERR_PARAM; // Root directory
+        if (isOpen(entry.offset))
+            return ERR_OTHER; // FatFs FR_LOCKED
+
+        if (entry.attr & FAT_ATTR_DIRECTORY) {
+            for (auto &e : getDir(entry.cluster)->entries) {
+                if (e.name != "." && e.name != "..")
+                    return ERR_NOT_EMPTY;
+            }
+            dirCache.erase(entry.cluster);
+        }
+
+        freeChain(entry.cluster);
+        removeEntry(dirCluster, entry);
+        flush();
+        return 0;
+    }
+
+    int rename(const std::string &pathOld, const std::string &pathNew) override {
+        if (!isMounted())
+            return ERR_NO_DISK;
+        if (readOnly)
+            return ERR_WRITE_PROTECTED;
+
+        Entry    entry;
+        uint32_t oldDirCluster = 0;
+        if (!lookup(pathOld, &entry, &oldDirCluster))
+            return ERR_NOT_FOUND;
+        if (entry.offset == 0)
+            return ERR_PARAM;
+        if (isOpen(entry.offset))
+            return ERR_OTHER; // FatFs FR_LOCKED
+
+        uint32_t    newDirCluster;
+        std::string newName;
+        int         result = lookupParent(pathNew, &newDirCluster, &newName);
+        if (result < 0)
+            return result;
+
+        // Only changing the case of the name is allowed when the new name already exists
+        Entry existing;
+        bool  sameEntry = lookup(pathNew, &existing) && existing.offset == entry.offset;
+        if (!sameEntry && lookup(pathNew, &existing))
+            return ERR_EXISTS;
+
+        // A directory can't be moved into itself
+        if (entry.attr & FAT_ATTR_DIRECTORY) {
+            uint32_t cluster = newDirCluster;
+            for (int depth = 0; cluster != 0 && depth < 256; depth++) {
+                if (cluster == entry.cluster)
+                    return ERR_PARAM;
+                Entry parent;
+                if (!lookupChild(cluster, "..", &parent))
+                    break;
+                cluster = parent.cluster;
+            }
+        }
+
+        // Keep a copy of the old entries, to restore them if creating the new entry fails
+        std::vector<std::pair<size_t, FatDirEntry>> oldSlots;
+        for (auto offset : entry.lfnSlots)
+            oldSlots.emplace_back(offset, *dirEntryAt(offset));
+        oldSlots.emplace_back(entry.offset, *dirEntryAt(entry.offset));
+        FatDirEntry oldDe = oldSlots.back().second;
+
+        if (sameEntry)
+            removeEntry(oldDirCluster, entry);
+
+        Entry newEntry;
+        result = createEntry(newDirCluster, newName, entry.attr, entry.cluster, entry.size, &newEntry);
+        if (result < 0) {
+            if (sameEntry) {
+                for (auto &slot : oldSlots) {
+                    *dirEntryAt(slot.first) = slot.second;
+                    markDirty(slot.first, sizeof(FatDirEntry));
+                }
+                dirChanged(oldDirCluster);
+            }
+            return result;
+        }
+        if (!sameEntry)
+            removeEntry(oldDirCluster, entry);
+
+        // Keep original timestamps
+        auto de     = dirEntryAt(newEntry.offset);
+        de->crtDate = oldDe.crtDate;
+        de->crtTime = oldDe.crtTime;
+        de->wrtDate = oldDe.wrtDate;
+        de->wrtTime = oldDe.wrtTime;
+
+        // Update the parent reference of a moved directory
+        if ((entry.attr & FAT_ATTR_DIRECTORY) && oldDirCluster != newDirCluster) {
+            forEachSlot(entry.cluster, [&](size_t offset) {
+                auto de = dirEntryAt(offset);
+                if (memcmp(de->name, "..         ", 11) == 0) {
+                    setEntryCluster(de, (fat32 && newDirCluster == rootCluster) ? 0 : newDirCluster);
+                    markDirty(offset, sizeof(*de));
+                    return false;
+                }
+                return de->name[0] != 0;
+            });
+            dirCache.erase(entry.cluster);
+        }
+
+        flush();
+        return 0;
+    }
+
+    bool lookupChild(uint32_t dirCluster, const std::string &name, Entry *result) {
+        auto dir = getDir(dirCluster);
+        auto it  = dir->byName.find(toUpper(name));
+        if (it == dir->byName.end())
+            return false;
+        *result = dir->entries[it->second];
+        return true;
+    }
+
+    int mkdir(const std::string &path) override {
+        if (!isMounted())
+            return ERR_NO_DISK;
+        if (readOnly)
+            return ERR_WRITE_PROTECTED;
+
+        uint32_t    dirCluster;
+        std::string name;
+        int         result = lookupParent(path, &dirCluster, &name);
+        if (result < 0)
+            return result;
+
+        Entry existing;
+        if (lookupChild(dirCluster, name, &existing))
+            return ERR_EXISTS;
+
+        uint32_t cluster = allocCluster(0, true);
+        if (!cluster)
+            return ERR_OTHER;
+
+        // '.' and '..' entries
+        FatDirEntry de;
+        memset(&de, 0, sizeof(de));
+        memset(de.name, ' ', sizeof(de.name));
+        de.attr = FAT_ATTR_DIRECTORY;
+        getFatDateTime(&de.wrtDate, &de.wrtTime);
+        de.crtDate = de.lstAccDate = de.wrtDate;
+        de.crtTime                 = de.wrtTime;
+
+        de.name[0] = '.';
+        setEntryCluster(&de, cluster);
+        memcpy(clusterPtr(cluster), &de, sizeof(de));
+        de.name[1] = '.';
+        setEntryCluster(&de, (fat32 && dirCluster == rootCluster) ? 0 : dirCluster);
+        memcpy(clusterPtr(cluster) + 32, &de, sizeof(de));
+
+        result = createEntry(dirCluster, name, FAT_ATTR_DIRECTORY, cluster, 0, nullptr);
+        if (result < 0) {
+            freeChain(cluster);
+            return result;
+        }
+        flush();
+        return 0;
+    }
+
+    int stat(const std::string &path, struct stat *st) override {
+        if (!isMounted())
+            return ERR_NO_DISK;
+
+        Entry entry;
+        if (!lookup(path, &entry))
+            return ERR_NOT_FOUND;
+
+        memset(st, 0, sizeof(*st));
+        bool isDir  = (entry.attr & FAT_ATTR_DIRECTORY) != 0;
+        st->st_mode = isDir ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+        st->st_size = isDir ? 0 : entry.size;
+
+        if (entry.wrtDate) {
+            struct tm tm;
+            memset(&tm, 0, sizeof(tm));
+            tm.tm_year   = (entry.wrtDate >> 9) + 80;
+            tm.tm_mon    = ((entry.wrtDate >> 5) & 0xF) - 1;
+            tm.tm_mday   = entry.wrtDate & 0x1F;
+            tm.tm_hour   = entry.wrtTime >> 11;
+            tm.tm_min    = (entry.wrtTime >> 5) & 0x3F;
+            tm.tm_sec    = (entry.wrtTime & 0x1F) * 2;
+            tm.tm_isdst  = -1;
+            st->st_mtime = mktime(&tm);
+        }
+        return 0;
+    }
+
+    SDCardImageInfo getInfo() {
+        SDCardImageInfo info;
+        info.path        = imagePath;
+        info.fatBits     = fat32 ? 32 : 16;
+        info.clusterSize = (unsigned)clusterSize;
+        info.clusters    = clusterCount;
+        info.readOnly    = readOnly;
+        info.cachedDirs  = (unsigned)dirCache.size();
+        info.writeBacks  = writeBacks;
+        return info;
+    }
+};
+
+static FatImageVFS *getFatImage() {
+    static FatImageVFS obj;
+    return &obj;
+}
+
+VFS *getFatImageVFS() {
+    auto vfs = getFatImage();
+    return vfs->isMounted() ? vfs : nullptr;
+}
+
+bool mountFatImage(const std::string &path) {
+    return getFatImage()->mount(path);
+}
+
+void unmountFatImage() {
+    getFatImage()->unmount();
+}
+
+bool getSDCardImageInfo(SDCardImageInfo *info) {
+    auto vfs = getFatImage();
+    if (!vfs->isMounted())
+        return false;
+    *info = vfs->getInfo();
+    return true;
+}
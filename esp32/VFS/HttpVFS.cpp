@@ -3,31 +3,40 @@
 #include <Windows.h>
 #include <wininet.h>
 #pragma comment(lib, "Wininet.lib")
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 #endif
 
 #define MAX_FDS (10)
 
+#ifdef _WIN32
 class HttpVFS : public VFS {
 public:
-#ifdef _WIN32
     HINTERNET hInternet;
     HINTERNET clients[MAX_FDS];
-#endif
 
     HttpVFS() {
     }
 
     void init() override {
-#ifdef _WIN32
         hInternet = InternetOpenA("Aquarius+ emulator", INTERNET_OPEN_TYPE_DIRECT, NULL, NULL, 0);
-#endif
     }
 
     int open(uint8_t flags, const std::string &_path) override {
         (void)flags;
         printf("HTTP open: %s\n", _path.c_str());
 
-#ifdef _WIN32
         if (flags == FO_RDONLY) {
             // Find free file descriptor
             int fd = -1;
@@ -65,14 +74,12 @@ public:
             }
             return fd;
         }
-#endif
         return ERR_OTHER;
     }
 
     int read(int fd, size_t size, void *buf) override {
         (void)buf;
         printf("HTTP read: %d  size: %u\n", fd, (unsigned)size);
-#ifdef _WIN32
         if (fd >= MAX_FDS || clients[fd] == nullptr)
             return ERR_PARAM;
         auto client = clients[fd];
@@ -82,34 +89,605 @@ public:
             return bytes_read;
         }
 
-#endif
         return ERR_OTHER;
     }
 
     int write(int fd, size_t size, const void *buf) override {
         (void)buf;
         printf("HTTP write: %d  size: %u\n", fd, (unsigned)size);
-#ifdef _WIN32
         if (fd >= MAX_FDS || clients[fd] == nullptr)
             return ERR_PARAM;
-#endif
         return ERR_OTHER;
     }
 
     int close(int fd) override {
         printf("HTTP close: %d\n", fd);
-#ifdef _WIN32
         if (fd >= MAX_FDS || clients[fd] == nullptr)
             return ERR_PARAM;
         auto client = clients[fd];
         InternetCloseHandle(client);
         clients[fd] = nullptr;
+        return 0;
+    }
+};
+#else
+// Portable implementation on plain sockets, with a pool of keep-alive connections, range requests
+// and an on-disk cache of small files.
+
+#define HTTP_TIMEOUT_MS     (10000)
+#define HTTP_WHOLE_FILE_MAX (1024 * 1024) // Files up to this size are fetched at once and cached on disk
+#define HTTP_RANGE_SIZE     (64 * 1024)   // Minimum size of subsequent range requests
+#define HTTP_MAX_REDIRECTS  (5)
+#define HTTP_MAX_IDLE       (4) // Idle connections kept per host
+#define HTTP_STATS_HISTORY  (32)
+
+static std::string toLower(std::string s) {
+    for (auto &ch : s)
+        ch = tolower(ch);
+    return s;
+}
+
+struct HttpUrl {
+    std::string host;
+    std::string port;
+    std::string path;
+
+    bool parse(const std::string &url) {
+        if (!startsWith(url, "http://", true))
+            return false;
+
+        auto rest     = url.substr(7);
+        auto slashPos = rest.find('/');
+        auto hostPort = rest.substr(0, slashPos);
+        path          = (slashPos == std::string::npos) ? "/" : rest.substr(slashPos);
+
+        auto colonPos = hostPort.rfind(':');
+        if (colonPos != std::string::npos) {
+            host = hostPort.substr(0, colonPos);
+            port = hostPort.substr(colonPos + 1);
+        } else {
+            host = hostPort;
+            port = "80";
+        }
+        return !host.empty() && !port.empty();
+    }
+    std::string key() const { return host + ":" + port; }
+};
+
+struct HttpResponse {
+    int                                status = 0;
+    std::map<std::string, std::string> headers; // Lower-case names
+    std::vector<uint8_t>               body;
+    bool                               keepAlive = false;
+
+    std::string header(const std::string &name) const {
+        auto it = headers.find(name);
+        return (it != headers.end()) ? it->second : std::string();
+    }
+};
+
+class HttpConnection {
+public:
+    ~HttpConnection() {
+        if (sock >= 0)
+            ::close(sock);
+    }
+
+    bool connect(const HttpUrl &url) {
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        struct addrinfo *ai;
+        if (getaddrinfo(url.host.c_str(), url.port.c_str(), &hints, &ai) != 0)
+            return false;
+
+        for (auto p = ai; p && sock < 0; p = p->ai_next) {
+            sock = ::socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+            if (sock < 0)
+                continue;
+
+            // Connect with timeout
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+            int result = ::connect(sock, p->ai_addr, p->ai_addrlen);
+            if (result < 0 && errno == EINPROGRESS) {
+                struct pollfd pfd = {sock, POLLOUT, 0};
+                int           err = 0;
+                socklen_t     len = sizeof(err);
+                if (poll(&pfd, 1, HTTP_TIMEOUT_MS) == 1 && getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0)
+                    result = 0;
+            }
+            if (result < 0) {
+                ::close(sock);
+                sock = -1;
+                continue;
+            }
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+
+            struct timeval tv = {HTTP_TIMEOUT_MS / 1000, 0};
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            int one = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+            setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
 #endif
+        }
+        freeaddrinfo(ai);
+        return sock >= 0;
+    }
+
+    bool sendAll(const std::string &data) {
+#ifdef MSG_NOSIGNAL
+        const int flags = MSG_NOSIGNAL;
+#else
+        const int flags = 0;
+#endif
+        size_t done = 0;
+        while (done < data.size()) {
+            auto result = ::send(sock, data.data() + done, data.size() - done, flags);
+            if (result <= 0)
+                return false;
+            done += result;
+        }
+        return true;
+    }
+
+    bool fill() {
+        if (rxPos > 0 && rxPos == rxBuf.size()) {
+            rxBuf.clear();
+            rxPos = 0;
+        }
+        uint8_t tmp[16384];
+        auto    result = ::recv(sock, tmp, sizeof(tmp), 0);
+        if (result <= 0)
+            return false;
+        rxBuf.insert(rxBuf.end(), tmp, tmp + result);
+        return true;
+    }
+
+    bool readLine(std::string &line) {
+        while (1) {
+            auto begin = rxBuf.begin() + rxPos;
+            auto it    = std::find(begin, rxBuf.end(), '\n');
+            if (it != rxBuf.end()) {
+                line.assign(begin, it);
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                rxPos = it - rxBuf.begin() + 1;
+                return true;
+            }
+            if (!fill())
+                return false;
+        }
+    }
+
+    bool readBytes(size_t count, std::vector<uint8_t> &out) {
+        while (count > 0) {
+            if (rxPos == rxBuf.size() && !fill())
+                return false;
+            size_t n = std::min(count, rxBuf.size() - rxPos);
+            out.insert(out.end(), rxBuf.begin() + rxPos, rxBuf.begin() + rxPos + n);
+            rxPos += n;
+            count -= n;
+        }
+        return true;
+    }
+
+    void readUntilClose(std::vector<uint8_t> &out) {
+        do {
+            out.insert(out.end(), rxBuf.begin() + rxPos, rxBuf.end());
+            rxPos = rxBuf.size();
+        } while (fill());
+    }
+
+    bool readResponse(HttpResponse &resp, bool headRequest) {
+        std::string line;
+        if (!readLine(line) || !startsWith(line, "HTTP/1."))
+            return false;
+
+        bool http10 = startsWith(line, "HTTP/1.0");
+        auto spPos  = line.find(' ');
+        if (spPos == std::string::npos)
+            return false;
+        resp.status = atoi(line.c_str() + spPos + 1);
+
+        while (1) {
+            if (!readLine(line))
+                return false;
+            if (line.empty())
+                break;
+            auto colonPos = line.find(':');
+            if (colonPos == std::string::npos)
+                continue;
+            auto value = line.substr(colonPos + 1);
+            value.erase(0, value.find_first_not_of(" \t"));
+            resp.headers[toLower(line.substr(0, colonPos))] = value;
+        }
+
+        auto connection = toLower(resp.header("connection"));
+        resp.keepAlive  = http10 ? (connection == "keep-alive") : (connection != "close");
+
+        // Read body
+        if (headRequest || resp.status == 204 || resp.status == 304 || resp.status / 100 == 1)
+            return true;
+
+        if (toLower(resp.header("transfer-encoding")).find("chunked") != std::string::npos) {
+            while (1) {
+                if (!readLine(line))
+                    return false;
+                size_t chunkSize = strtoul(line.c_str(), nullptr, 16);
+                if (chunkSize == 0)
+                    break;
+                if (!readBytes(chunkSize, resp.body) || !readLine(line))
+                    return false;
+            }
+            // Trailers
+            while (readLine(line) && !line.empty()) {
+            }
+            return true;
+        }
+
+        auto contentLength = resp.header("content-length");
+        if (!contentLength.empty())
+            return readBytes(strtoull(contentLength.c_str(), nullptr, 10), resp.body);
+
+        readUntilClose(resp.body);
+        resp.keepAlive = false;
+        return true;
+    }
+
+    // Data received beyond the previous response means the connection can't be reused
+    bool isClean() const { return rxPos == rxBuf.size(); }
+
+    int                  sock = -1;
+    std::vector<uint8_t> rxBuf;
+    size_t               rxPos = 0;
+};
+
+class HttpVFS : public VFS {
+public:
+    struct OpenFile {
+        std::string          url;       // Final URL, after redirects
+        int64_t              size = -1; // Total size, -1 if unknown
+        int64_t              offset = 0;
+        std::vector<uint8_t> buf;
+        int64_t              bufOffset = 0;
+        bool                 complete  = false; // 'buf' holds the complete file
+    };
+    std::unique_ptr<OpenFile> fds[MAX_FDS];
+
+    std::mutex                                                            mutex;
+    std::map<std::string, std::vector<std::unique_ptr<HttpConnection>>> idleConnections;
+    std::string                                                           cachePath;
+    HttpStats                                                             stats;
+
+    HttpVFS() {
+    }
+
+    void init() override {
+    }
+
+    void setCachePath(const std::string &path) {
+        std::lock_guard lock(mutex);
+        cachePath = path;
+        if (!cachePath.empty())
+            ::mkdir(cachePath.c_str(), 0755);
+    }
+
+    // Perform a single GET (or HEAD) request, on a pooled connection if available
+    bool request(const HttpUrl &url, const std::string &extraHeaders, HttpResponse &resp, bool head = false) {
+        std::string req = (head ? "HEAD " : "GET ") + url.path + " HTTP/1.1\r\n";
+        req += "Host: " + url.host + (url.port == "80" ? "" : ":" + url.port) + "\r\n";
+        req += "User-Agent: Aquarius+ emulator\r\n";
+        req += "Connection: keep-alive\r\n";
+        req += extraHeaders;
+        req += "\r\n";
+
+        auto start = std::chrono::steady_clock::now();
+
+        // An idle connection might have been closed by the server meanwhile, so retry once on a new connection
+        for (int attempt = 0; attempt < 2; attempt++) {
+            std::unique_ptr<HttpConnection> conn;
+            bool                            reused = false;
+            {
+                std::lock_guard lock(mutex);
+                auto           &idle = idleConnections[url.key()];
+                if (attempt == 0 && !idle.empty()) {
+                    conn = std::move(idle.back());
+                    idle.pop_back();
+                    reused = true;
+                }
+            }
+            if (!conn) {
+                conn = std::make_unique<HttpConnection>();
+                if (!conn->connect(url))
+                    return false;
+            }
+
+            resp = HttpResponse();
+            if (!conn->sendAll(req) || !conn->readResponse(resp, head)) {
+                if (reused)
+                    continue;
+                return false;
+            }
+
+            auto            latency = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::lock_guard lock(mutex);
+            if (resp.keepAlive && conn->isClean()) {
+                auto &idle = idleConnections[url.key()];
+                if (idle.size() < HTTP_MAX_IDLE)
+                    idle.push_back(std::move(conn));
+            }
+
+            stats.requests++;
+            stats.bytes += resp.body.size();
+            if (!reused)
+                stats.connections++;
+
+            HttpRequestInfo info;
+            info.url       = "http://" + url.key() + url.path;
+            info.status    = resp.status;
+            info.bytes     = resp.body.size();
+            info.latencyMs = latency;
+            info.reused    = reused;
+            stats.recent.push_back(info);
+            if (stats.recent.size() > HTTP_STATS_HISTORY)
+                stats.recent.erase(stats.recent.begin());
+            return true;
+        }
+        return false;
+    }
+
+    // Request following redirects, updates 'urlStr' to the final location
+    bool requestFollow(std::string &urlStr, const std::string &extraHeaders, HttpResponse &resp, bool head = false) {
+        for (int i = 0; i <= HTTP_MAX_REDIRECTS; i++) {
+            HttpUrl url;
+            if (!url.parse(urlStr) || !request(url, extraHeaders, resp, head))
+                return false;
+
+            if (resp.status != 301 && resp.status != 302 && resp.status != 303 && resp.status != 307 && resp.status != 308)
+                return true;
+
+            auto location = resp.header("location");
+            if (location.empty())
+                return true;
+            if (location[0] == '/')
+                location = "http://" + url.key() + location;
+            urlStr = location;
+        }
+        return false;
+    }
+
+    // Parse total size from 'Content-Range: bytes 0-1023/4567'
+    static int64_t getRangeTotal(const HttpResponse &resp) {
+        auto contentRange = resp.header("content-range");
+        auto slashPos     = contentRange.find('/');
+        if (slashPos == std::string::npos || contentRange[slashPos + 1] == '*')
+            return -1;
+        return strtoll(contentRange.c_str() + slashPos + 1, nullptr, 10);
+    }
+
+    std::string getCacheFileName(const std::string &url) {
+        char tmp[32];
+        snprintf(tmp, sizeof(tmp), "/%016llx", (unsigned long long)std::hash<std::string>()(url));
+        return cachePath + tmp;
+    }
+
+    // Cached files consist of a line with the URL, a line with the validator header and the file data
+    bool readCache(const std::string &url, std::string &validator, std::vector<uint8_t> &data) {
+        if (cachePath.empty())
+            return false;
+
+        std::ifstream ifs(getCacheFileName(url), std::ifstream::binary);
+        std::string   cachedUrl;
+        if (!ifs.good() || !std::getline(ifs, cachedUrl) || cachedUrl != url || !std::getline(ifs, validator))
+            return false;
+        data.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    void writeCache(const std::string &url, const HttpResponse &resp, const std::vector<uint8_t> &data) {
+        if (cachePath.empty())
+            return;
+
+        std::string validator;
+        if (!resp.header("etag").empty())
+            validator = "If-None-Match: " + resp.header("etag");
+        else if (!resp.header("last-modified").empty())
+            validator = "If-Modified-Since: " + resp.header("last-modified");
+        else
+            return;
+
+        std::ofstream ofs(getCacheFileName(url), std::ofstream::binary);
+        ofs << url << "\n"
+            << validator << "\n";
+        ofs.write((const char *)data.data(), data.size());
+    }
+
+    int open(uint8_t flags, const std::string &_path) override {
+        if (flags != FO_RDONLY)
+            return ERR_OTHER;
+
+        int fd = -1;
+        for (int i = 0; i < MAX_FDS; i++) {
+            if (!fds[i]) {
+                fd = i;
+                break;
+            }
+        }
+        if (fd == -1)
+            return ERR_TOO_MANY_OPEN;
+
+        std::string          validator;
+        std::vector<uint8_t> cachedData;
+        bool                 cached = readCache(_path, validator, cachedData);
+
+        // Fetch the start of the file, or all of it if it is small enough
+        auto         f = std::make_unique<OpenFile>();
+        HttpResponse resp;
+        f->url = _path;
+        char range[64];
+        snprintf(range, sizeof(range), "Range: bytes=0-%d\r\n", HTTP_WHOLE_FILE_MAX - 1);
+        if (!requestFollow(f->url, std::string(range) + (cached ? validator + "\r\n" : ""), resp))
+            return ERR_OTHER;
+
+        if (resp.status == 304 && cached) {
+            std::lock_guard lock(mutex);
+            stats.cacheHits++;
+            f->buf      = std::move(cachedData);
+            f->size     = f->buf.size();
+            f->complete = true;
+
+        } else if (resp.status == 200) {
+            // Server doesn't support ranges
+            f->buf      = std::move(resp.body);
+            f->size     = f->buf.size();
+            f->complete = true;
+            writeCache(_path, resp, f->buf);
+
+        } else if (resp.status == 206) {
+            f->buf      = std::move(resp.body);
+            f->size     = getRangeTotal(resp);
+            f->complete = (f->size == (int64_t)f->buf.size());
+            if (f->complete)
+                writeCache(_path, resp, f->buf);
+
+        } else if (resp.status == 416) {
+            // Empty file
+            f->size     = 0;
+            f->complete = true;
+
+        } else {
+            return (resp.status == 404) ? ERR_NOT_FOUND : ERR_OTHER;
+        }
+
+        fds[fd] = std::move(f);
+        return fd;
+    }
+
+    int read(int fd, size_t size, void *buf) override {
+        if (fd < 0 || fd >= MAX_FDS || !fds[fd])
+            return ERR_PARAM;
+        auto f = fds[fd].get();
+
+        auto   dst  = static_cast<uint8_t *>(buf);
+        size_t done = 0;
+        while (done < size) {
+            if (f->offset >= f->bufOffset && f->offset < f->bufOffset + (int64_t)f->buf.size()) {
+                size_t n = std::min(size - done, (size_t)(f->bufOffset + f->buf.size() - f->offset));
+                memcpy(dst + done, f->buf.data() + (f->offset - f->bufOffset), n);
+                done += n;
+                f->offset += n;
+                continue;
+            }
+            if (f->complete || (f->size >= 0 && f->offset >= f->size))
+                break;
+
+            // Fetch the next part of the file
+            int64_t      length = std::max((int64_t)(size - done), (int64_t)HTTP_RANGE_SIZE);
+            HttpResponse resp;
+            char         range[64];
+            snprintf(range, sizeof(range), "Range: bytes=%lld-%lld\r\n", (long long)f->offset, (long long)(f->offset + length - 1));
+            if (!requestFollow(f->url, range, resp))
+                return done > 0 ? (int)done : ERR_OTHER;
+
+            if (resp.status == 206) {
+                f->bufOffset = f->offset;
+                f->buf       = std::move(resp.body);
+            } else if (resp.status == 200) {
+                f->bufOffset = 0;
+                f->buf       = std::move(resp.body);
+                f->size      = f->buf.size();
+                f->complete  = true;
+            } else if (resp.status == 416) {
+                break;
+            } else {
+                return done > 0 ? (int)done : ERR_OTHER;
+            }
+            if (f->buf.empty())
+                break;
+        }
+        return (int)done;
+    }
+
+    int write(int fd, size_t size, const void *buf) override {
+        return ERR_OTHER;
+    }
+
+    int seek(int fd, size_t offset) override {
+        if (fd < 0 || fd >= MAX_FDS || !fds[fd])
+            return ERR_PARAM;
+        fds[fd]->offset = offset;
         return 0;
     }
+
+    int lseek(int fd, int offset, int whence) override {
+        if (fd < 0 || fd >= MAX_FDS || !fds[fd] || whence < 0 || whence > 2)
+            return ERR_PARAM;
+        auto f = fds[fd].get();
+
+        int64_t base = 0;
+        if (whence == 1)
+            base = f->offset;
+        else if (whence == 2) {
+            if (f->size < 0)
+                return ERR_PARAM;
+            base = f->size;
+        }
+        if (base + offset < 0)
+            return ERR_PARAM;
+        f->offset = base + offset;
+        return (int)f->offset;
+    }
+
+    int tell(int fd) override {
+        if (fd < 0 || fd >= MAX_FDS || !fds[fd])
+            return ERR_PARAM;
+        return (int)fds[fd]->offset;
+    }
+
+    int close(int fd) override {
+        if (fd < 0 || fd >= MAX_FDS || !fds[fd])
+            return ERR_PARAM;
+        fds[fd].reset();
+        return 0;
+    }
+
+    int stat(const std::string &path, struct stat *st) override {
+        // Only the headers are needed, don't fetch any of the file like open() does
+        std::string  url = path;
+        HttpResponse resp;
+        if (!requestFollow(url, "", resp, true))
+            return ERR_OTHER;
+        if (resp.status != 200)
+            return (resp.status == 404) ? ERR_NOT_FOUND : ERR_OTHER;
+
+        memset(st, 0, sizeof(*st));
+        st->st_mode = S_IFREG;
+        st->st_size = strtoll(resp.header("content-length").c_str(), nullptr, 10);
+        return 0;
+    }
+
+    HttpStats getStats() {
+        std::lock_guard lock(mutex);
+        return stats;
+    }
 };
+#endif
 
 VFS *getHttpVFS() {
     static HttpVFS obj;
     return &obj;
 }
+
+#if defined(EMULATOR) && !defined(_WIN32)
+void setHttpCachePath(const std::string &path) {
+    static_cast<HttpVFS *>(getHttpVFS())->setCachePath(path);
+}
+
+HttpStats getHttpStats() {
+    return static_cast<HttpVFS *>(getHttpVFS())->getStats();
+}
+#endif
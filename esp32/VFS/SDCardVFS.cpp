@@ -5,19 +5,72 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #else
 #include <io.h>
 #include <time.h>
 #endif
 
-#define MAX_FDS (10)
+#include <algorithm>
+#include <atomic>
+
+#define READ_AHEAD_SIZE (32 * 1024)
 
 class SDCardVFS : public VFS {
 public:
     std::string basePath;
-    FILE       *fds[MAX_FDS];
+
+    // Open files are accessed with positional reads/writes, so there are no separate seek system calls.
+    // Small reads are served from a per-file read-ahead buffer.
+    struct OpenFile {
+        int     fd     = -1;
+        uint8_t flags  = 0;
+        bool    append = false;
+        int64_t offset = 0;
+
+        std::vector<uint8_t> raBuf;
+        int64_t              raOffset = 0;
+        size_t               raLen    = 0;
+
+        std::string writePath; // Set for files opened for writing, to invalidate their directory on close
+    };
+    std::vector<std::unique_ptr<OpenFile>> fds;
+
+    struct {
+        std::atomic<uint64_t> reads{0};
+        std::atomic<uint64_t> readSyscalls{0};
+        std::atomic<uint64_t> bytesRead{0};
+        std::atomic<uint64_t> syscalls{0};
+        std::atomic<unsigned> openFiles{0};
+    } ioStats;
+
+#ifndef _WIN32
+    // Case-insensitive name index per directory, used to resolve paths on case-sensitive host file systems.
+    // Its version also identifies the directory contents for cached listings.
+    struct NameIndex {
+        struct timespec                              mtime;
+        int                                          wd      = -1;
+        uint64_t                                     version = 0;
+        std::unordered_map<std::string, std::string> names; // Upper-case name -> host name
+    };
+    std::mutex                                 nameIndexMutex;
+    std::unordered_map<std::string, NameIndex> nameIndex; // Keyed by relative directory path
+    SDCardNameCacheStats                       nameIndexStats;
+    uint64_t                                   nameIndexVersion = 0;
+    int                                        inotifyFd = -1;
+#ifdef __linux__
+    std::unordered_set<int> inotifyWatches;
+#endif
+#endif
 
     SDCardVFS() {
+#ifdef __linux__
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
     }
 
     void setBasePath(const std::string &_basePath) {
@@ -25,8 +78,177 @@ public:
 
         basePath = _basePath;
         stripTrailingSlashes(basePath);
+
+#ifndef _WIN32
+        std::lock_guard lock(nameIndexMutex);
+        clearNameIndex();
+#endif
+    }
+
+#ifndef _WIN32
+    static std::string toUpper(std::string s) {
+        for (auto &ch : s)
+            ch = toupper(ch);
+        return s;
+    }
+
+    static struct timespec getMTime(const struct stat &st) {
+#ifdef __APPLE__
+        return st.st_mtimespec;
+#else
+        return st.st_mtim;
+#endif
+    }
+
+    void clearNameIndex() {
+#ifdef __linux__
+        for (auto wd : inotifyWatches)
+            inotify_rm_watch(inotifyFd, wd);
+        inotifyWatches.clear();
+#endif
+        nameIndex.clear();
+    }
+
+    void invalidateNameIndex(const std::string &dir) {
+        if (nameIndex.erase(dir))
+            nameIndexStats.invalidations++;
     }
 
+    // Invalidate the index of the directory containing 'path'
+    void invalidateParentNameIndex(const std::string &path) {
+        auto            pos = path.find_last_of('/');
+        std::lock_guard lock(nameIndexMutex);
+        invalidateNameIndex(pos == std::string::npos ? std::string() : path.substr(0, pos));
+    }
+
+#ifdef __linux__
+    void processInotifyEvents() {
+        alignas(struct inotify_event) char buf[4096];
+        while (1) {
+            auto len = ::read(inotifyFd, buf, sizeof(buf));
+            if (len <= 0)
+                break;
+
+            for (char *p = buf; p < buf + len;) {
+                auto ev = reinterpret_cast<struct inotify_event *>(p);
+                p += sizeof(struct inotify_event) + ev->len;
+
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    clearNameIndex();
+                    continue;
+                }
+                if (ev->mask & IN_IGNORED)
+                    inotifyWatches.erase(ev->wd);
+
+                // Multiple paths can refer to the same directory (and watch) through symlinks
+                for (auto it = nameIndex.begin(); it != nameIndex.end();) {
+                    if (it->second.wd == ev->wd) {
+                        it = nameIndex.erase(it);
+                        nameIndexStats.invalidations++;
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+        }
+    }
+#endif
+
+    NameIndex *getNameIndex(const std::string &dir) {
+        auto fullPath = getFullPath(dir);
+
+#ifdef __linux__
+        if (inotifyFd >= 0)
+            processInotifyEvents();
+#endif
+
+        struct stat st;
+        auto        it = nameIndex.find(dir);
+        if (it != nameIndex.end()) {
+            if (it->second.wd >= 0) {
+                nameIndexStats.hits++;
+                return &it->second;
+            }
+            // No notifications for this directory, fall back to checking the modification time
+            if (::stat(fullPath.c_str(), &st) == 0) {
+                auto mtime = getMTime(st);
+                if (mtime.tv_sec == it->second.mtime.tv_sec && mtime.tv_nsec == it->second.mtime.tv_nsec) {
+                    nameIndexStats.hits++;
+                    return &it->second;
+                }
+            }
+            invalidateNameIndex(dir);
+        }
+        nameIndexStats.misses++;
+
+        // Limit the number of cached directories
+        if (nameIndex.size() >= 256)
+            clearNameIndex();
+
+        // Start watching before reading the directory, so no changes are missed
+        NameIndex ni;
+#ifdef __linux__
+        if (inotifyFd >= 0) {
+            ni.wd = inotify_add_watch(inotifyFd, fullPath.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+            if (ni.wd >= 0)
+                inotifyWatches.insert(ni.wd);
+        }
+#endif
+        if (::stat(fullPath.c_str(), &st) < 0)
+            return nullptr;
+        ni.mtime   = getMTime(st);
+        ni.version = ++nameIndexVersion;
+
+        DIR *d = ::opendir(fullPath.c_str());
+        if (d == nullptr)
+            return nullptr;
+        while (struct dirent *de = ::readdir(d)) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            // Keep the first entry if multiple names only differ in case
+            ni.names.emplace(toUpper(de->d_name), de->d_name);
+        }
+        ::closedir(d);
+
+        return &(nameIndex[dir] = std::move(ni));
+    }
+
+    bool lookupName(const std::string &dir, const std::string &name, std::string &realName) {
+        if (basePath.empty())
+            return false;
+
+        std::lock_guard lock(nameIndexMutex);
+        auto            ni = getNameIndex(dir);
+        if (ni == nullptr)
+            return false;
+
+        auto it = ni->names.find(toUpper(name));
+        if (it == ni->names.end())
+            return false;
+        realName = it->second;
+        return true;
+    }
+
+    bool getDirVersion(const std::string &path, uint64_t *version) override {
+        if (basePath.empty())
+            return false;
+
+        std::lock_guard lock(nameIndexMutex);
+        auto            ni = getNameIndex(path);
+        if (ni == nullptr)
+            return false;
+        *version = ni->version;
+        return true;
+    }
+
+    SDCardNameCacheStats getNameIndexStats() {
+        std::lock_guard lock(nameIndexMutex);
+        auto            result = nameIndexStats;
+        result.dirs            = nameIndex.size();
+        return result;
+    }
+#endif
+
     std::string getFullPath(const std::string &path) {
         // Compose full path
         std::string result = basePath;
@@ -48,46 +270,68 @@ public:
         return ERR_OTHER;
     }
 
+    // Positional I/O helpers
+    static int64_t preadAt(int fd, void *buf, size_t size, int64_t offset) {
+#ifndef _WIN32
+        return ::pread(fd, buf, size, (off_t)offset);
+#else
+        if (_lseeki64(fd, offset, SEEK_SET) < 0)
+            return -1;
+        return _read(fd, buf, (unsigned)size);
+#endif
+    }
+
+    static int64_t pwriteAt(int fd, const void *buf, size_t size, int64_t offset) {
+#ifndef _WIN32
+        return ::pwrite(fd, buf, size, (off_t)offset);
+#else
+        if (_lseeki64(fd, offset, SEEK_SET) < 0)
+            return -1;
+        return _write(fd, buf, (unsigned)size);
+#endif
+    }
+
+    static int64_t fileSize(int fd) {
+#ifndef _WIN32
+        struct stat st;
+        if (::fstat(fd, &st) < 0)
+            return -1;
+        return st.st_size;
+#else
+        return _filelengthi64(fd);
+#endif
+    }
+
     int open(uint8_t flags, const std::string &path) override {
         if (basePath.empty())
             return ERR_NO_DISK;
 
-        // Translate flags
-        int  mi = 0;
-        char mode[5];
+        // Translate flags (same semantics as the fopen modes used before)
+        int  oflag  = 0;
+        bool append = (flags & FO_APPEND) != 0;
 
         // if (flags & FO_CREATE)
         //     oflag |= O_CREAT;
 
         switch (flags & FO_ACCMODE) {
             case FO_RDONLY:
-                mode[mi++] = 'r';
+                oflag = O_RDONLY;
                 break;
             case FO_WRONLY:
-                if (flags & FO_APPEND) {
-                    mode[mi++] = 'a';
-                } else {
-                    mode[mi++] = 'w';
-                }
-                if (flags & FO_EXCL) {
-                    mode[mi++] = 'x';
-                }
-
+                oflag = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+                if (flags & FO_EXCL)
+                    oflag |= O_EXCL;
                 break;
             case FO_RDWR:
-                if (flags & FO_APPEND) {
-                    mode[mi++] = 'a';
-                    mode[mi++] = '+';
+                if (append) {
+                    oflag = O_RDWR | O_CREAT | O_APPEND;
                 } else if (flags & FO_TRUNC) {
-                    mode[mi++] = 'w';
-                    mode[mi++] = '+';
+                    oflag = O_RDWR | O_CREAT | O_TRUNC;
                 } else {
-                    mode[mi++] = 'r';
-                    mode[mi++] = '+';
-                }
-                if (flags & FO_EXCL) {
-                    mode[mi++] = 'x';
+                    oflag = O_RDWR;
                 }
+                if (flags & FO_EXCL)
+                    oflag |= O_EXCL;
                 break;
 
             default: {
@@ -95,68 +339,175 @@ public:
                 return ERR_PARAM;
             }
         }
-        mode[mi++] = 'b';
-        mode[mi]   = 0;
+
+        auto fullPath = getFullPath(path);
+#ifndef _WIN32
+        int hostFd = ::open(fullPath.c_str(), oflag | O_CLOEXEC, 0664);
+#else
+        int hostFd = _open(fullPath.c_str(), oflag | _O_BINARY, _S_IREAD | _S_IWRITE);
+#endif
+        ioStats.syscalls++;
+        if (hostFd < 0) {
+            return mapErrNoResult();
+        }
+
+        auto f    = std::make_unique<OpenFile>();
+        f->fd     = hostFd;
+        f->flags  = flags;
+        f->append = append;
+        if (append) {
+            f->offset = fileSize(hostFd);
+            ioStats.syscalls++;
+        }
 
         // Find free file descriptor
         int fd = -1;
-        for (int i = 0; i < MAX_FDS; i++) {
-            if (fds[i] == nullptr) {
+        for (int i = 0; i < (int)fds.size(); i++) {
+            if (!fds[i]) {
                 fd = i;
                 break;
             }
         }
-        if (fd == -1)
-            return ERR_TOO_MANY_OPEN;
+        if (fd == -1) {
+            fd = (int)fds.size();
+            fds.emplace_back();
+        }
+        fds[fd] = std::move(f);
+        ioStats.openFiles++;
 
-        auto  fullPath = getFullPath(path);
-        FILE *f        = ::fopen(fullPath.c_str(), mode);
-        if (f == nullptr) {
-            return mapErrNoResult();
+#ifndef _WIN32
+        if ((flags & FO_ACCMODE) != FO_RDONLY) {
+            fds[fd]->writePath = path;
+            invalidateParentNameIndex(path);
         }
-        fds[fd] = f;
+#endif
         return fd;
     }
 
+    OpenFile *getFile(int fd) {
+        if (fd < 0 || fd >= (int)fds.size())
+            return nullptr;
+        return fds[fd].get();
+    }
+
     int close(int fd) override {
         if (basePath.empty())
             return ERR_NO_DISK;
 
-        if (fd >= MAX_FDS || fds[fd] == nullptr)
+        auto f = getFile(fd);
+        if (f == nullptr)
             return ERR_PARAM;
-        FILE *f = fds[fd];
 
-        ::fclose(f);
-        fds[fd] = nullptr;
+#ifndef _WIN32
+        ::close(f->fd);
+
+        // File size and date in the directory listing changed
+        if (!f->writePath.empty())
+            invalidateParentNameIndex(f->writePath);
+#else
+        _close(f->fd);
+#endif
+        ioStats.syscalls++;
+        ioStats.openFiles--;
+        fds[fd].reset();
         return 0;
     }
 
+    // Read from the current offset, without advancing it
+    int readAt(OpenFile *f, size_t size, void *buf) {
+        if ((f->flags & FO_ACCMODE) == FO_WRONLY) {
+            errno = EBADF;
+            return mapErrNoResult();
+        }
+
+        auto   dst  = static_cast<uint8_t *>(buf);
+        size_t done = 0;
+        while (done < size) {
+            int64_t offset = f->offset + done;
+
+            // Serve from the read-ahead buffer
+            if (offset >= f->raOffset && offset < f->raOffset + (int64_t)f->raLen) {
+                size_t n = std::min(size - done, (size_t)(f->raOffset + f->raLen - offset));
+                memcpy(dst + done, f->raBuf.data() + (offset - f->raOffset), n);
+                done += n;
+                continue;
+            }
+
+            // Large reads go directly into the destination buffer
+            if (size - done >= READ_AHEAD_SIZE) {
+                auto result = preadAt(f->fd, dst + done, size - done, offset);
+                ioStats.syscalls++;
+                if (result < 0)
+                    return mapErrNoResult();
+                done += result;
+                break;
+            }
+
+            // Refill the read-ahead buffer
+            f->raBuf.resize(READ_AHEAD_SIZE);
+            auto result = preadAt(f->fd, f->raBuf.data(), READ_AHEAD_SIZE, offset);
+            ioStats.syscalls++;
+            if (result < 0) {
+                f->raLen = 0;
+                return mapErrNoResult();
+            }
+            f->raOffset = offset;
+            f->raLen    = result;
+            if (result == 0)
+                break;
+        }
+        return (int)done;
+    }
+
     int read(int fd, size_t size, void *buf) override {
         if (basePath.empty())
             return ERR_NO_DISK;
 
-        if (fd >= MAX_FDS || fds[fd] == nullptr)
+        auto f = getFile(fd);
+        if (f == nullptr)
             return ERR_PARAM;
-        FILE *f = fds[fd];
 
-        int result = (int)::fread(buf, 1, size, f);
-        return (result < 0) ? mapErrNoResult() : result;
+        auto syscalls = ioStats.syscalls.load();
+        int  result   = readAt(f, size, buf);
+        if (result > 0) {
+            f->offset += result;
+            ioStats.bytesRead += result;
+        }
+        ioStats.reads++;
+        ioStats.readSyscalls += ioStats.syscalls - syscalls;
+        return result;
     }
 
     int readline(int fd, size_t size, void *buf) override {
         if (basePath.empty())
             return ERR_NO_DISK;
 
-        if (fd >= MAX_FDS || fds[fd] == nullptr)
+        auto f = getFile(fd);
+        if (f == nullptr || size == 0)
             return ERR_PARAM;
 
-        FILE *f = fds[fd];
-        if (fgets((char *)buf, (int)size, f) == NULL) {
-            if (feof(f))
-                return ERR_EOF;
-            errno = ferror(f);
-            return mapErrNoResult();
+        // Same behaviour as fgets(): stop after a newline or size-1 characters
+        auto   dst = static_cast<char *>(buf);
+        size_t len = 0;
+        while (len < size - 1) {
+            char tmp[256];
+            int  result = readAt(f, std::min(sizeof(tmp), size - 1 - len), tmp);
+            if (result < 0)
+                return result;
+            if (result == 0)
+                break;
+
+            auto nl = static_cast<char *>(memchr(tmp, '\n', result));
+            int  n  = nl ? (int)(nl - tmp + 1) : result;
+            memcpy(dst + len, tmp, n);
+            len += n;
+            f->offset += n;
+            if (nl)
+                break;
         }
+        dst[len] = 0;
+        if (len == 0)
+            return ERR_EOF;
         return 0;
     }
 
@@ -164,60 +515,98 @@ public:
         if (basePath.empty())
             return ERR_NO_DISK;
 
-        if (fd >= MAX_FDS || fds[fd] == nullptr)
+        auto f = getFile(fd);
+        if (f == nullptr)
             return ERR_PARAM;
-        FILE *f = fds[fd];
+        if ((f->flags & FO_ACCMODE) == FO_RDONLY) {
+            errno = EBADF;
+            return mapErrNoResult();
+        }
 
-        int result = (int)::fwrite(buf, 1, size, f);
-        return (result < 0) ? mapErrNoResult() : result;
+        // Written data might be in the read-ahead buffer
+        f->raLen = 0;
+
+        int64_t result;
+        if (f->append) {
+            // Appends always go to the end of the file
+#ifndef _WIN32
+            result = ::write(f->fd, buf, size);
+#else
+            result = _write(f->fd, buf, (unsigned)size);
+#endif
+            ioStats.syscalls++;
+            if (result >= 0) {
+                f->offset = fileSize(f->fd);
+                ioStats.syscalls++;
+            }
+        } else {
+            result = pwriteAt(f->fd, buf, size, f->offset);
+            ioStats.syscalls++;
+            if (result >= 0)
+                f->offset += result;
+        }
+        return (result < 0) ? mapErrNoResult() : (int)result;
     }
 
     int seek(int fd, size_t offset) override {
         if (basePath.empty())
             return ERR_NO_DISK;
 
-        if (fd >= MAX_FDS || fds[fd] == nullptr)
+        auto f = getFile(fd);
+        if (f == nullptr)
             return ERR_PARAM;
-        FILE *f = fds[fd];
 
-        int result = (int)::fseek(f, (long)offset, SEEK_SET);
-        return (result < 0) ? mapErrNoResult() : 0;
+        f->offset = offset;
+        return 0;
     }
 
     int lseek(int fd, int offset, int whence) override {
         if (basePath.empty())
             return ERR_NO_DISK;
 
-        if (fd >= MAX_FDS || fds[fd] == nullptr || whence < 0 || whence > 2)
+        auto f = getFile(fd);
+        if (f == nullptr || whence < 0 || whence > 2)
             return ERR_PARAM;
 
+        int64_t base = 0;
         switch (whence) {
-            case 0: whence = SEEK_SET; break;
-            case 1: whence = SEEK_CUR; break;
-            case 2: whence = SEEK_END; break;
+            case 0: base = 0; break;
+            case 1: base = f->offset; break;
+            case 2: {
+                base = fileSize(f->fd);
+                ioStats.syscalls++;
+                if (base < 0)
+                    return mapErrNoResult();
+                break;
+            }
         }
-
-        FILE *f      = fds[fd];
-        int   result = ::fseek(f, offset, whence);
-        if (result < 0)
+        if (base + offset < 0) {
+            errno = EINVAL;
             return mapErrNoResult();
+        }
 
-        result = ::ftell(f);
-        if (result < 0)
-            return mapErrNoResult();
-        return result;
+        f->offset = base + offset;
+        return (int)f->offset;
     }
 
     int tell(int fd) override {
         if (basePath.empty())
             return ERR_NO_DISK;
 
-        if (fd >= MAX_FDS || fds[fd] == nullptr)
+        auto f = getFile(fd);
+        if (f == nullptr)
             return ERR_PARAM;
-        FILE *f = fds[fd];
+        return (int)f->offset;
+    }
 
-        int result = (int)::ftell(f);
-        return (result < 0) ? mapErrNoResult() : result;
+    SDCardIoStats getIoStats() {
+        SDCardIoStats result;
+        result.reads        = ioStats.reads;
+        result.readSyscalls = ioStats.readSyscalls;
+        result.bytesRead    = ioStats.bytesRead;
+        result.syscalls     = ioStats.syscalls;
+        result.openFiles    = ioStats.openFiles;
+        return result;
     }
 
     std::pair<int, DirEnumCtx> direnum(const std::string &path, uint8_t flags) override {
@@ -254,25 +643,7 @@ public:
             if (de == NULL) {
                 break;
             }
-
-            // Read additional file stats
-            std::string filePath = fullPath + "/" + de->d_name;
-            struct stat st;
-            if (::stat(filePath.c_str(), &st) < 0) {
-                continue;
-            }
-
-            // Return file entry
             dee.filename = de->d_name;
-            dee.size     = (de->d_type == DT_DIR) ? 0 : st.st_size;
-            dee.attr     = (de->d_type == DT_DIR) ? DE_ATTR_DIR : 0;
-
-#ifdef __APPLE__
-            time_t t = st.st_mtimespec.tv_sec;
-#else
-            time_t t = st.st_mtim.tv_sec;
-#endif
-
 #else
             if (!first) {
                 if (_findnext(handle, &fileinfo) != 0)
@@ -284,17 +655,9 @@ public:
             if (fileinfo.attrib & (_A_HIDDEN | _A_SYSTEM))
                 continue;
 
-            // Return file entry
             dee.filename = fileinfo.name;
-            dee.size     = (fileinfo.attrib & _A_SUBDIR) ? 0 : fileinfo.size;
-            dee.attr     = (fileinfo.attrib & _A_SUBDIR) ? DE_ATTR_DIR : 0;
-            time_t t     = fileinfo.time_write;
 #endif
 
-            struct tm *tm = ::localtime(&t);
-            dee.ftime     = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
-            dee.fdate     = ((tm->tm_year + 1900 - 1980) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
-
             // Skip files starting with a dot
             if (dee.filename.size() == 0 || dee.filename == "." || dee.filename == ".." || (dee.filename[0] == '.' && !showHidden))
                 continue;
@@ -335,6 +698,28 @@ public:
                     continue;
             }
 
+            // Only stat entries that are actually returned
+#ifndef _WIN32
+            struct stat st;
+            if (::fstatat(dirfd(dir), de->d_name, &st, 0) < 0) {
+                continue;
+            }
+
+            // Symlinks are followed by fstatat, so use its result for those
+            bool isDir = (de->d_type == DT_DIR) || ((de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) && S_ISDIR(st.st_mode));
+            dee.size   = isDir ? 0 : st.st_size;
+            dee.attr   = isDir ? DE_ATTR_DIR : 0;
+            time_t t   = getMTime(st).tv_sec;
+#else
+            dee.size = (fileinfo.attrib & _A_SUBDIR) ? 0 : fileinfo.size;
+            dee.attr = (fileinfo.attrib & _A_SUBDIR) ? DE_ATTR_DIR : 0;
+            time_t t = fileinfo.time_write;
+#endif
+
+            struct tm *tm = ::localtime(&t);
+            dee.ftime     = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
+            dee.fdate     = ((tm->tm_year + 1900 - 1980) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
+
             result->push_back(dee);
         }
 
@@ -357,6 +742,9 @@ public:
         if (result < 0) {
             result = ::rmdir(fullPath.c_str());
         }
+#ifndef _WIN32
+        invalidateParentNameIndex(path);
+#endif
         return (result < 0) ? mapErrNoResult() : 0;
     }
 
@@ -368,6 +756,10 @@ public:
         auto fullNew = getFullPath(pathNew);
 
         int result = ::rename(fullOld.c_str(), fullNew.c_str());
+#ifndef _WIN32
+        invalidateParentNameIndex(pathOld);
+        invalidateParentNameIndex(pathNew);
+#endif
         return (result < 0) ? mapErrNoResult() : 0;
     }
 
@@ -381,6 +773,7 @@ public:
         int result = ::mkdir(fullPath.c_str());
 #else
         int result = ::mkdir(fullPath.c_str(), 0775);
+        invalidateParentNameIndex(path);
 #endif
         return (result < 0) ? mapErrNoResult() : 0;
     }
@@ -395,11 +788,42 @@ public:
     }
 };
 
-VFS *getSDCardVFS() {
+static SDCardVFS *getSDCardDirVFS() {
     static SDCardVFS obj;
     return &obj;
 }
 
+VFS *getSDCardVFS() {
+#ifdef EMULATOR
+    if (auto vfs = getFatImageVFS())
+        return vfs;
+#endif
+    return getSDCardDirVFS();
+}
+
 void setSDCardPath(const std::string &basePath) {
-    static_cast<SDCardVFS *>(getSDCardVFS())->setBasePath(basePath);
+    // A regular file is mounted as disk image
+    struct stat st;
+    if (!basePath.empty() && ::stat(basePath.c_str(), &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG) {
+        getSDCardDirVFS()->setBasePath("");
+        if (!mountFatImage(basePath))
+            printf("Unable to mount SD card image '%s'\n", basePath.c_str());
+        return;
+    }
+    unmountFatImage();
+    getSDCardDirVFS()->setBasePath(basePath);
+}
+
+#ifndef _WIN32
+bool sdCardLookupName(const std::string &dir, const std::string &name, std::string &realName) {
+    return getSDCardDirVFS()->lookupName(dir, name, realName);
+}
+
+SDCardNameCacheStats getSDCardNameCacheStats() {
+    return getSDCardDirVFS()->getNameIndexStats();
+}
+#endif
+
+SDCardIoStats getSDCardIoStats() {
+    return getSDCardDirVFS()->getIoStats();
 }
@@ -3,20 +3,113 @@
 #include <ws2tcpip.h>
 #pragma comment(lib, "Ws2_32.lib")
 #else
+#include <arpa/inet.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 #endif
 
-#define MAX_FDS (10)
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#ifdef EMULATOR
+#include <future>
+#include <thread>
+#endif
 
-class TcpVFS : public VFS {
-public:
-    bool inUse[MAX_FDS]   = {0};
-#ifndef _WIN32
-    int  sockets[MAX_FDS] = {0};
+#define MAX_FDS       (10)
+#define RX_CHUNK_SIZE (16384) // Bytes requested from the host per recv call
+#define MAX_IDLE      (8)     // Maximum number of idle connections kept for reuse
+#define IDLE_EXPIRE   (30000) // Idle connections are closed after this many milliseconds
+
+#ifdef _WIN32
+typedef SOCKET socket_t;
+#define pollSockets WSAPoll
 #else
-    SOCKET sockets[MAX_FDS] = {0};
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define pollSockets    poll
 #endif
 
+static void closeSocket(socket_t sock) {
+#ifdef _WIN32
+    ::closesocket(sock);
+#else
+    ::close(sock);
+#endif
+}
+
+static bool setNonBlocking(socket_t sock) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    return fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) != -1;
+#endif
+}
+
+static bool wouldBlock() {
+#ifdef _WIN32
+    auto err = WSAGetLastError();
+    return err == WSAEWOULDBLOCK || err == WSAEINPROGRESS;
+#else
+    return errno == EINPROGRESS || errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+static int64_t getTimeMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Wait until the socket becomes readable/writable, returns false on timeout
+static bool waitSocket(socket_t sock, short events, int timeoutMs) {
+    struct pollfd pfd;
+    pfd.fd      = sock;
+    pfd.events  = events;
+    pfd.revents = 0;
+
+    auto deadline = getTimeMs() + timeoutMs;
+    while (1) {
+        int result = pollSockets(&pfd, 1, (int)std::max((int64_t)0, deadline - getTimeMs()));
+        if (result > 0)
+            return true;
+        if (result == 0 || !wouldBlock())
+            return false;
+    }
+}
+
+class TcpVFS : public VFS {
+public:
+    // All sockets are non-blocking. Data is received in large chunks into a per-descriptor buffer,
+    // from which the (typically small) reads of the Aquarius+ side are served.
+    struct Connection {
+        socket_t             sock = INVALID_SOCKET;
+        std::string          key; // host:port
+        std::vector<uint8_t> rxBuf;
+        size_t               rxPos     = 0;
+        bool                 eof       = false;
+        int64_t              idleSince = 0;
+    };
+    std::unique_ptr<Connection>             conns[MAX_FDS];
+    std::deque<std::unique_ptr<Connection>> idleConns; // Closed by the Aquarius+ side, kept open for reuse
+
+    std::atomic<int>  connectTimeout   = 5000; // ms
+    std::atomic<int>  readTimeout      = 0;    // ms to wait for data when none is buffered
+    std::atomic<bool> reuseConnections = false; // Raw TCP servers may expect a new connection per session
+
+    std::atomic<uint64_t> statConnects  = 0;
+    std::atomic<uint64_t> statReused    = 0;
+    std::atomic<uint64_t> statTimeouts  = 0;
+    std::atomic<uint64_t> statBytesRx   = 0;
+    std::atomic<uint64_t> statBytesTx   = 0;
+    std::atomic<uint64_t> statRecvCalls = 0;
+    std::atomic<unsigned> statOpenConns = 0;
+    std::atomic<unsigned> statIdleConns = 0;
+
     TcpVFS() {
     }
 
@@ -35,6 +128,142 @@ public:
         }
     }
 
+    void updateIdleCount() {
+        statIdleConns = (unsigned)idleConns.size();
+    }
+
+    // Find a usable idle connection to the given host, discarding expired or closed ones
+    std::unique_ptr<Connection> takeIdleConnection(const std::string &key) {
+        auto now = getTimeMs();
+        for (auto it = idleConns.begin(); it != idleConns.end();) {
+            auto &conn = *it;
+
+            bool usable = (now - conn->idleSince < IDLE_EXPIRE);
+            if (usable) {
+                // Readable idle socket means either closed by peer or unsolicited data, neither can be reused
+                struct pollfd pfd;
+                pfd.fd      = conn->sock;
+                pfd.events  = POLLIN;
+                pfd.revents = 0;
+                usable      = pollSockets(&pfd, 1, 0) == 0;
+            }
+            if (!usable) {
+                closeSocket(conn->sock);
+                it = idleConns.erase(it);
+                continue;
+            }
+            if (conn->key == key) {
+                auto result = std::move(conn);
+                idleConns.erase(it);
+                updateIdleCount();
+                return result;
+            }
+            ++it;
+        }
+        updateIdleCount();
+        return nullptr;
+    }
+
+    static bool lookup(const std::string &host, struct in_addr &addr) {
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        struct addrinfo *ai;
+        if (getaddrinfo(host.c_str(), nullptr, &hints, &ai) != 0)
+            return false;
+        addr = ((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+        freeaddrinfo(ai);
+        return true;
+    }
+
+    // Resolve 'host', giving up after 'timeoutMs'. Numeric addresses don't need the resolver.
+    int resolve(const std::string &host, int timeoutMs, struct in_addr &addr) {
+        if (inet_pton(AF_INET, host.c_str(), &addr) == 1)
+            return 0;
+
+#ifdef EMULATOR
+        // getaddrinfo() can't be cancelled and blocks for as long as the DNS server takes, which would stall the
+        // emulation thread. Run it on a detached thread instead; when it times out, its result is discarded.
+        auto result = std::make_shared<std::promise<std::pair<bool, struct in_addr>>>();
+        auto future = result->get_future();
+        std::thread([result, host] {
+            struct in_addr resolved;
+            bool           ok = lookup(host, resolved);
+            result->set_value({ok, resolved});
+        }).detach();
+
+        if (future.wait_for(std::chrono::milliseconds(timeoutMs)) != std::future_status::ready) {
+            statTimeouts++;
+            return ERR_OTHER;
+        }
+        auto value = future.get();
+        if (!value.first)
+            return ERR_NOT_FOUND;
+        addr = value.second;
+        return 0;
+#else
+        (void)timeoutMs;
+        return lookup(host, addr) ? 0 : ERR_NOT_FOUND;
+#endif
+    }
+
+    socket_t connectTo(const std::string &host, const std::string &portStr, int &err) {
+        // Resolving and connecting together take at most the connect timeout
+        auto deadline = getTimeMs() + connectTimeout;
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port   = htons((uint16_t)atoi(portStr.c_str()));
+        err = resolve(host, connectTimeout, addr.sin_addr);
+        if (err != 0)
+            return INVALID_SOCKET;
+
+        // Open socket
+        auto sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (sock == INVALID_SOCKET || !setNonBlocking(sock)) {
+            if (sock != INVALID_SOCKET)
+                closeSocket(sock);
+            err = ERR_OTHER;
+            return INVALID_SOCKET;
+        }
+
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+        setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+        // Connect to host, waiting at most the connect timeout for completion
+        int result = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+
+        if (result != 0) {
+            if (!wouldBlock()) {
+                closeSocket(sock);
+                err = ERR_NOT_FOUND;
+                return INVALID_SOCKET;
+            }
+            if (!waitSocket(sock, POLLOUT, (int)std::max(deadline - getTimeMs(), (int64_t)1))) {
+                statTimeouts++;
+                closeSocket(sock);
+                err = ERR_OTHER;
+                return INVALID_SOCKET;
+            }
+
+            int       sockErr = 0;
+            socklen_t len     = sizeof(sockErr);
+            if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&sockErr, &len) != 0 || sockErr != 0) {
+                closeSocket(sock);
+                err = ERR_NOT_FOUND;
+                return INVALID_SOCKET;
+            }
+        }
+        statConnects++;
+        return sock;
+    }
+
     int open(uint8_t flags, const std::string &_path) override {
         (void)flags;
         printf("TCP open: %s\n", _path.c_str());
@@ -56,12 +285,10 @@ public:
             return ERR_PARAM;
         }
 
-        printf("TCP host '%s'  port '%d'\n", host.c_str(), port);
-
         // Find free file descriptor
         int fd = -1;
         for (int i = 0; i < MAX_FDS; i++) {
-            if (!inUse[i]) {
+            if (!conns[i]) {
                 fd = i;
                 break;
             }
@@ -69,150 +296,126 @@ public:
         if (fd == -1)
             return ERR_TOO_MANY_OPEN;
 
-        // Resolve name
-        struct addrinfo hints;
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family   = AF_INET;
-        hints.ai_socktype = SOCK_STREAM;
-
-        struct addrinfo *ai;
-        if (getaddrinfo(host.c_str(), portStr.c_str(), &hints, &ai) != 0) {
-            return ERR_NOT_FOUND;
+        auto key  = host + ":" + portStr;
+        auto conn = reuseConnections ? takeIdleConnection(key) : nullptr;
+        if (conn) {
+            statReused++;
+        } else {
+            int  err  = 0;
+            auto sock = connectTo(host, portStr, err);
+            if (sock == INVALID_SOCKET)
+                return err;
+
+            conn       = std::make_unique<Connection>();
+            conn->sock = sock;
+            conn->key  = key;
         }
 
-        printf("Name resolved!\n");
-
-        // Open socket
-        auto sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        conns[fd] = std::move(conn);
+        statOpenConns++;
+        return fd;
+    }
 
-#ifndef _WIN32
-        if (sock == -1) {
-#else
-        if (sock == INVALID_SOCKET) {
-#endif
-            freeaddrinfo(ai);
-            return ERR_OTHER;
+    // Receive whatever the host has available into the descriptor's buffer
+    int fill(Connection *conn) {
+        if (conn->rxPos == conn->rxBuf.size()) {
+            conn->rxBuf.clear();
+            conn->rxPos = 0;
         }
-
-#ifndef _WIN32
-        if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1) {
-            ::close(sock);
-            return ERR_OTHER;
+        auto oldSize = conn->rxBuf.size();
+        conn->rxBuf.resize(oldSize + RX_CHUNK_SIZE);
+        int len = recv(conn->sock, (char *)conn->rxBuf.data() + oldSize, RX_CHUNK_SIZE, 0);
+        statRecvCalls++;
+        conn->rxBuf.resize(oldSize + std::max(len, 0));
+
+        if (len == 0) {
+            conn->eof = true;
+            return ERR_EOF;
         }
-#endif
-
-        printf("Socket opened!\n");
-
-        // Connect to host
-        int err = connect(sock, ai->ai_addr, (socklen_t)ai->ai_addrlen);
-        freeaddrinfo(ai);
-
-        if (err != 0) {
-#ifndef _WIN32
-            if (errno == EINPROGRESS) {
-                struct timeval tv;
-                tv.tv_sec  = 5;
-                tv.tv_usec = 0;
-
-                fd_set fdset;
-                FD_ZERO(&fdset);
-                FD_SET(sock, &fdset);
-
-                // Connection in progress -> have to wait until the connecting socket is marked as writable, i.e. connection completes
-                err = select(sock + 1, NULL, &fdset, NULL, &tv);
-                if (err <= 0) {
-                    ::close(sock);
-                    return ERR_OTHER;
-                }
-
-            } else
-#endif
-            {
-                printf("Error connecting to host!\n");
+        if (len < 0) {
+            if (wouldBlock())
+                return 0;
 #ifndef _WIN32
-                ::close(sock);
+            if (errno == ENOTCONN || errno == ECONNRESET) {
 #else
-                ::closesocket(sock);
+            if (WSAGetLastError() == WSAENOTCONN || WSAGetLastError() == WSAECONNRESET) {
 #endif
-                return ERR_NOT_FOUND;
+                conn->eof = true;
+                return ERR_EOF;
             }
+            return ERR_OTHER;
         }
-
-        // Success!
-        inUse[fd]   = true;
-        sockets[fd] = sock;
-        return fd;
+        statBytesRx += len;
+        return len;
     }
 
     int read(int fd, size_t size, void *buf) override {
-        // printf("TCP read: %d  size: %u\n", fd, (unsigned)size);
-
-        if (fd >= MAX_FDS || !inUse[fd])
+        if (fd < 0 || fd >= MAX_FDS || !conns[fd])
             return ERR_PARAM;
-        auto sock = sockets[fd];
+        auto conn = conns[fd].get();
 
         if (size == 0)
             return 0;
 
-#ifdef _WIN32
-        {
-            u_long avail = 0;
-            ioctlsocket(sock, FIONREAD, &avail);
-            if (avail == 0)
-                return 0;
-            if (avail < size)
-                size = avail;
+        if (conn->rxPos == conn->rxBuf.size() && !conn->eof) {
+            int result = fill(conn);
+            if (result == 0 && readTimeout > 0) {
+                if (waitSocket(conn->sock, POLLIN, readTimeout))
+                    result = fill(conn);
+                else
+                    statTimeouts++;
+            }
+            if (result < 0 && result != ERR_EOF)
+                return result;
         }
-        int len = recv(sock, (char *)buf, (int)size, 0);
-#else
-        int len = recv(sock, buf, size, 0);
-#endif
 
-        if (len == 0)
-            return ERR_EOF;
+        size_t avail = conn->rxBuf.size() - conn->rxPos;
+        if (avail == 0)
+            return conn->eof ? ERR_EOF : 0;
 
-        if (len < 0) {
-#ifndef _WIN32
-            if (errno == EINPROGRESS || errno == EAGAIN || errno == EWOULDBLOCK) {
-                return 0; // Not an error
-            }
-            if (errno == ENOTCONN) {
-                return ERR_EOF;
-            }
-#endif
-            return ERR_OTHER;
-        }
-        return len;
+        size = std::min(size, avail);
+        memcpy(buf, conn->rxBuf.data() + conn->rxPos, size);
+        conn->rxPos += size;
+        return (int)size;
     }
 
     int write(int fd, size_t size, const void *buf) override {
-        // printf("TCP write: %d  size: %u\n", fd, (unsigned)size);
-
-        if (fd >= MAX_FDS || !inUse[fd])
+        if (fd < 0 || fd >= MAX_FDS || !conns[fd])
             return ERR_PARAM;
-        auto sock = sockets[fd];
+        auto conn = conns[fd].get();
 
         if (size == 0)
             return 0;
 
-        int         to_write = (int)size;
-        const char *data     = (const char *)buf;
-        while (to_write > 0) {
-            int written = send(sock, data + (size - to_write), to_write, 0);
+#ifdef MSG_NOSIGNAL
+        const int sendFlags = MSG_NOSIGNAL;
+#else
+        const int sendFlags = 0;
+#endif
+
+        // Wait for room in the send buffer instead of spinning, but never longer than the connect timeout
+        size_t      done = 0;
+        const char *data = (const char *)buf;
+        while (done < size) {
+            int written = send(conn->sock, data + done, (int)(size - done), sendFlags);
+            if (written > 0) {
+                done += written;
+                statBytesTx += written;
+                continue;
+            }
+            if (written < 0 && !wouldBlock()) {
 #ifndef _WIN32
-            if (written < 0 && errno != EINPROGRESS && errno != EAGAIN && errno != EWOULDBLOCK)
-                return ERR_OTHER;
+                if (errno == ENOTCONN || errno == EPIPE || errno == ECONNRESET)
 #else
-            if (written < 0) {
-                int err = WSAGetLastError();
-                if (err == WSAENOTCONN)
+                if (WSAGetLastError() == WSAENOTCONN || WSAGetLastError() == WSAECONNRESET)
+#endif
                     return ERR_EOF;
                 return ERR_OTHER;
             }
-#endif
-
-            if (written > 0)
-                to_write -= written;
+            if (!waitSocket(conn->sock, POLLOUT, connectTimeout)) {
+                statTimeouts++;
+                return done > 0 ? (int)done : ERR_OTHER;
+            }
         }
         return (int)size;
     }
@@ -220,16 +423,31 @@ public:
     int close(int fd) override {
         printf("TCP close: %d\n", fd);
 
-        if (fd >= MAX_FDS || !inUse[fd])
+        if (fd < 0 || fd >= MAX_FDS || !conns[fd])
             return ERR_PARAM;
-#ifndef _WIN32
-        ::close(sockets[fd]);
-#else
-        ::closesocket(sockets[fd]);
-#endif
-        inUse[fd]   = false;
-        sockets[fd] = -1;
-
+        auto conn = std::move(conns[fd]);
+        statOpenConns--;
+
+        // Keep connections that are in a clean state (no unread or pending data) for a next open of the same host
+        if (reuseConnections && !conn->eof && conn->rxPos == conn->rxBuf.size()) {
+            struct pollfd pfd;
+            pfd.fd      = conn->sock;
+            pfd.events  = POLLIN;
+            pfd.revents = 0;
+            if (pollSockets(&pfd, 1, 0) == 0) {
+                conn->rxBuf.clear();
+                conn->rxPos     = 0;
+                conn->idleSince = getTimeMs();
+                idleConns.push_back(std::move(conn));
+                if (idleConns.size() > MAX_IDLE) {
+                    closeSocket(idleConns.front()->sock);
+                    idleConns.pop_front();
+                }
+                updateIdleCount();
+                return 0;
+            }
+        }
+        closeSocket(conn->sock);
         return 0;
     }
 };
@@ -238,3 +456,26 @@ VFS *getTcpVFS() {
     static TcpVFS obj;
     return &obj;
 }
+
+#ifdef EMULATOR
+void setTcpConfig(int connectTimeoutMs, int readTimeoutMs, bool reuseConnections) {
+    auto vfs              = static_cast<TcpVFS *>(getTcpVFS());
+    vfs->connectTimeout   = std::max(connectTimeoutMs, 1);
+    vfs->readTimeout      = std::max(readTimeoutMs, 0);
+    vfs->reuseConnections = reuseConnections;
+}
+
+TcpStats getTcpStats() {
+    auto     vfs = static_cast<TcpVFS *>(getTcpVFS());
+    TcpStats stats;
+    stats.connects        = vfs->statConnects;
+    stats.reused          = vfs->statReused;
+    stats.timeouts        = vfs->statTimeouts;
+    stats.bytesRx         = vfs->statBytesRx;
+    stats.bytesTx         = vfs->statBytesTx;
+    stats.recvCalls       = vfs->statRecvCalls;
+    stats.openConnections = vfs->statOpenConns;
+    stats.idleConnections = vfs->statIdleConns;
+    return stats;
+}
+#endif
@@ -1,16 +1,6 @@
 #include "VFS.h"
 #include <algorithm>
 
-#ifdef EMULATOR
-#ifndef _WIN32
-static inline std::string toUpper(std::string s) {
-    for (auto &ch : s)
-        ch = toupper(ch);
-    return s;
-}
-#endif
-#endif
-
 VFSContext::VFSContext() {
     for (int i = 0; i < MAX_FDS; i++) {
         fdVfs[i] = nullptr;
@@ -27,10 +17,16 @@ std::string VFSContext::resolvePath(std::string path, VFS **vfs, std::string *wi
 
     if (startsWith(path, "http://") || startsWith(path, "https://")) {
         *vfs = getHttpVFS();
+#ifdef EMULATOR
+        lastVfs = *vfs;
+#endif
         return path;
     }
     if (startsWith(path, "tcp://")) {
         *vfs = getTcpVFS();
+#ifdef EMULATOR
+        lastVfs = *vfs;
+#endif
         return path;
     }
 
@@ -89,17 +85,8 @@ std::string VFSContext::resolvePath(std::string path, VFS **vfs, std::string *wi
 #ifdef EMULATOR
 #ifndef _WIN32
         // Handle case-sensitive host file systems
-        auto curPartUpper = toUpper(part);
         if (*vfs == getSDCardVFS()) {
-            auto [deResult, deCtx] = (*vfs)->direnum(result, 0);
-            if (deResult == 0) {
-                for (auto &dee : *deCtx) {
-                    if (toUpper(dee.filename) == curPartUpper) {
-                        part = dee.filename;
-                        break;
-                    }
-                }
-            }
+            sdCardLookupName(result, part, part);
         }
 #endif
 #endif
@@ -108,6 +95,9 @@ std::string VFSContext::resolvePath(std::string path, VFS **vfs, std::string *wi
             result += '/';
         result += part;
     }
+#ifdef EMULATOR
+    lastVfs = *vfs;
+#endif
     return result;
 }
 
@@ -166,6 +156,7 @@ void VFSContext::closeAll() {
     for (int i = 0; i < MAX_DDS; i++) {
         deCtxs[i] = nullptr;
     }
+    dirSnapshots.clear();
 
 #ifdef EMULATOR
     fi.clear();
@@ -212,6 +203,9 @@ int VFSContext::open(uint8_t flags, const std::string &pathArg) {
 int VFSContext::close(int fd) {
     if (fd >= MAX_FDS || fdVfs[fd] == nullptr)
         return ERR_PARAM;
+#ifdef EMULATOR
+    lastVfs = fdVfs[fd];
+#endif
 
     int result = fdVfs[fd]->close(fds[fd]);
     fdVfs[fd]  = nullptr;
@@ -228,6 +222,9 @@ int VFSContext::close(int fd) {
 int VFSContext::read(int fd, size_t size, void *buf) {
     if (fd >= MAX_FDS || fdVfs[fd] == nullptr)
         return ERR_PARAM;
+#ifdef EMULATOR
+    lastVfs = fdVfs[fd];
+#endif
 
     int result = fdVfs[fd]->read(fds[fd], size, buf);
 #ifdef EMULATOR
@@ -241,6 +238,9 @@ int VFSContext::read(int fd, size_t size, void *buf) {
 int VFSContext::readline(int fd, size_t size, void *buf) {
     if (fd >= MAX_FDS || fdVfs[fd] == nullptr)
         return ERR_PARAM;
+#ifdef EMULATOR
+    lastVfs = fdVfs[fd];
+#endif
 
     int result = fdVfs[fd]->readline(fds[fd], size, buf);
 #ifdef EMULATOR
@@ -252,6 +252,9 @@ int VFSContext::readline(int fd, size_t size, void *buf) {
 int VFSContext::write(int fd, size_t size, const void *buf) {
     if (fd >= MAX_FDS || fdVfs[fd] == nullptr)
         return ERR_PARAM;
+#ifdef EMULATOR
+    lastVfs = fdVfs[fd];
+#endif
 
     int result = fdVfs[fd]->write(fds[fd], size, buf);
 #ifdef EMULATOR
@@ -265,6 +268,9 @@ int VFSContext::write(int fd, size_t size, const void *buf) {
 int VFSContext::seek(int fd, size_t offset) {
     if (fd >= MAX_FDS || fdVfs[fd] == nullptr)
         return ERR_PARAM;
+#ifdef EMULATOR
+    lastVfs = fdVfs[fd];
+#endif
 
     int result = fdVfs[fd]->seek(fds[fd], offset);
 #ifdef EMULATOR
@@ -276,6 +282,9 @@ int VFSContext::seek(int fd, size_t offset) {
 int VFSContext::lseek(int fd, int offset, int whence) {
     if (fd >= MAX_FDS || fdVfs[fd] == nullptr)
         return ERR_PARAM;
+#ifdef EMULATOR
+    lastVfs = fdVfs[fd];
+#endif
 
     int result = fdVfs[fd]->lseek(fds[fd], offset, whence);
 #ifdef EMULATOR
@@ -287,6 +296,9 @@ int VFSContext::lseek(int fd, int offset, int whence) {
 int VFSContext::tell(int fd) {
     if (fd >= MAX_FDS || fdVfs[fd] == nullptr)
         return ERR_PARAM;
+#ifdef EMULATOR
+    lastVfs = fdVfs[fd];
+#endif
     int result = fdVfs[fd]->tell(fds[fd]);
     return result;
 }
@@ -310,28 +322,51 @@ int VFSContext::openDirExt(const char *pathArg, uint8_t flags, uint16_t skipCoun
     if (!vfs)
         return ERR_PARAM;
 
-    auto [result, deCtx] = vfs->direnum(path, flags);
-    if (result < 0)
-        return result;
+    // Reuse a previous listing of this directory if it didn't change since
+    DirEnumCtx deCtx;
+    uint64_t   version    = 0;
+    bool       cacheable  = vfs->getDirVersion(path, &version);
+    auto       itSnapshot = std::find_if(dirSnapshots.begin(), dirSnapshots.end(), [&](const DirSnapshot &snapshot) {
+        return snapshot.vfs == vfs && snapshot.flags == flags && snapshot.path == path && snapshot.wildCard == wildCard;
+    });
+    if (itSnapshot != dirSnapshots.end()) {
+        if (cacheable && itSnapshot->version == version)
+            deCtx = itSnapshot->deCtx;
+        dirSnapshots.erase(itSnapshot);
+    }
 
-    if (!path.empty() && (flags & DE_FLAG_DOTDOT) != 0)
-        deCtx->push_back(DirEnumEntry("..", 0, DE_ATTR_DIR, 0, 0));
+    if (!deCtx) {
+        auto [result, newCtx] = vfs->direnum(path, flags);
+        if (result < 0)
+            return result;
+        deCtx = newCtx;
+
+        if (!path.empty() && (flags & DE_FLAG_DOTDOT) != 0)
+            deCtx->push_back(DirEnumEntry("..", 0, DE_ATTR_DIR, 0, 0));
+
+        if (!wildCard.empty())
+            deCtx->erase(
+                std::remove_if(deCtx->begin(), deCtx->end(), [&](DirEnumEntry &de) {
+                    if ((de.attr & DE_ATTR_DIR) != 0 && (flags & DE_FLAG_ALWAYS_DIRS))
+                        return false;
+                    return !wildcardMatch(de.filename, wildCard);
+                }),
+                deCtx->end());
+
+        std::sort(deCtx->begin(), deCtx->end(), [](auto &a, auto &b) {
+            // Sort directories at the top
+            if ((a.attr & DE_ATTR_DIR) != (b.attr & DE_ATTR_DIR))
+                return (a.attr & DE_ATTR_DIR) != 0;
+            return strcasecmp(a.filename.c_str(), b.filename.c_str()) < 0;
+        });
+    }
 
-    if (!wildCard.empty())
-        deCtx->erase(
-            std::remove_if(deCtx->begin(), deCtx->end(), [&](DirEnumEntry &de) {
-                if ((de.attr & DE_ATTR_DIR) != 0 && (flags & DE_FLAG_ALWAYS_DIRS))
-                    return false;
-                return !wildcardMatch(de.filename, wildCard);
-            }),
-            deCtx->end());
-
-    std::sort(deCtx->begin(), deCtx->end(), [](auto &a, auto &b) {
-        // Sort directories at the top
-        if ((a.attr & DE_ATTR_DIR) != (b.attr & DE_ATTR_DIR))
-            return (a.attr & DE_ATTR_DIR) != 0;
-        return strcasecmp(a.filename.c_str(), b.filename.c_str()) < 0;
-    });
+    if (cacheable) {
+        // Most recently used snapshot at the front
+        if (dirSnapshots.size() >= 4)
+            dirSnapshots.pop_back();
+        dirSnapshots.push_front(DirSnapshot{vfs, path, wildCard, flags, version, deCtx});
+    }
 
     deCtxs[dd] = deCtx;
     deIdx[dd]  = skipCount;
@@ -76,6 +76,9 @@ public:
     // Directory operations
     virtual std::pair<int, DirEnumCtx> direnum(const std::string &path, uint8_t flags) { return std::make_pair(ERR_OTHER, nullptr); }
 
+    // Returns a value that changes whenever the directory listing changes, or false if not supported
+    virtual bool getDirVersion(const std::string &path, uint64_t *version) { return false; }
+
     // Filesystem operations
     virtual int delete_(const std::string &path) { return ERR_OTHER; }
     virtual int rename(const std::string &path_old, const std::string &path_new) { return ERR_OTHER; }
@@ -112,6 +115,9 @@ public:
         unsigned    offset;
     };
     std::map<uint8_t, DirInfo> di;
+
+    // Backend accessed by the most recent operation, for per-backend statistics
+    VFS *lastVfs = nullptr;
 #endif
 
     void reset();
@@ -147,8 +153,92 @@ private:
     uint8_t     fds[MAX_FDS];
     DirEnumCtx  deCtxs[MAX_DDS];
     int         deIdx[MAX_DDS];
+
+    // Sorted and filtered directory listings, reused by paged openDirExt calls
+    struct DirSnapshot {
+        VFS        *vfs;
+        std::string path;
+        std::string wildCard;
+        uint8_t     flags;
+        uint64_t    version;
+        DirEnumCtx  deCtx;
+    };
+    std::deque<DirSnapshot> dirSnapshots;
 };
 
 #ifdef EMULATOR
+// 'basePath' is either a host directory or a FAT16/FAT32 disk image file
 void setSDCardPath(const std::string &basePath);
+
+bool mountFatImage(const std::string &path);
+void unmountFatImage();
+VFS *getFatImageVFS(); // nullptr if no image is mounted
+
+struct SDCardImageInfo {
+    std::string path;
+    unsigned    fatBits     = 0;
+    unsigned    clusterSize = 0;
+    uint32_t    clusters    = 0;
+    bool        readOnly    = false;
+    unsigned    cachedDirs  = 0;
+    uint64_t    writeBacks  = 0; // Write-back operations to the image file
+};
+bool getSDCardImageInfo(SDCardImageInfo *info);
+
+#ifndef _WIN32
+// Case-insensitive lookup of 'name' in SD card directory 'dir', used on case-sensitive host file systems
+bool sdCardLookupName(const std::string &dir, const std::string &name, std::string &realName);
+
+struct SDCardNameCacheStats {
+    uint64_t hits          = 0;
+    uint64_t misses        = 0;
+    uint64_t invalidations = 0;
+    size_t   dirs          = 0;
+};
+SDCardNameCacheStats getSDCardNameCacheStats();
+#endif
+
+struct SDCardIoStats {
+    uint64_t reads        = 0; // Number of read calls
+    uint64_t readSyscalls = 0; // Host system calls done for those reads
+    uint64_t bytesRead    = 0;
+    uint64_t syscalls     = 0; // All host system calls for file I/O
+    unsigned openFiles    = 0;
+};
+SDCardIoStats getSDCardIoStats();
+
+void setTcpConfig(int connectTimeoutMs, int readTimeoutMs, bool reuseConnections);
+
+struct TcpStats {
+    uint64_t connects        = 0; // New connections made
+    uint64_t reused          = 0; // Opens served by an idle connection
+    uint64_t timeouts        = 0;
+    uint64_t bytesRx         = 0;
+    uint64_t bytesTx         = 0;
+    uint64_t recvCalls       = 0;
+    unsigned openConnections = 0;
+    unsigned idleConnections = 0;
+};
+TcpStats getTcpStats();
+
+#ifndef _WIN32
+// Directory used to cache files retrieved by HttpVFS, empty to disable caching
+void setHttpCachePath(const std::string &path);
+
+struct HttpRequestInfo {
+    std::string url;
+    int         status    = 0;
+    size_t      bytes     = 0;
+    float       latencyMs = 0;
+    bool        reused    = false; // Sent on a kept-alive connection
+};
+struct HttpStats {
+    uint64_t                     requests    = 0;
+    uint64_t                     bytes       = 0;
+    uint64_t                     cacheHits   = 0;
+    uint64_t                     connections = 0; // New connections made
+    std::vector<HttpRequestInfo> recent;
+};
+HttpStats getHttpStats();
+#endif
 #endif
@@ -3,11 +3,152 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <vector>
 #include <stdio.h>
 #include <string.h>
+#include <list>
 #include <set>
 
-static std::chrono::time_point startTime = std::chrono::steady_clock::now();
+//////////////////////////////////////////////////////////////////////////////
+// Scheduler
+//////////////////////////////////////////////////////////////////////////////
+
+// All kernel objects are protected by a single mutex, like the critical sections of the real
+// kernel. Blocking calls register a waiter, which is woken when its condition becomes true or its
+// deadline passes.
+struct Waiter {
+    std::function<bool()>                 ready;
+    uint64_t                              deadline; // In ticks, UINT64_MAX to wait forever
+    std::chrono::steady_clock::time_point realDeadline;
+    bool                                  isTask;
+    bool                                  woken = false;
+    std::condition_variable               cv;
+};
+
+static std::mutex              rtosMutex;
+static std::list<Waiter *>     waiters;
+static std::condition_variable idleCv;
+static unsigned                runningTasks = 0; // Tasks not blocked in one of the functions below
+static thread_local bool       isTask       = false;
+
+static bool                                  virtualTime   = false;
+static uint64_t                              virtualUs     = 0;
+static uint64_t                              realBaseTicks = 0;
+static std::chrono::steady_clock::time_point realBaseTime  = std::chrono::steady_clock::now();
+
+static uint64_t getTicks() {
+    if (virtualTime)
+        return virtualUs / 1000;
+    return realBaseTicks + std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - realBaseTime).count();
+}
+
+// Only tasks run on virtual time. Other threads, like the emulation thread that advances it, time
+// out on the wall clock.
+static bool expired(const Waiter *w) {
+    if (w->deadline == UINT64_MAX)
+        return false;
+    if (w->isTask)
+        return getTicks() >= w->deadline;
+    return std::chrono::steady_clock::now() >= w->realDeadline;
+}
+
+// Wake waiters that can continue. In virtual time mode, woken tasks count as running right away,
+// so FreeRtosMock_advance() can wait for them.
+static void wakeReady() {
+    for (auto w : waiters) {
+        if (!w->woken && (w->ready() || expired(w))) {
+            w->woken = true;
+            if (w->isTask)
+                runningTasks++;
+            w->cv.notify_one();
+        }
+    }
+}
+
+// Block until 'ready' returns true or the timeout expires, returns the final value of 'ready'
+static bool waitFor(std::unique_lock<std::mutex> &lock, TickType_t ticksToWait, std::function<bool()> ready) {
+    if (ready())
+        return true;
+    if (ticksToWait == 0)
+        return false;
+
+    Waiter w;
+    w.ready        = std::move(ready);
+    w.deadline     = (ticksToWait == portMAX_DELAY) ? UINT64_MAX : getTicks() + ticksToWait;
+    w.realDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ticksToWait);
+    w.isTask       = isTask;
+    auto it        = waiters.insert(waiters.end(), &w);
+
+    if (w.isTask && --runningTasks == 0)
+        idleCv.notify_all();
+
+    bool result = false;
+    while (1) {
+        if (w.ready()) {
+            result = true;
+            break;
+        }
+        if (expired(&w))
+            break;
+
+        if (w.woken) {
+            // Someone else got there first, block again
+            w.woken = false;
+            if (w.isTask && --runningTasks == 0)
+                idleCv.notify_all();
+        }
+
+        if (w.deadline == UINT64_MAX || (w.isTask && virtualTime)) {
+            w.cv.wait(lock);
+        } else if (w.isTask) {
+            w.cv.wait_until(lock, realBaseTime + std::chrono::milliseconds(w.deadline - realBaseTicks));
+        } else {
+            w.cv.wait_until(lock, w.realDeadline);
+        }
+    }
+
+    waiters.erase(it);
+    if (w.isTask && !w.woken)
+        runningTasks++;
+    return result;
+}
+
+void FreeRtosMock_setVirtualTime(bool enable) {
+    std::lock_guard lock(rtosMutex);
+    if (enable == virtualTime)
+        return;
+
+    // Keep the tick count continuous
+    auto ticks = getTicks();
+    if (enable) {
+        virtualUs = ticks * 1000;
+    } else {
+        realBaseTicks = ticks;
+        realBaseTime  = std::chrono::steady_clock::now();
+    }
+    virtualTime = enable;
+
+    // Let waiters recompute their deadline in the new time base
+    for (auto w : waiters)
+        w->cv.notify_one();
+    idleCv.notify_all();
+}
+
+void FreeRtosMock_advance(uint64_t us) {
+    std::unique_lock lock(rtosMutex);
+    if (!virtualTime)
+        return;
+
+    virtualUs += us;
+    wakeReady();
+
+    // Let the woken tasks run until they block again. Tasks waiting on something other than the
+    // mocked kernel objects (e.g. file I/O) can't be tracked, so don't stall the emulation forever.
+    idleCv.wait_for(lock, std::chrono::milliseconds(100), [] { return runningTasks == 0 || !virtualTime; });
+}
 
 //////////////////////////////////////////////////////////////////////////////
 // Task
@@ -16,6 +157,21 @@ struct tskTaskControlBlock {
     std::thread t;
 };
 
+static void startTask(std::function<void()> fn, tskTaskControlBlock *tcb) {
+    {
+        std::lock_guard lock(rtosMutex);
+        runningTasks++;
+    }
+    tcb->t = std::thread([fn = std::move(fn)]() {
+        isTask = true;
+        fn();
+
+        std::lock_guard lock(rtosMutex);
+        if (--runningTasks == 0)
+            idleCv.notify_all();
+    });
+}
+
 BaseType_t xTaskCreate(
     TaskFunction_t               pxTaskCode,
     const char *const            pcName,
@@ -25,9 +181,7 @@ BaseType_t xTaskCreate(
     TaskHandle_t *const          pxCreatedTask) {
 
     auto tcb = new tskTaskControlBlock();
-    tcb->t   = std::thread([pxTaskCode, pvParameters]() {
-        pxTaskCode(pvParameters);
-    });
+    startTask([pxTaskCode, pvParameters]() { pxTaskCode(pvParameters); }, tcb);
 
     if (pxCreatedTask) {
         *pxCreatedTask = tcb;
@@ -39,113 +193,187 @@ BaseType_t xTaskCreate(
 }
 
 TickType_t xTaskGetTickCount() {
-    auto now = std::chrono::steady_clock::now();
-    return (TickType_t)std::chrono::duration_cast<std::chrono::milliseconds>(now - startTime).count();
+    std::lock_guard lock(rtosMutex);
+    return (TickType_t)getTicks();
 }
 
 void vTaskDelay(const TickType_t xTicksToDelay) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(xTicksToDelay));
+    std::unique_lock lock(rtosMutex);
+    waitFor(lock, xTicksToDelay, [] { return false; });
 }
 
 //////////////////////////////////////////////////////////////////////////////
 // Queue
 //////////////////////////////////////////////////////////////////////////////
+// Bounded multi-producer/multi-consumer ring: each cell's sequence number tells whether it is free
+// for the producer or filled for the consumer at a given position. Sends and receives that don't
+// have to wait never take the kernel mutex.
 struct QueueDefinition {
-    std::timed_mutex            mutex;
-    std::condition_variable_any cvSend;
-    std::condition_variable_any cvReceive;
-
-    uint8_t    *buf;
-    UBaseType_t length;
-    UBaseType_t itemSize;
-    unsigned    count;
-    unsigned    wrIdx;
-    unsigned    rdIdx;
+    uint8_t              *buf;
+    std::atomic<size_t>  *sequence;
+    UBaseType_t           length;
+    UBaseType_t           itemSize;
+    std::atomic<unsigned> blocked{0}; // Senders/receivers waiting in the slow path
+
+    alignas(64) std::atomic<size_t> enqueuePos{0};
+    alignas(64) std::atomic<size_t> dequeuePos{0};
+
+    bool tryPush(const void *item) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        while (1) {
+            size_t   seq  = sequence[pos % length].load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                // Full
+                return false;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        memcpy(buf + itemSize * (pos % length), item, itemSize);
+        sequence[pos % length].store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(void *item) {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        while (1) {
+            size_t   seq  = sequence[pos % length].load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                // Empty
+                return false;
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        memcpy(item, buf + itemSize * (pos % length), itemSize);
+        sequence[pos % length].store(pos + length, std::memory_order_release);
+        return true;
+    }
+
+    // Called after a successful push or pop, wakes waiters on the other side
+    void notify() {
+        // Pairs with the fence in wait(): either the waiter sees our update, or we see the waiter
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (blocked.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard lock(rtosMutex);
+            wakeReady();
+        }
+    }
+
+    // Slow path, 'op' is retried from the scheduler until it succeeds or the timeout expires
+    bool wait(TickType_t ticksToWait, const std::function<bool()> &op) {
+        std::unique_lock lock(rtosMutex);
+        blocked++;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        bool done   = false;
+        bool result = waitFor(lock, ticksToWait, [&] {
+            if (!done)
+                done = op();
+            return done;
+        });
+        blocked--;
+
+        // Our success may unblock waiters on the other side
+        if (result)
+            wakeReady();
+        return result;
+    }
 };
 
 QueueHandle_t xQueueCreate(const UBaseType_t uxQueueLength, const UBaseType_t uxItemSize) {
     auto qh      = new QueueDefinition();
     qh->buf      = new uint8_t[uxQueueLength * uxItemSize];
+    qh->sequence = new std::atomic<size_t>[uxQueueLength];
     qh->itemSize = uxItemSize;
     qh->length   = uxQueueLength;
-    qh->count    = 0;
-    qh->wrIdx    = 0;
-    qh->rdIdx    = 0;
+    for (unsigned i = 0; i < uxQueueLength; i++)
+        qh->sequence[i].store(i, std::memory_order_relaxed);
     return qh;
 }
 
 BaseType_t xQueueSend(QueueHandle_t xQueue, const void *const pvItemToQueue, TickType_t xTicksToWait) {
-    auto tpUntil = std::chrono::steady_clock::now() + std::chrono::milliseconds(xTicksToWait);
-
-    std::unique_lock lock(xQueue->mutex, std::defer_lock);
-    while (1) {
-        if (lock.try_lock_until(tpUntil)) {
-            if (xQueue->count < xQueue->length) {
-                // Copy item into queue
-                memcpy(xQueue->buf + xQueue->itemSize * xQueue->wrIdx, pvItemToQueue, xQueue->itemSize);
-                xQueue->count++;
-                if (++xQueue->wrIdx >= xQueue->length)
-                    xQueue->wrIdx = 0;
-
-                xQueue->cvSend.notify_one();
-                return pdTRUE;
-            }
-
-            if (!xQueue->cvReceive.wait_until(lock, tpUntil, [xQueue] { return xQueue->count < xQueue->length; })) {
-                return pdFALSE;
-            }
-
-            lock.unlock();
-        }
+    if (xQueue->tryPush(pvItemToQueue)) {
+        xQueue->notify();
+        return pdTRUE;
     }
-    return pdFALSE;
+    if (xTicksToWait == 0)
+        return pdFALSE;
+    return xQueue->wait(xTicksToWait, [=] { return xQueue->tryPush(pvItemToQueue); }) ? pdTRUE : pdFALSE;
 }
 
 BaseType_t xQueueReceive(QueueHandle_t xQueue, void *const pvBuffer, TickType_t xTicksToWait) {
-    auto tpUntil = std::chrono::steady_clock::now() + std::chrono::milliseconds(xTicksToWait);
-
-    std::unique_lock lock(xQueue->mutex, std::defer_lock);
-    while (1) {
-        if (lock.try_lock_until(tpUntil)) {
-            if (xQueue->count > 0) {
-                // Copy item from queue
-                memcpy(pvBuffer, xQueue->buf + xQueue->itemSize * xQueue->rdIdx, xQueue->itemSize);
-                xQueue->count--;
-                if (++xQueue->rdIdx >= xQueue->length)
-                    xQueue->rdIdx = 0;
-
-                xQueue->cvReceive.notify_one();
-                return pdTRUE;
-            }
-
-            if (!xQueue->cvSend.wait_until(lock, tpUntil, [xQueue] { return xQueue->count > 0; })) {
-                return pdFALSE;
-            }
-
-            lock.unlock();
-        }
+    if (xQueue->tryPop(pvBuffer)) {
+        xQueue->notify();
+        return pdTRUE;
     }
-    return pdFALSE;
+    if (xTicksToWait == 0)
+        return pdFALSE;
+    return xQueue->wait(xTicksToWait, [=] { return xQueue->tryPop(pvBuffer); }) ? pdTRUE : pdFALSE;
 }
 
 BaseType_t xQueueReset(QueueHandle_t xQueue) {
-    std::lock_guard lock(xQueue->mutex);
-    xQueue->count = 0;
-    xQueue->wrIdx = 0;
-    xQueue->rdIdx = 0;
+    // Discard the queued items
+    std::vector<uint8_t> tmp(xQueue->itemSize);
+    while (xQueue->tryPop(tmp.data())) {
+    }
+    xQueue->notify();
     return pdTRUE;
 }
 
 UBaseType_t uxQueueMessagesWaiting(const QueueHandle_t xQueue) {
-    std::lock_guard lock(xQueue->mutex);
-    return xQueue->count;
+    size_t enqueuePos = xQueue->enqueuePos.load(std::memory_order_acquire);
+    size_t dequeuePos = xQueue->dequeuePos.load(std::memory_order_acquire);
+    return (UBaseType_t)std::min(enqueuePos - std::min(dequeuePos, enqueuePos), (size_t)xQueue->length);
+}
+
+double FreeRtosMock_benchmarkQueue(unsigned producers, unsigned consumers) {
+    const unsigned perProducer = 200000;
+    auto           q           = xQueueCreate(16, sizeof(uint32_t));
+    uint64_t       total       = (uint64_t)producers * perProducer;
+
+    std::atomic<uint64_t>    received{0};
+    std::vector<std::thread> threads;
+    auto                     start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < producers; i++) {
+        threads.emplace_back([=] {
+            for (uint32_t n = 0; n < perProducer; n++)
+                xQueueSend(q, &n, portMAX_DELAY);
+        });
+    }
+    for (unsigned i = 0; i < consumers; i++) {
+        threads.emplace_back([&] {
+            uint32_t val;
+            while (received.load(std::memory_order_relaxed) < total) {
+                if (xQueueReceive(q, &val, pdMS_TO_TICKS(10)))
+                    received++;
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    delete[] q->buf;
+    delete[] q->sequence;
+    delete q;
+    return total / elapsed;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 // Semaphore
 //////////////////////////////////////////////////////////////////////////////
 struct SemaphoreDefinition {
-    std::recursive_timed_mutex mutex;
+    std::thread::id owner;
+    unsigned        count = 0;
 };
 
 SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() {
@@ -154,11 +382,25 @@ SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() {
 }
 
 BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t xMutex, TickType_t xTicksToWait) {
-    return xMutex->mutex.try_lock_for(std::chrono::milliseconds(xTicksToWait)) ? pdTRUE : pdFALSE;
+    auto            self = std::this_thread::get_id();
+    std::unique_lock lock(rtosMutex);
+    if (!waitFor(lock, xTicksToWait, [xMutex, self] { return xMutex->count == 0 || xMutex->owner == self; }))
+        return pdFALSE;
+
+    xMutex->owner = self;
+    xMutex->count++;
+    return pdTRUE;
 }
 
 BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t xMutex) {
-    xMutex->mutex.unlock();
+    std::lock_guard lock(rtosMutex);
+    if (xMutex->count == 0 || xMutex->owner != std::this_thread::get_id())
+        return pdFALSE;
+
+    if (--xMutex->count == 0) {
+        xMutex->owner = std::thread::id();
+        wakeReady();
+    }
     return pdTRUE;
 }
 
@@ -170,22 +412,23 @@ void vSemaphoreDelete(SemaphoreHandle_t xMutex) {
 // Timer
 //////////////////////////////////////////////////////////////////////////////
 struct tmrTimerControl {
-    TickType_t                            period;
-    bool                                  autoReload;
-    void                                 *timerId;
-    TimerCallbackFunction_t               func;
-    std::chrono::steady_clock::time_point expiryTime;
+    TickType_t              period;
+    bool                    autoReload;
+    void                   *timerId;
+    TimerCallbackFunction_t func;
+    uint64_t                expiryTime;
 };
 
 static auto compTc = [](const tmrTimerControl *lhs, const tmrTimerControl *rhs) {
-    return lhs->expiryTime < rhs->expiryTime;
+    if (lhs->expiryTime != rhs->expiryTime)
+        return lhs->expiryTime < rhs->expiryTime;
+    return lhs < rhs;
 };
 
 static std::set<tmrTimerControl *, decltype(compTc)> activeTimers(compTc);
-static std::timed_mutex                              activeTimersMutex;
-static std::condition_variable_any                   activeTimersCv;
-static bool                                          quit = false;
-static std::thread                                   timerThread;
+static bool                                          timersChanged = false;
+static bool                                          quit          = false;
+static tskTaskControlBlock                           timerTask;
 
 TimerHandle_t xTimerCreate(
     const char *const       pcTimerName,
@@ -203,7 +446,7 @@ TimerHandle_t xTimerCreate(
 }
 
 BaseType_t xTimerDelete(TimerHandle_t xTimer, TickType_t xTicksToWait) {
-    std::lock_guard lock(activeTimersMutex);
+    std::lock_guard lock(rtosMutex);
     activeTimers.erase(xTimer);
     delete xTimer;
     return pdTRUE;
@@ -214,44 +457,41 @@ void *pvTimerGetTimerID(const TimerHandle_t xTimer) {
 }
 
 BaseType_t xTimerStart(TimerHandle_t xTimer, TickType_t xTicksToWait) {
-    std::lock_guard lock(activeTimersMutex);
+    std::lock_guard lock(rtosMutex);
     activeTimers.erase(xTimer);
 
-    xTimer->expiryTime = std::chrono::steady_clock::now() + std::chrono::milliseconds(xTimer->period);
+    xTimer->expiryTime = getTicks() + xTimer->period;
     activeTimers.insert(xTimer);
 
-    activeTimersCv.notify_one();
+    timersChanged = true;
+    wakeReady();
     return pdTRUE;
 }
 
 BaseType_t xTimerStop(TimerHandle_t xTimer, TickType_t xTicksToWait) {
-    std::lock_guard lock(activeTimersMutex);
+    std::lock_guard lock(rtosMutex);
     activeTimers.erase(xTimer);
 
-    activeTimersCv.notify_one();
+    timersChanged = true;
+    wakeReady();
     return pdTRUE;
 }
 
 BaseType_t xTimerReset(TimerHandle_t xTimer, TickType_t xTicksToWait) {
-    std::lock_guard lock(activeTimersMutex);
-    activeTimers.erase(xTimer);
-
-    xTimer->expiryTime = std::chrono::steady_clock::now() + std::chrono::milliseconds(xTimer->period);
-    activeTimers.insert(xTimer);
-
-    activeTimersCv.notify_one();
-    return pdTRUE;
+    return xTimerStart(xTimer, xTicksToWait);
 }
 
-static void timerThreadFunc() {
-    std::unique_lock lock(activeTimersMutex);
+// Timer service task, callbacks are executed from here like on the real kernel
+static void timerTaskFunc() {
+    std::unique_lock lock(rtosMutex);
     while (!quit) {
+        auto now = getTicks();
         if (!activeTimers.empty()) {
             auto t = *activeTimers.begin();
-            if (t->expiryTime <= std::chrono::steady_clock::now()) {
+            if (t->expiryTime <= now) {
                 activeTimers.erase(t);
                 if (t->autoReload) {
-                    t->expiryTime += std::chrono::milliseconds(t->period);
+                    t->expiryTime += t->period;
                     activeTimers.insert(t);
                 }
                 lock.unlock();
@@ -259,25 +499,24 @@ static void timerThreadFunc() {
                 lock.lock();
                 continue;
             }
-
-            activeTimersCv.wait_until(lock, t->expiryTime);
-
-        } else {
-            activeTimersCv.wait(lock);
         }
+
+        TickType_t ticksToWait = activeTimers.empty() ? portMAX_DELAY : (TickType_t)((*activeTimers.begin())->expiryTime - now);
+        timersChanged          = false;
+        waitFor(lock, ticksToWait, [] { return quit || timersChanged; });
     }
 }
 
 void FreeRtosMock_init() {
-    timerThread = std::thread([] { timerThreadFunc(); });
-
-    // startTime = std::chrono::steady_clock::now();
+    quit = false;
+    startTask([] { timerTaskFunc(); }, &timerTask);
 }
 
 void FreeRtosMock_deinit() {
-    quit = true;
-    activeTimersCv.notify_all();
-    timerThread.join();
-
-    // startTime = std::chrono::steady_clock::now();
+    {
+        std::lock_guard lock(rtosMutex);
+        quit = true;
+        wakeReady();
+    }
+    timerTask.t.join();
 }
@@ -32,6 +32,13 @@ typedef unsigned portBASE_TYPE UBaseType_t;
 void FreeRtosMock_init();
 void FreeRtosMock_deinit();
 
+// In virtual time mode the tick count only advances through FreeRtosMock_advance(), which the
+// emulation loop calls with the emulated time that passed. Tasks and timers whose deadline passed
+// are woken, and the call returns once all tasks are blocked again, so the ESP side runs in
+// lockstep with the emulated machine instead of the wall clock.
+void FreeRtosMock_setVirtualTime(bool enable);
+void FreeRtosMock_advance(uint64_t us);
+
 //////////////////////////////////////////////////////////////////////////////
 // Task
 //////////////////////////////////////////////////////////////////////////////
@@ -60,6 +67,10 @@ BaseType_t    xQueueReceive(QueueHandle_t xQueue, void *const pvBuffer, TickType
 BaseType_t    xQueueReset(QueueHandle_t xQueue);
 UBaseType_t   uxQueueMessagesWaiting(const QueueHandle_t xQueue);
 
+// Messages per second through a 16 entry queue, with the given number of sending and receiving
+// threads blocking on it
+double FreeRtosMock_benchmarkQueue(unsigned producers, unsigned consumers);
+
 //////////////////////////////////////////////////////////////////////////////
 // Semaphore
 //////////////////////////////////////////////////////////////////////////////
@@ -2016,3 +2016,16 @@ enum xz_ret xz_decompress(const uint8_t *in, int in_size, uint8_t *out) {
 
     return ret;
 }
+
+struct xz_dec *xz_stream_init(void) {
+    xz_crc32_init();
+    return xz_dec_init(0);
+}
+
+enum xz_ret xz_stream_run(struct xz_dec *s, struct xz_buf *b) {
+    return dec_main(s, b);
+}
+
+void xz_stream_end(struct xz_dec *s) {
+    xz_dec_end(s);
+}
@@ -27,6 +27,13 @@ struct xz_buf {
 
 enum xz_ret xz_decompress(const uint8_t *in, int in_size, uint8_t *out);
 
+// Incremental decompression into a single output buffer that holds the complete file. Input can be
+// supplied in parts, xz_stream_run() returns XZ_INTERNAL_OK when it needs more input.
+struct xz_dec;
+struct xz_dec *xz_stream_init(void);
+enum xz_ret    xz_stream_run(struct xz_dec *s, struct xz_buf *b);
+void           xz_stream_end(struct xz_dec *s);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,5 +1,6 @@
 #include "EmuState.h"
 #include "FpgaCore.h"
+#include <chrono>
 
 static std::shared_ptr<EmuState> curEmuState;
 
@@ -74,93 +75,226 @@ void EmuState::renderOverlay(void *pixels, int pitch) {
 void EmuState::spiSel(bool enable) {
     if (spiSelected == enable)
         return;
+
+    // Commands without a response are dispatched on deselect
+    if (!enable && !spiDone && !txBuf.empty())
+        spiTransaction(txBuf[0], txBuf.data() + 1, txBuf.size() - 1, nullptr, 0);
+
     spiSelected = enable;
+    spiDone     = false;
     txBuf.clear();
 }
 
 void EmuState::spiTx(const void *data, size_t length) {
-    if (!spiSelected)
+    if (!spiSelected || spiDone)
         return;
 
     auto p = static_cast<const uint8_t *>(data);
     txBuf.insert(txBuf.end(), p, p + length);
-    if (txBuf.empty())
+}
+
+void EmuState::spiRx(void *buf, size_t length) {
+    memset(buf, 0, length);
+    if (!spiSelected || spiDone || txBuf.empty())
+        return;
+
+    // Commands with a response are dispatched on the first read, directly into the caller's buffer
+    spiDone = true;
+    spiTransaction(txBuf[0], txBuf.data() + 1, txBuf.size() - 1, static_cast<uint8_t *>(buf), length);
+}
+
+void EmuState::spiTransaction(uint8_t cmd, const uint8_t *data, size_t length, uint8_t *rxBuf, size_t rxLength) {
+    if (cmd == CMD_GET_SYSINFO || cmd == CMD_GET_NAME1 || cmd == CMD_GET_NAME2) {
+        // Constant core information, no need to synchronize with the emulation thread
+        EmuState::spiCommand(cmd, data, length, rxBuf, rxLength);
         return;
+    }
+    if (std::this_thread::get_id() == emuThreadId) {
+        // Execute directly, after any commands still in the mailbox. The mailbox is only drained with the
+        // mutex held, on this thread it is either already held or free.
+        std::lock_guard lock(mutex);
+        spiDrain();
+        spiCommand(cmd, data, length, rxBuf, rxLength);
+        return;
+    }
+
+    SpiMessage msg;
+    msg.cmd = cmd;
+    msg.data.assign(data, data + length);
+    if (rxLength == 0) {
+        spiMailbox.push(std::move(msg));
+        return;
+    }
+
+    // The caller may hold the FPGA mutex, which the emulation thread can take while holding the core
+    // mutex, so never block on the core mutex here. The emulation thread executes the command at the next
+    // line boundary. When it is not inside a frame (the mutex is free) the mailbox is drained right here.
+    auto response = std::make_shared<SpiResponse>();
+    response->data.resize(rxLength);
+    msg.response = response;
+    spiMailbox.push(std::move(msg));
+
+    while (true) {
+        if (mutex.try_lock()) {
+            spiDrain();
+            mutex.unlock();
+        }
+
+        std::unique_lock lock(response->mutex);
+        if (response->cv.wait_for(lock, std::chrono::milliseconds(1), [&] { return response->done; }))
+            break;
+
+        // Give up when this core was unloaded
+        if (EmuState::get().get() != this)
+            return;
+    }
+    memcpy(rxBuf, response->data.data(), rxLength);
+}
+
+void EmuState::spiDrainMailbox() {
+    SpiMessage msg;
+    while (spiMailbox.pop(msg)) {
+        if (!msg.response) {
+            spiCommand(msg.cmd, msg.data.data(), msg.data.size(), nullptr, 0);
+            continue;
+        }
+
+        auto &response = *msg.response;
+        spiCommand(msg.cmd, msg.data.data(), msg.data.size(), response.data.data(), response.data.size());
+        std::lock_guard lock(response.mutex);
+        response.done = true;
+        response.cv.notify_one();
+    }
+}
 
-    switch (txBuf[0]) {
+void EmuState::spiCommand(uint8_t cmd, const uint8_t *data, size_t length, uint8_t *rxBuf, size_t rxLength) {
+    switch (cmd) {
         case CMD_RESET: {
-            if (txBuf.size() == 1 + 1) {
-                if (txBuf[1] & 2) {
+            if (length == 1) {
+                if (data[0] & 2) {
                     reset(true);
                 } else {
                     reset(false);
                 }
+                *typeInResetting = false;
             }
             break;
         }
 
         case CMD_GET_SYSINFO: {
-            if (txBuf.size() == 2) {
-                rxQueue.push(coreType);
-                rxQueue.push(coreFlags);
-                rxQueue.push(coreVersionMajor);
-                rxQueue.push(coreVersionMinor);
+            if (length == 1) {
+                uint8_t sysInfo[4] = {coreType, coreFlags, coreVersionMajor, coreVersionMinor};
+                memcpy(rxBuf, sysInfo, std::min(rxLength, sizeof(sysInfo)));
             }
             break;
         }
         case CMD_GET_NAME1: {
-            if (txBuf.size() == 2) {
-                rxQueuePushData(coreName, 8);
+            if (length == 1) {
+                memcpy(rxBuf, coreName, std::min(rxLength, (size_t)8));
             }
             break;
         }
         case CMD_GET_NAME2: {
-            if (txBuf.size() == 2) {
-                rxQueuePushData(coreName + 8, 8);
+            if (length == 1) {
+                memcpy(rxBuf, coreName + 8, std::min(rxLength, (size_t)8));
             }
             break;
         }
 
         case CMD_OVL_TEXT: {
-            if (txBuf.size() == 1 + 2048) {
-                memcpy(ovlText, &txBuf[1], 2048);
+            if (length == sizeof(ovlText)) {
+                memcpy(ovlText, data, sizeof(ovlText));
             }
             break;
         }
         case CMD_OVL_PALETTE: {
-            if (txBuf.size() == 1 + 32) {
-                memcpy(ovlPalette, &txBuf[1], 32);
+            if (length == sizeof(ovlPalette)) {
+                memcpy(ovlPalette, data, sizeof(ovlPalette));
             }
             break;
         }
         case CMD_OVL_FONT: {
-            if (txBuf.size() == 1 + 2048) {
-                memcpy(ovlFont, &txBuf[1], 2048);
+            if (length == sizeof(ovlFont)) {
+                memcpy(ovlFont, data, sizeof(ovlFont));
             }
             break;
         }
     }
 }
 
-void EmuState::spiRx(void *buf, size_t length) {
-    if (!spiSelected)
+void EmuState::pasteText(const std::string &str) {
+    std::lock_guard lock(typeInMutex);
+    typeInStr    = str;
+    typeInPos    = 0;
+    typeInActive = !typeInStr.empty();
+}
+
+bool EmuState::pasteIsDone() {
+    return !typeInActive;
+}
+
+bool EmuState::pasteProgress(size_t &done, size_t &total) {
+    std::lock_guard lock(typeInMutex);
+    done  = typeInPos;
+    total = typeInStr.size();
+    return typeInActive;
+}
+
+void EmuState::pasteCancel() {
+    std::lock_guard lock(typeInMutex);
+    typeInStr.clear();
+    typeInPos    = 0;
+    typeInActive = false;
+}
+
+void EmuState::typeInFeed() {
+    std::lock_guard lock(typeInMutex);
+    if (*typeInResetting)
         return;
 
-    uint8_t *p = static_cast<uint8_t *>(buf);
-    for (unsigned i = 0; i < length; i++) {
-        uint8_t val = 0;
-        if (!rxQueue.empty()) {
-            val = rxQueue.front();
-            rxQueue.pop();
+    // Top up the keyboard buffer with as many characters as the guest has consumed. The characters go
+    // straight into the core instead of through Keyboard::pressKey(), which would take the FPGA mutex
+    // on the emulation thread while an ESP task holding it may be waiting for this thread.
+    unsigned space = typeInSpace();
+    while (space > 0 && typeInPos < typeInStr.size()) {
+        uint8_t ch = typeInStr[typeInPos++];
+        if (ch == '\n')
+            ch = '\r';
+
+        if (ch == 0x1C || ch == 0x1D) {
+            // Delays, not needed since the guest paces the feed
+            continue;
         }
-        *(p++) = val;
-    }
-}
+        if (ch == 0x1E) {
+            // Reset through the FPGA core like Keyboard::pressKey() does, so the core's reset configuration
+            // applies (Aq+: T80, cold/warm reset, start screen bypass). That takes the FPGA mutex as well,
+            // so it is done on another thread. Its reset command reaches this thread through the SPI
+            // mailbox, typing continues after that.
+            *typeInResetting = true;
+            std::thread([resetting = typeInResetting, typing = typeInPos < typeInStr.size()] {
+                auto core = FpgaCore::get();
+                if (!core) {
+                    *resetting = false;
+                    return;
+                }
+                core->resetCore();
 
-void EmuState::rxQueuePushData(const void *_p, size_t size) {
-    auto p = static_cast<const uint8_t *>(_p);
-    while (size--) {
-        rxQueue.push(*(p++));
+                // Typed keys cancel the start screen bypass, like the keys pressKey() passes to keyChar()
+                if (typing)
+                    core->cancelBypassStart();
+            }).detach();
+            break;
+        }
+        if (ch > '~')
+            continue;
+
+        typeInKey(ch);
+        space--;
+    }
+    if (typeInPos >= typeInStr.size()) {
+        typeInStr.clear();
+        typeInPos    = 0;
+        typeInActive = false;
     }
 }
 
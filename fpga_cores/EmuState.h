@@ -1,6 +1,10 @@
 #pragma once
 
 #include "Common.h"
+#include "MpscQueue.h"
+#include <atomic>
+#include <condition_variable>
+#include <thread>
 
 #define ERF_RENDER_SCREEN    (1 << 0)
 #define ERF_NEW_AUDIO_SAMPLE (1 << 1)
@@ -19,9 +23,16 @@ public:
     virtual void spiTx(const void *data, size_t length);
     virtual void spiRx(void *buf, size_t length);
 
+    // Complete SPI command. 'data' points to the payload following the command byte, up to 'rxLength'
+    // response bytes are written to 'rxBuf'. Commands issued from other threads are queued and executed
+    // by the emulation thread at the next frame or line boundary, commands with a response wait for that.
+    void spiTransaction(uint8_t cmd, const uint8_t *data, size_t length, uint8_t *rxBuf, size_t rxLength);
+
     virtual void fileMenu() {}
-    virtual void pasteText(const std::string &str) {}
-    virtual bool pasteIsDone() { return true; }
+    virtual void pasteText(const std::string &str);
+    virtual bool pasteIsDone();
+    virtual bool pasteProgress(size_t &done, size_t &total);
+    virtual void pasteCancel();
 
     virtual bool getDebuggerEnabled() { return enableDebugger; };
     virtual void setDebuggerEnabled(bool en) { enableDebugger = en; };
@@ -39,12 +50,62 @@ protected:
     // Debugging
     bool enableDebugger = false;
 
-    // SPI interface
-    bool                 spiSelected = false;
-    std::vector<uint8_t> txBuf;
-    std::queue<uint8_t>  rxQueue;
+    // Emulation thread synchronization. The mutex is held by the emulation thread for the duration of
+    // a frame. SPI commands never take it, they are executed by the emulation thread itself.
+    std::recursive_mutex         mutex;
+    std::atomic<std::thread::id> emuThreadId;
 
-    void rxQueuePushData(const void *_p, size_t size);
+    void beginFrame() {
+        emuThreadId = std::this_thread::get_id();
+        spiDrain();
+    }
+
+    // SPI interface
+    struct SpiResponse {
+        std::mutex              mutex;
+        std::condition_variable cv;
+        bool                    done = false;
+        std::vector<uint8_t>    data;
+    };
+    struct SpiMessage {
+        uint8_t                      cmd = 0;
+        std::vector<uint8_t>         data;
+        std::shared_ptr<SpiResponse> response; // Set when the sender waits for a response
+    };
+    bool                  spiSelected = false;
+    bool                  spiDone     = false;
+    std::vector<uint8_t>  txBuf;
+    MpscQueue<SpiMessage> spiMailbox;
+
+    void spiDrain() {
+        if (!spiMailbox.empty())
+            spiDrainMailbox();
+    }
+    void spiDrainMailbox();
+
+    // Handle a SPI command, always called on the emulation thread (or with mutex held)
+    virtual void spiCommand(uint8_t cmd, const uint8_t *data, size_t length, uint8_t *rxBuf, size_t rxLength);
+
+    // Type-in
+    std::mutex        typeInMutex;
+    std::string       typeInStr;
+    size_t            typeInPos = 0;
+    std::atomic<bool> typeInActive{false};
+
+    // Set while a reset requested by type-in (0x1E) is pending, cleared when the emulation thread executes it
+    std::shared_ptr<std::atomic<bool>> typeInResetting = std::make_shared<std::atomic<bool>>(false);
+
+    // Number of characters the core keyboard buffer can currently accept
+    virtual unsigned typeInSpace() { return 0; }
+
+    // Put a character in the core keyboard buffer
+    virtual void typeInKey(uint8_t ch) {}
+
+    void keyboardTypeIn() {
+        if (typeInActive)
+            typeInFeed();
+    }
+    void typeInFeed();
 
     // Overlay
     uint8_t  ovlFont[2048];
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Page-granular address decoder for the 32-bit word organized memory of the RISC-V cores. Pages
+// backed by host memory are accessed directly, the others (nullptr) are left to the MMIO handlers.
+template <unsigned AddrBits, unsigned PageBits>
+class MemoryPages {
+public:
+    static constexpr uint32_t pageSize = 1U << PageBits;
+    static constexpr unsigned numPages = 1U << (AddrBits - PageBits);
+
+    // Map 'size' bytes of host memory at 'addr', both must be page aligned
+    void map(uint32_t addr, size_t size, void *mem, bool writable) {
+        assert((addr % pageSize) == 0 && (size % pageSize) == 0);
+        for (size_t offset = 0; offset < size; offset += pageSize) {
+            auto page       = static_cast<uint32_t *>(mem) + offset / 4;
+            auto idx        = (addr + offset) >> PageBits;
+            readPages[idx]  = page;
+            writePages[idx] = writable ? page : nullptr;
+        }
+    }
+
+    uint32_t *readPtr(uint32_t addr) const {
+        if (addr >> AddrBits)
+            return nullptr;
+        auto page = readPages[addr >> PageBits];
+        return page ? page + (addr & (pageSize - 1)) / 4 : nullptr;
+    }
+
+    uint32_t *writePtr(uint32_t addr) const {
+        if (addr >> AddrBits)
+            return nullptr;
+        auto page = writePages[addr >> PageBits];
+        return page ? page + (addr & (pageSize - 1)) / 4 : nullptr;
+    }
+
+private:
+    uint32_t *readPages[numPages]  = {};
+    uint32_t *writePages[numPages] = {};
+};
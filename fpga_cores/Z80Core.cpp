@@ -170,6 +170,13 @@ int Z80Core::emulate() {
     if (hasIrq())
         Z80INT(&z80ctx, 0xFF);
 
+    // High-level emulation (not while breakpoints might be skipped)
+    if (hleHook && emuMode == Em_Running && !(enableDebugger && enableBreakpoints)) {
+        int hleTStates = hleHook();
+        if (hleTStates > 0)
+            return hleTStates;
+    }
+
     // Emulate 1 instruction
     z80ctx.tstates = 0;
     Z80Execute(&z80ctx);
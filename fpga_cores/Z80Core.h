@@ -15,6 +15,13 @@ public:
     std::function<void(uint16_t addr, uint8_t data)> ioWrite;
     std::function<void(uint16_t addr)>               showInMemEdit;
 
+    // Optional high-level emulation hook, called before each instruction. Returns the number of
+    // T-states consumed, or 0 to execute the instruction normally.
+    std::function<int()> hleHook;
+
+    Z80Regs  &getRegs() { return z80ctx.R1; }
+    uint16_t &getPC() { return z80ctx.PC; }
+
     void loadConfig(cJSON *root);
     void saveConfig(cJSON *root);
     int  emulate();
@@ -3,11 +3,13 @@
 #include "UartProtocol.h"
 #include "FPGA.h"
 #include "cpu/riscv.h"
+#include "cpu/RiscvProfiler.h"
 #include "Config.h"
 #include "bootrom.h"
 #include "Aq32Video.h"
 #include "Aq32FmSynth.h"
 #include "Aq32Pcm.h"
+#include "MemoryPages.h"
 #include "imgui.h"
 #include "Keyboard.h"
 #include <chrono>
@@ -108,6 +110,7 @@ static uint64_t now_ms() {
 class Aq32EmuState : public EmuState {
 public:
     riscv                cpu;
+    RiscvProfiler        profiler;
     Aq32Video            video;
     Aq32FmSynth          fmsynth;
     Aq32Pcm              pcm;
@@ -117,17 +120,21 @@ public:
     uint16_t             handCtrl   = 0xFFFF;
     std::deque<uint16_t> kbBuf;
     const unsigned       kbBufSize  = 16;
+    float                hostMips   = 0;
+    float                icacheHits = 0; // Percentage of instructions served from the instruction cache
+    float                cpuIdle    = 0; // Percentage of steps skipped while the CPU was idle
     unsigned             audioLeft  = 0;
     unsigned             audioRight = 0;
     DCBlock              dcBlockLeft;
     DCBlock              dcBlockRight;
-    std::string          typeInStr;
-    std::recursive_mutex mutex;
     uint32_t             mainRam[512 * 1024 / 4];
     uint32_t             bootRom[0x800 / 4];
+    MemoryPages<20, 11>  pages;
     int                  curLineStepsRemaining = 0;
     uint64_t             mtimecmp              = 0;
     uint64_t             mtimeDiff             = 0;
+    uint64_t             emuLines              = 0;     // Video lines emulated since start
+    bool                 emulatedMtime         = false; // mtime follows emulated instead of wall-clock time
 
 #ifdef GDB_ENABLE
     // GDB interface
@@ -146,6 +153,7 @@ public:
     bool showBreakpoints   = false;
     bool showIoRegsWindow  = false;
     bool showMemEdit       = false;
+    bool showProfiler      = false;
     int  memEditMemSelect  = 0;
     bool enableBreakpoints = false;
 
@@ -173,9 +181,19 @@ public:
         cpu.dataRead16  = [this](uint32_t addr) { return _memRead16(addr); };
         cpu.dataRead32  = [this](uint32_t addr) { return _memRead32(addr); };
         cpu.instrRead   = [this](uint32_t addr) { return (uint32_t)memRead(addr); };
+        cpu.bindBus(this);
 
         memset(&keybMatrix, 0xFF, sizeof(keybMatrix));
         memcpy(bootRom, bootrom_bin, bootrom_bin_len);
+
+        // Memory accessed directly, the other pages are handled by ioRead/ioWrite
+        pages.map(BASE_BOOTROM, sizeof(bootRom), bootRom, false);
+        pages.map(BASE_TEXTRAM, sizeof(video.textRam), video.textRam, true);
+        pages.map(BASE_VRAM, sizeof(video.videoRam), video.videoRam, true);
+        pages.map(BASE_MAINRAM, sizeof(mainRam), mainRam, true);
+        cpu.addCodeRegion(BASE_BOOTROM, sizeof(bootRom));
+        cpu.addCodeRegion(BASE_MAINRAM, sizeof(mainRam));
+
         loadConfig();
         reset();
 
@@ -194,12 +212,22 @@ public:
 #endif
     }
 
+    // mtime counts milliseconds, either of wall-clock time or of emulated time (262 lines at 60Hz)
+    uint64_t mtimeBase() {
+        return emulatedMtime ? emuLines * 1000 / (262 * 60) : now_ms();
+    }
     void setMtime(uint64_t newVal) {
-        mtimeDiff = newVal - now_ms();
+        mtimeDiff = newVal - mtimeBase();
         cpu.mtime = newVal;
     }
     uint64_t getMtime() {
-        return now_ms() + mtimeDiff;
+        return mtimeBase() + mtimeDiff;
+    }
+    void setEmulatedMtime(bool enable) {
+        // Keep mtime continuous
+        auto mtime    = getMtime();
+        emulatedMtime = enable;
+        setMtime(mtime);
     }
 
     void reset(bool cold = false) override {
@@ -216,6 +244,9 @@ public:
         cpu.mtval        = 0;
         cpu.mip          = 0;
         cpu.trap         = 0;
+        cpu.wfi          = false;
+        cpu.callDepth    = 0;
+        cpu.flushInstrCache();
         setMtime(0);
         mtimecmp = 0;
 
@@ -232,6 +263,12 @@ public:
         showCpuState     = getBoolValue(root, "showCpuState", false);
         showBreakpoints  = getBoolValue(root, "showBreakpoints", false);
         showIoRegsWindow = getBoolValue(root, "showIoRegsWindow", false);
+        setEmulatedMtime(getBoolValue(root, "emulatedMtime", false));
+        cpu.setBlockMode(getBoolValue(root, "cpuBlockMode", false));
+        cpu.setJit(getBoolValue(root, "cpuJit", false));
+        showProfiler = getBoolValue(root, "showProfiler", false);
+        profiler.setEnabled(cpu, getBoolValue(root, "profilerEnabled", false));
+        profiler.symbols.load(getStringValue(root, "profilerElfPath", ""));
 
         cJSON_Delete(root);
     }
@@ -243,18 +280,22 @@ public:
         cJSON_AddBoolToObject(root, "showCpuState", showCpuState);
         cJSON_AddBoolToObject(root, "showBreakpoints", showBreakpoints);
         cJSON_AddBoolToObject(root, "showIoRegsWindow", showIoRegsWindow);
+        cJSON_AddBoolToObject(root, "emulatedMtime", emulatedMtime);
+        cJSON_AddBoolToObject(root, "cpuBlockMode", cpu.getBlockMode());
+        cJSON_AddBoolToObject(root, "cpuJit", cpu.getJit());
+        cJSON_AddBoolToObject(root, "showProfiler", showProfiler);
+        cJSON_AddBoolToObject(root, "profilerEnabled", profiler.isEnabled());
+        cJSON_AddStringToObject(root, "profilerElfPath", profiler.symbols.getPath().c_str());
 
         Config::instance()->saveConfigFile("aq32.json", root);
     }
 
     void getVideoSize(int &w, int &h) override {
-        std::lock_guard lock(mutex);
         w = Aq32Video::activeWidth;
         h = Aq32Video::activeHeight * 2;
     }
 
     void getPixels(void *pixels, int pitch) override {
-        std::lock_guard lock(mutex);
         const uint16_t *fb = video.getFb();
         for (int j = 0; j < Aq32Video::activeHeight * 2; j++) {
             for (int i = 0; i < Aq32Video::activeWidth; i++) {
@@ -265,57 +306,53 @@ public:
         renderOverlay(pixels, pitch);
     }
 
-    void spiTx(const void *data, size_t length) override {
-        std::lock_guard lock(mutex);
-        EmuState::spiTx(data, length);
-        if (!spiSelected || txBuf.empty())
-            return;
-
-        switch (txBuf[0]) {
+    void spiCommand(uint8_t cmd, const uint8_t *data, size_t length, uint8_t *rxBuf, size_t rxLength) override {
+        switch (cmd) {
             case CMD_SET_KEYB_MATRIX: {
-                if (txBuf.size() == 1 + 8) {
-                    memcpy(&keybMatrix, &txBuf[1], 8);
+                if (length == 8) {
+                    memcpy(&keybMatrix, data, 8);
                 }
                 break;
             }
 
             case CMD_SET_HCTRL: {
-                if (txBuf.size() == 1 + 2) {
-                    memcpy(&handCtrl, &txBuf[1], 2);
+                if (length == 2) {
+                    memcpy(&handCtrl, data, 2);
                 }
                 break;
             }
 
             case CMD_WRITE_KBBUF16: {
-                if (txBuf.size() == 1 + 2 && kbBuf.size() < kbBufSize) {
-                    kbBuf.push_back(txBuf[1] | (txBuf[2] << 8));
+                if (length == 2 && kbBuf.size() < kbBufSize) {
+                    kbBuf.push_back(data[0] | (data[1] << 8));
                 }
                 break;
             }
 
             case CMD_WRITE_GAMEPAD1: {
-                if (txBuf.size() == 1 + 8) {
-                    memcpy(&gamePad1, &txBuf[1], 8);
+                if (length == 8) {
+                    memcpy(&gamePad1, data, 8);
                 }
                 break;
             }
 
             case CMD_WRITE_GAMEPAD2: {
-                if (txBuf.size() == 1 + 8) {
-                    memcpy(&gamePad2, &txBuf[1], 8);
+                if (length == 8) {
+                    memcpy(&gamePad2, data, 8);
                 }
                 break;
             }
+
+            default: EmuState::spiCommand(cmd, data, length, rxBuf, rxLength); break;
         }
     }
 
-    void pasteText(const std::string &str) override {
-        std::lock_guard lock(mutex);
-        typeInStr = str;
+    unsigned typeInSpace() override {
+        return kbBufSize - (unsigned)kbBuf.size();
     }
-    bool pasteIsDone() override {
-        std::lock_guard lock(mutex);
-        return typeInStr.empty();
+    void typeInKey(uint8_t ch) override {
+        uint8_t data[2] = {ch, 0};
+        spiCommand(CMD_WRITE_KBBUF16, data, sizeof(data), nullptr, 0);
     }
 
     uint8_t _memRead8(uint32_t addr) {
@@ -403,26 +440,42 @@ public:
     }
 
     int64_t memRead(uint32_t addr, bool allow_side_effect = true) {
-        if (/* addr >= BASE_BOOTROM && */ addr < (BASE_BOOTROM + sizeof(bootRom))) {
-            return bootRom[(addr & 0x7FF) / 4];
-        } else if (addr == REG_ESPCTRL) {
+        if (auto p = pages.readPtr(addr))
+            return *p;
+        return ioRead(addr, allow_side_effect);
+    }
+
+    void memWrite(uint32_t addr, uint32_t val, uint32_t mask) {
+        if (auto p = pages.writePtr(addr)) {
+            *p = (*p & ~mask) | (val & mask);
+            return;
+        }
+        ioWrite(addr, val, mask);
+    }
+
+    int64_t ioRead(uint32_t addr, bool allow_side_effect) {
+        if (addr == REG_ESPCTRL) {
             if (allow_side_effect)
                 return UartProtocol::instance()->readCtrl();
             else
                 return 0;
         } else if (addr == REG_ESPDATA) {
-            if (allow_side_effect)
+            if (allow_side_effect) {
+                cpu.loadSideEffect = true;
                 return UartProtocol::instance()->readData();
-            else
+            } else {
                 return 0;
+            }
         } else if (addr == REG_KEYBUF) {
             uint32_t result = 0;
             if (kbBuf.empty()) {
                 result = 1U << 31;
             } else {
                 result = kbBuf.front();
-                if (allow_side_effect)
+                if (allow_side_effect) {
                     kbBuf.pop_front();
+                    cpu.loadSideEffect = true;
+                }
             }
             return result;
         } else if (addr == REG_HCTRL) {
@@ -497,12 +550,6 @@ public:
             // Character RAM (8b)
             uint8_t val = video.charRam[addr & (sizeof(video.charRam) - 1)];
             return val | (val << 8) | (val << 16) | (val << 24);
-        } else if (addr >= BASE_TEXTRAM && addr < (BASE_TEXTRAM + sizeof(video.textRam))) {
-            // Text RAM (8b/16/32b)
-            return reinterpret_cast<uint32_t *>(video.textRam)[(addr & (sizeof(video.textRam) - 1)) / 4];
-        } else if (addr >= BASE_VRAM && addr < (BASE_VRAM + sizeof(video.videoRam))) {
-            // Video RAM (8/16/32b)
-            return reinterpret_cast<uint32_t *>(video.videoRam)[(addr & (sizeof(video.videoRam) - 1)) / 4];
         } else if (addr >= BASE_VRAM4BIT && addr < (BASE_VRAM4BIT + 2 * sizeof(video.videoRam))) {
             // Video RAM (8/16/32b)
             uint16_t val16 = reinterpret_cast<uint16_t *>(video.videoRam)[(addr & (2 * sizeof(video.videoRam) - 1)) / 4];
@@ -511,14 +558,11 @@ public:
                              ((val16 & 0x00F0) << 4) |
                              (val16 & 0x000F);
             return val32;
-
-        } else if (addr >= BASE_MAINRAM && addr < (BASE_MAINRAM + sizeof(mainRam))) {
-            return mainRam[(addr & (sizeof(mainRam) - 1)) / 4];
         }
         return -1;
     }
 
-    void memWrite(uint32_t addr, uint32_t val, uint32_t mask) {
+    void ioWrite(uint32_t addr, uint32_t val, uint32_t mask) {
         if (addr == REG_ESPCTRL) {
             UartProtocol::instance()->writeCtrl(val & 0xFF);
         } else if (addr == REG_ESPDATA) {
@@ -585,15 +629,6 @@ public:
         } else if (addr >= BASE_CHRAM && addr < (BASE_CHRAM + sizeof(video.charRam))) {
             // Character RAM (8b)
             video.charRam[addr & (sizeof(video.charRam) - 1)] = val & 0xFF;
-        } else if (addr >= BASE_TEXTRAM && addr < (BASE_TEXTRAM + sizeof(video.textRam))) {
-            // Text RAM (8b/16b)
-            auto p = &reinterpret_cast<uint32_t *>(video.textRam)[(addr & (sizeof(video.textRam) - 1)) / 4];
-            *p     = (*p & ~mask) | (val & mask);
-
-        } else if (addr >= BASE_VRAM && addr < (BASE_VRAM + sizeof(video.videoRam))) {
-            // Video RAM (8/16/32b)
-            auto p = &reinterpret_cast<uint32_t *>(video.videoRam)[(addr & (sizeof(video.videoRam) - 1)) / 4];
-            *p     = (*p & ~mask) | (val & mask);
         } else if (addr >= BASE_VRAM4BIT && addr < (BASE_VRAM4BIT + 2 * sizeof(video.videoRam))) {
             uint16_t *p     = &reinterpret_cast<uint16_t *>(video.videoRam)[(addr & (2 * sizeof(video.videoRam) - 1)) / 4];
             uint16_t  val16 = *p;
@@ -616,10 +651,6 @@ public:
                 ((val32 & 0x00000F00) >> 4) |
                 (val32 & 0x0000000F);
             *p = val16;
-
-        } else if (addr >= BASE_MAINRAM && addr < (BASE_MAINRAM + sizeof(mainRam))) {
-            auto p = &mainRam[(addr & (sizeof(mainRam) - 1)) / 4];
-            *p     = (*p & ~mask) | (val & mask);
         }
     }
 
@@ -630,6 +661,7 @@ public:
 
         if (curLineStepsRemaining <= 0) {
             video.videoLine++;
+            emuLines++;
             curLineStepsRemaining = 10000000 / 60 / 262;
 
             if (video.isOnStartOfVBlank())
@@ -643,13 +675,14 @@ public:
             }
 
             video.drawLine(video.videoLine);
+            spiDrain();
             keyboardTypeIn();
 
             if (pcm.hasIrq())
                 cpu.pendInterrupt(1 << 18);
             if (!kbBuf.empty())
                 cpu.pendInterrupt(1 << 19);
-            if (UartProtocol::instance()->readCtrl() & 1)
+            if (UartProtocol::instance()->getStatus() & 1)
                 cpu.pendInterrupt(1 << 20);
 
             cpu.mtime = getMtime();
@@ -657,19 +690,16 @@ public:
                 cpu.pendInterrupt(1 << 7);
         }
 
-        cpu.emulate();
-        curLineStepsRemaining--;
+        // Run up to the next line, the CPU stops early on a breakpoint or profiler sample
+        unsigned steps = cpu.run(emuMode == Em_Step ? 1 : profiler.limitSteps(curLineStepsRemaining));
+        curLineStepsRemaining -= steps;
+        profiler.sample(cpu, steps);
 
-        if (enableDebugger && enableBreakpoints) {
-            for (auto &bp : breakpoints) {
-                if (bp.enabled && bp.addr == cpu.pc) {
-                    emuMode = Em_Halted;
+        if (enableDebugger && enableBreakpoints && cpu.isBreakpoint(cpu.pc)) {
+            emuMode = Em_Halted;
 #ifdef GDB_ENABLE
-                    gdbBreakpointHit();
+            gdbBreakpointHit();
 #endif
-                    break;
-                }
-            }
         }
         if (emuMode == Em_Step)
             emuMode = Em_Halted;
@@ -677,16 +707,42 @@ public:
         return end_of_frame;
     }
 
+    void syncBreakpoints() {
+        std::vector<uint32_t> addrs;
+        if (enableDebugger && enableBreakpoints) {
+            for (auto &bp : breakpoints) {
+                if (bp.enabled)
+                    addrs.push_back(bp.addr);
+            }
+        }
+        cpu.setBreakpoints(addrs);
+    }
+
     void emulateFrame(int16_t *audioBuf, unsigned numSamples) override {
         std::lock_guard lock(mutex);
+        beginFrame();
+        syncBreakpoints();
 
         if (emuMode == Em_Halted) {
             for (int line = 0; line < 262; line++)
                 video.drawLine(line);
             return;
         }
+        auto     tStart      = std::chrono::steady_clock::now();
+        uint64_t startInstrs = cpu.minstret;
+        uint64_t startHits   = cpu.icacheHits;
+        uint64_t startMisses = cpu.icacheMisses;
+        uint64_t startIdle   = cpu.idleSteps;
         while (!emulateStep()) {
         }
+        {
+            uint64_t hits    = cpu.icacheHits - startHits;
+            uint64_t lookups = hits + cpu.icacheMisses - startMisses;
+            auto     us      = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count();
+            hostMips         = us > 0 ? (float)(cpu.minstret - startInstrs) / us : 0;
+            icacheHits       = lookups > 0 ? 100.0f * hits / lookups : 0;
+            cpuIdle          = 100.0f * (cpu.idleSteps - startIdle) / (262 * (10000000 / 60 / 262));
+        }
 
         if (audioBuf != nullptr) {
             memset(audioBuf, 0, numSamples * sizeof(*audioBuf) * 2);
@@ -705,12 +761,20 @@ public:
         }
     }
 
-    void keyboardTypeIn() {
-        if (kbBuf.size() < kbBufSize && !typeInStr.empty()) {
-            char ch = typeInStr.front();
-            typeInStr.erase(typeInStr.begin());
-            Keyboard::instance()->pressKey(ch);
+    void fileMenu() override {
+        std::lock_guard lock(mutex);
+        bool            enable = emulatedMtime;
+        if (ImGui::MenuItem("Timer follows emulated time", "", &enable))
+            setEmulatedMtime(enable);
+        enable = cpu.getBlockMode();
+        if (ImGui::MenuItem("Execute CPU code in blocks", "", &enable))
+            cpu.setBlockMode(enable);
+        if (riscv::jitSupported()) {
+            enable = cpu.getJit();
+            if (ImGui::MenuItem("Compile CPU blocks to host code", "", &enable, cpu.getBlockMode()))
+                cpu.setJit(enable);
         }
+        ImGui::Separator();
     }
 
     void dbgMenu() override {
@@ -722,6 +786,7 @@ public:
         ImGui::MenuItem("Breakpoints", "", &showBreakpoints);
         ImGui::MenuItem("Memory editor", "", &showMemEdit);
         ImGui::MenuItem("IO Registers", "", &showIoRegsWindow);
+        ImGui::MenuItem("Profiler", "", &showProfiler);
     }
 
     void dbgWindows() override {
@@ -738,6 +803,8 @@ public:
             dbgWndMemEdit(&showMemEdit);
         if (showIoRegsWindow)
             dbgWndIoRegs(&showIoRegsWindow);
+        if (showProfiler)
+            profiler.drawWindow(cpu, &showProfiler);
     }
 
     void dbgWndIoRegs(bool *p_open) {
@@ -785,6 +852,8 @@ public:
             ImGui::PopStyleColor();
             ImGui::EndDisabled();
 
+            ImGui::Text("Host speed: %.1f MIPS, instruction cache hits: %.1f%%", hostMips, icacheHits);
+            ImGui::Text("CPU idle: %.1f%%", cpuIdle);
             ImGui::Separator();
 
             {
@@ -945,6 +1014,7 @@ public:
                 };
                 memEdit.writeFn = [this](ImU8 *data, size_t off, ImU8 d) {
                     memWrite((uint32_t)off, d | (d << 8) | (d << 16) | (d << 24), 0xFF << (off & 3) * 8);
+                    cpu.invalidateInstr((uint32_t)off);
 
                     // memWrite((uint16_t)off, d);
                 };
@@ -1129,6 +1199,7 @@ public:
                 endAddr = BASE_MAINRAM + sizeof(mainRam);
 
             memcpy(((uint8_t *)mainRam) + addr, data.data(), endAddr - addr);
+            cpu.flushInstrCache();
 
         } else {
             printf("Write memory %08lX: ", addr);
@@ -1300,6 +1371,7 @@ public:
             {
                 std::lock_guard lock(mutex);
                 emuMode = Em_Step;
+                syncBreakpoints();
                 emulateStep();
             }
             gdbSendStopReply();
@@ -0,0 +1,106 @@
+#include "ElfSymbols.h"
+#include <algorithm>
+
+// Whether 'size' bytes at 'offset' lie within 'buf', without computing 'offset + size' (which can wrap)
+static bool inBounds(const std::vector<uint8_t> &buf, size_t offset, size_t size) {
+    return offset <= buf.size() && size <= buf.size() - offset;
+}
+
+static uint16_t get16(const std::vector<uint8_t> &buf, size_t offset) {
+    if (!inBounds(buf, offset, 2))
+        return 0;
+    return buf[offset] | (buf[offset + 1] << 8);
+}
+
+static uint32_t get32(const std::vector<uint8_t> &buf, size_t offset) {
+    if (!inBounds(buf, offset, 4))
+        return 0;
+    return buf[offset] | (buf[offset + 1] << 8) | (buf[offset + 2] << 16) | ((uint32_t)buf[offset + 3] << 24);
+}
+
+bool ElfSymbols::load(const std::string &_path) {
+    clear();
+
+    std::ifstream ifs(_path, std::ios::binary);
+    if (!ifs.good())
+        return false;
+    std::vector<uint8_t> buf((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+    // ELF32, little-endian
+    if (buf.size() < 52 || buf[0] != 0x7F || buf[1] != 'E' || buf[2] != 'L' || buf[3] != 'F' || buf[4] != 1 || buf[5] != 1)
+        return false;
+
+    // Offsets and sizes from the file are checked with inBounds() before use. Section indices are 16-bit, so
+    // index * shentsize can't wrap.
+    size_t shoff     = get32(buf, 32);
+    size_t shentsize = get16(buf, 46);
+    size_t shnum     = get16(buf, 48);
+    if (shentsize < 40 || !inBounds(buf, shoff, shnum * shentsize))
+        return false;
+
+    for (size_t i = 0; i < shnum; i++) {
+        size_t sh = shoff + i * shentsize;
+        if (get32(buf, sh + 4) != 2) // SHT_SYMTAB
+            continue;
+
+        size_t symOffset = get32(buf, sh + 16);
+        size_t symSize   = get32(buf, sh + 20);
+        size_t strIdx    = get32(buf, sh + 24);
+        if (strIdx >= shnum)
+            continue;
+        size_t strSh     = shoff + strIdx * shentsize;
+        size_t strOffset = get32(buf, strSh + 16);
+        size_t strSize   = get32(buf, strSh + 20);
+        if (!inBounds(buf, symOffset, symSize) || !inBounds(buf, strOffset, strSize))
+            continue;
+
+        for (size_t pos = 0; symSize - pos >= 16; pos += 16) {
+            size_t   sym   = symOffset + pos;
+            uint32_t name  = get32(buf, sym + 0);
+            uint32_t value = get32(buf, sym + 4);
+            uint32_t size  = get32(buf, sym + 8);
+            unsigned type  = buf[sym + 12] & 0xF;
+            unsigned shndx = get16(buf, sym + 14);
+
+            // Functions and untyped labels (assembly code) defined in a section
+            if ((type != 2 && type != 0) || shndx == 0 || shndx >= 0xFF00 || name == 0 || name >= strSize)
+                continue;
+
+            const char *str = (const char *)&buf[strOffset + name];
+            std::string symName(str, strnlen(str, strSize - name));
+            if (symName.empty() || symName[0] == '$' || symName.rfind(".L", 0) == 0)
+                continue;
+
+            symbols.push_back({value, type == 2 ? size : 0, symName});
+        }
+    }
+    if (symbols.empty())
+        return false;
+
+    // Prefer sized (function) symbols over labels at the same address
+    std::sort(symbols.begin(), symbols.end(), [](const Symbol &a, const Symbol &b) {
+        return a.addr != b.addr ? a.addr < b.addr : a.size > b.size;
+    });
+    symbols.erase(std::unique(symbols.begin(), symbols.end(), [](const Symbol &a, const Symbol &b) { return a.addr == b.addr; }), symbols.end());
+
+    path = _path;
+    return true;
+}
+
+void ElfSymbols::clear() {
+    symbols.clear();
+    path.clear();
+}
+
+std::string ElfSymbols::getName(uint32_t addr) const {
+    auto it = std::upper_bound(symbols.begin(), symbols.end(), addr, [](uint32_t addr, const Symbol &sym) { return addr < sym.addr; });
+    if (it != symbols.begin()) {
+        --it;
+        if (it->size == 0 || addr < it->addr + it->size)
+            return it->name;
+    }
+
+    char tmp[16];
+    snprintf(tmp, sizeof(tmp), "0x%08X", addr);
+    return tmp;
+}
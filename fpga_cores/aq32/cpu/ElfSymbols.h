@@ -0,0 +1,26 @@
+#pragma once
+
+#include "Common.h"
+
+// Function and label symbols from the symbol table of a 32-bit little-endian ELF file (RISC-V GCC output)
+class ElfSymbols {
+public:
+    bool load(const std::string &path);
+    void clear();
+
+    const std::string &getPath() const { return path; }
+    bool               empty() const { return symbols.empty(); }
+
+    // Name of the symbol containing 'addr', or the address in hex when there is none
+    std::string getName(uint32_t addr) const;
+
+private:
+    struct Symbol {
+        uint32_t    addr;
+        uint32_t    size; // 0 when unknown, the symbol then extends up to the next one
+        std::string name;
+    };
+
+    std::vector<Symbol> symbols; // Sorted by address
+    std::string         path;
+};
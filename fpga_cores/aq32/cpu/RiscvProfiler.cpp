@@ -0,0 +1,186 @@
+#include "RiscvProfiler.h"
+#include "imgui.h"
+#include "tinyfiledialogs.h"
+#include <algorithm>
+
+void RiscvProfiler::setEnabled(riscv &cpu, bool enable) {
+    enabled    = enable;
+    lastCycles = cpu.mcycle;
+    cpu.setCallTracking(enable);
+}
+
+void RiscvProfiler::reset() {
+    stacks.clear();
+    funcStats.clear();
+    totalCycles = 0;
+    numSamples  = 0;
+    statsTime   = -1;
+}
+
+void RiscvProfiler::record(const riscv &cpu) {
+    // mcycle can be written by the guest
+    uint64_t cycles = cpu.mcycle >= lastCycles ? cpu.mcycle - lastCycles : 0;
+    lastCycles      = cpu.mcycle;
+    if (cycles == 0)
+        return;
+
+    curStack.assign(cpu.callStack, cpu.callStack + cpu.callDepth);
+    curStack.push_back(cpu.pc);
+    stacks[curStack] += cycles;
+    totalCycles += cycles;
+    numSamples++;
+}
+
+const std::string &RiscvProfiler::frameName(uint32_t addr) {
+    auto it = names.find(addr);
+    if (it != names.end())
+        return it->second;
+    return names.emplace(addr, symbols.getName(addr)).first->second;
+}
+
+// Address within the function of each frame: the call instruction for return addresses, the interrupted
+// instruction for traps and the PC for the innermost frame
+static uint32_t frameAddr(const std::vector<uint32_t> &stack, size_t idx) {
+    uint32_t addr = stack[idx];
+    if (idx + 1 == stack.size())
+        return addr;
+    return (addr & 1) ? (addr & ~1) : addr - 4;
+}
+
+void RiscvProfiler::updateStats() {
+    std::unordered_map<std::string, size_t> funcIdx;
+    std::vector<const std::string *>        frames;
+
+    funcStats.clear();
+    for (auto &entry : stacks) {
+        auto &stack = entry.first;
+
+        frames.clear();
+        for (size_t i = 0; i < stack.size(); i++) {
+            auto &name = frameName(frameAddr(stack, i));
+
+            // Count recursive functions once in the total
+            bool seen = false;
+            for (auto frame : frames)
+                seen |= (*frame == name);
+            frames.push_back(&name);
+
+            auto it = funcIdx.find(name);
+            if (it == funcIdx.end()) {
+                it = funcIdx.emplace(name, funcStats.size()).first;
+                funcStats.push_back({name, 0, 0});
+            }
+            auto &stats = funcStats[it->second];
+            if (!seen)
+                stats.total += entry.second;
+            if (i + 1 == stack.size())
+                stats.self += entry.second;
+        }
+    }
+
+    std::sort(funcStats.begin(), funcStats.end(), [](const FuncStats &a, const FuncStats &b) { return a.self > b.self; });
+}
+
+bool RiscvProfiler::exportFolded(const std::string &path) {
+    std::map<std::string, uint64_t> folded;
+    for (auto &entry : stacks) {
+        std::string line;
+        for (size_t i = 0; i < entry.first.size(); i++) {
+            if (i > 0)
+                line += ';';
+            line += frameName(frameAddr(entry.first, i));
+        }
+        folded[line] += entry.second;
+    }
+
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    for (auto &entry : folded)
+        fprintf(f, "%s %llu\n", entry.first.c_str(), (unsigned long long)entry.second);
+    fclose(f);
+    return true;
+}
+
+void RiscvProfiler::drawWindow(riscv &cpu, bool *p_open) {
+    ImGui::SetNextWindowSizeConstraints(ImVec2(400, 200), ImVec2(FLT_MAX, FLT_MAX));
+    if (ImGui::Begin("Profiler", p_open, 0)) {
+        bool enable = enabled;
+        if (ImGui::Checkbox("Enabled", &enable))
+            setEnabled(cpu, enable);
+        ImGui::SameLine();
+        if (ImGui::Button("Reset"))
+            reset();
+        ImGui::SameLine();
+        if (ImGui::Button("Export folded stacks...")) {
+            static const char *lFilterPatterns[1] = {"*.folded"};
+            char              *path               = tinyfd_saveFileDialog("Export folded stacks", "profile.folded", 1, lFilterPatterns, "Folded stack files");
+            if (path)
+                exportFolded(path);
+        }
+
+        if (symbols.empty()) {
+            if (ImGui::Button("Load ELF symbols")) {
+                char const *lFilterPatterns[1] = {"*.elf"};
+                char       *elfFile            = tinyfd_openFileDialog("Open ELF file", "", 1, lFilterPatterns, "ELF files", 0);
+                if (elfFile) {
+                    symbols.load(elfFile);
+                    names.clear();
+                    statsTime = -1;
+                }
+            }
+        } else {
+            if (ImGui::Button("Reload")) {
+                auto path = symbols.getPath();
+                symbols.load(path);
+                names.clear();
+                statsTime = -1;
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("X")) {
+                symbols.clear();
+                names.clear();
+                statsTime = -1;
+            }
+            ImGui::SameLine();
+            ImGui::TextUnformatted(symbols.getPath().c_str());
+        }
+        ImGui::Text("Samples: %llu, cycles: %llu", (unsigned long long)numSamples, (unsigned long long)totalCycles);
+        ImGui::Separator();
+
+        // Aggregating all stacks is too slow to do every frame
+        double now = ImGui::GetTime();
+        if (statsTime < 0 || now - statsTime >= 1.0) {
+            updateStats();
+            statsTime = now;
+        }
+
+        if (ImGui::BeginTable("Table", 3, ImGuiTableFlags_ScrollY | ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersV | ImGuiTableFlags_BordersOuter)) {
+            ImGui::TableSetupColumn("Function");
+            ImGui::TableSetupColumn("Self", ImGuiTableColumnFlags_WidthFixed);
+            ImGui::TableSetupColumn("Total", ImGuiTableColumnFlags_WidthFixed);
+            ImGui::TableSetupScrollFreeze(0, 1);
+            ImGui::TableHeadersRow();
+
+            float scale = totalCycles > 0 ? 100.0f / totalCycles : 0;
+
+            ImGuiListClipper clipper;
+            clipper.Begin((int)funcStats.size());
+            while (clipper.Step()) {
+                for (int row_n = clipper.DisplayStart; row_n < clipper.DisplayEnd; row_n++) {
+                    auto &stats = funcStats[row_n];
+
+                    ImGui::TableNextRow();
+                    ImGui::TableNextColumn();
+                    ImGui::TextUnformatted(stats.name.c_str());
+                    ImGui::TableNextColumn();
+                    ImGui::Text("%5.1f%%", stats.self * scale);
+                    ImGui::TableNextColumn();
+                    ImGui::Text("%5.1f%%", stats.total * scale);
+                }
+            }
+            ImGui::EndTable();
+        }
+    }
+    ImGui::End();
+}
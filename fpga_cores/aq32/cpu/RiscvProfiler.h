@@ -0,0 +1,75 @@
+#pragma once
+
+#include "Common.h"
+#include "riscv.h"
+#include "ElfSymbols.h"
+#include <random>
+#include <unordered_map>
+
+// Sampling profiler for the RISC-V cores. A sample records the PC with the call stack tracked by the CPU, weighted
+// with the cycles since the previous sample. Samples are taken at random intervals (geometrically distributed, in
+// steps), since sampling at every video line or run slice aliases with loops of a matching period. The core limits
+// each riscv::run() call with limitSteps() and reports the steps executed to sample() after it.
+class RiscvProfiler {
+public:
+    void setEnabled(riscv &cpu, bool enable);
+    bool isEnabled() const { return enabled; }
+    void reset();
+
+    unsigned limitSteps(unsigned steps) const { return enabled ? std::min(steps, stepsToSample) : steps; }
+    void     sample(const riscv &cpu, unsigned steps) {
+        if (!enabled)
+            return;
+        if (steps < stepsToSample) {
+            stepsToSample -= steps;
+            return;
+        }
+        record(cpu);
+        stepsToSample = std::max(interval(rng), 1U);
+    }
+
+    // Write the samples as folded stacks ("outer;inner;leaf cycles" per line), the input of flamegraph.pl
+    bool exportFolded(const std::string &path);
+
+    void drawWindow(riscv &cpu, bool *p_open);
+
+    ElfSymbols symbols;
+
+private:
+    struct StackHash {
+        size_t operator()(const std::vector<uint32_t> &stack) const {
+            size_t h = 0;
+            for (auto addr : stack)
+                h = h * 31 + addr;
+            return h;
+        }
+    };
+
+    struct FuncStats {
+        std::string name;
+        uint64_t    self;  // Cycles in the function itself
+        uint64_t    total; // Cycles including the functions it called
+    };
+
+    void               record(const riscv &cpu);
+    const std::string &frameName(uint32_t addr);
+    void               updateStats();
+
+    static constexpr double meanSampleSteps = 600;
+
+    bool                                  enabled       = false;
+    unsigned                              stepsToSample = 1; // Countdown to the next sample
+    std::minstd_rand                      rng;
+    std::geometric_distribution<unsigned> interval{1.0 / meanSampleSteps};
+    uint64_t                              lastCycles  = 0;
+    uint64_t                              totalCycles = 0;
+    uint64_t                              numSamples  = 0;
+
+    // Call stacks (return addresses from outer to inner, then the PC) with their cycles
+    std::unordered_map<std::vector<uint32_t>, uint64_t, StackHash> stacks;
+    std::vector<uint32_t>                                          curStack;
+
+    std::unordered_map<uint32_t, std::string> names; // Function name per frame address
+    std::vector<FuncStats>                    funcStats;
+    double                                    statsTime = -1;
+};
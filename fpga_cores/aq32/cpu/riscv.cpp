@@ -11,284 +11,451 @@ static uint32_t __inline __builtin_clz(uint32_t x) {
 }
 #endif
 
-void riscv::emulate() {
-    mcycle += 2;
+using DecodedInstr = riscv::DecodedInstr;
+
+#define INSTR(name) static void name(riscv &cpu, const DecodedInstr &d, uint32_t curpc, uint32_t &newpc)
+
+// clang-format off
+INSTR(opIllegal) { cpu.trap = TRAP_INSTR_ILLEGAL; }
+INSTR(opFence)   { }
+
+INSTR(opLui)   { cpu.regs[d.rd] = d.imm; }
+INSTR(opAuipc) { cpu.regs[d.rd] = curpc + d.imm; }
+INSTR(opJal)   { cpu.regs[d.rd] = curpc + 4; newpc = curpc + d.imm; }
+INSTR(opJalr)  { uint32_t target = (cpu.regs[d.rs1] + d.imm) & ~3; cpu.regs[d.rd] = curpc + 4; newpc = target; }
+
+// Variants used with call tracking
+INSTR(opJalCall)  { cpu.regs[d.rd] = curpc + 4; newpc = curpc + d.imm; cpu.pushCall(curpc + 4); }
+INSTR(opJalrCall) { uint32_t target = (cpu.regs[d.rs1] + d.imm) & ~3; cpu.regs[d.rd] = curpc + 4; newpc = target; cpu.pushCall(curpc + 4); }
+INSTR(opJalrRet)  { uint32_t target = (cpu.regs[d.rs1] + d.imm) & ~3; cpu.regs[d.rd] = curpc + 4; newpc = target; cpu.popCall(target); }
+
+INSTR(opBeq)  { if (          cpu.regs[d.rs1] ==           cpu.regs[d.rs2]) newpc = curpc + d.imm; }
+INSTR(opBne)  { if (          cpu.regs[d.rs1] !=           cpu.regs[d.rs2]) newpc = curpc + d.imm; }
+INSTR(opBlt)  { if ((int32_t)cpu.regs[d.rs1] <  (int32_t)cpu.regs[d.rs2]) newpc = curpc + d.imm; }
+INSTR(opBge)  { if ((int32_t)cpu.regs[d.rs1] >= (int32_t)cpu.regs[d.rs2]) newpc = curpc + d.imm; }
+INSTR(opBltu) { if (          cpu.regs[d.rs1] <            cpu.regs[d.rs2]) newpc = curpc + d.imm; }
+INSTR(opBgeu) { if (          cpu.regs[d.rs1] >=           cpu.regs[d.rs2]) newpc = curpc + d.imm; }
+
+INSTR(opLb)  { cpu.mcycle += 1; cpu.regs[d.rd] = (int8_t)cpu.dataRead8(cpu.regs[d.rs1] + d.imm); }
+INSTR(opLh)  { cpu.mcycle += 1; cpu.regs[d.rd] = (int16_t)cpu.dataRead16(cpu.regs[d.rs1] + d.imm); }
+INSTR(opLw)  { cpu.mcycle += 1; cpu.regs[d.rd] = cpu.dataRead32(cpu.regs[d.rs1] + d.imm); }
+INSTR(opLbu) { cpu.mcycle += 1; cpu.regs[d.rd] = cpu.dataRead8(cpu.regs[d.rs1] + d.imm); }
+INSTR(opLhu) { cpu.mcycle += 1; cpu.regs[d.rd] = cpu.dataRead16(cpu.regs[d.rs1] + d.imm); }
+
+INSTR(opSb) { cpu.mcycle += 1; uint32_t addr = cpu.regs[d.rs1] + d.imm; cpu.dataWrite8(addr, cpu.regs[d.rs2]); cpu.invalidateInstr(addr); }
+INSTR(opSh) { cpu.mcycle += 1; uint32_t addr = cpu.regs[d.rs1] + d.imm; cpu.dataWrite16(addr, cpu.regs[d.rs2]); cpu.invalidateInstr(addr); }
+INSTR(opSw) { cpu.mcycle += 1; uint32_t addr = cpu.regs[d.rs1] + d.imm; cpu.dataWrite32(addr, cpu.regs[d.rs2]); cpu.invalidateInstr(addr); }
+
+INSTR(opAddi)  { cpu.regs[d.rd] = cpu.regs[d.rs1] + d.imm; }
+INSTR(opSlti)  { cpu.regs[d.rd] = (int32_t)cpu.regs[d.rs1] < d.imm; }
+INSTR(opSltiu) { cpu.regs[d.rd] = cpu.regs[d.rs1] < (uint32_t)d.imm; }
+INSTR(opXori)  { cpu.regs[d.rd] = cpu.regs[d.rs1] ^ d.imm; }
+INSTR(opOri)   { cpu.regs[d.rd] = cpu.regs[d.rs1] | d.imm; }
+INSTR(opAndi)  { cpu.regs[d.rd] = cpu.regs[d.rs1] & d.imm; }
+INSTR(opSlli)  { cpu.regs[d.rd] = cpu.regs[d.rs1] << d.imm; }
+INSTR(opSrli)  { cpu.regs[d.rd] = cpu.regs[d.rs1] >> d.imm; }
+INSTR(opSrai)  { cpu.regs[d.rd] = (int32_t)cpu.regs[d.rs1] >> d.imm; }
+
+INSTR(opAdd)  { cpu.regs[d.rd] = cpu.regs[d.rs1] + cpu.regs[d.rs2]; }
+INSTR(opSub)  { cpu.regs[d.rd] = cpu.regs[d.rs1] - cpu.regs[d.rs2]; }
+INSTR(opSll)  { cpu.regs[d.rd] = cpu.regs[d.rs1] << (cpu.regs[d.rs2] & 0x1F); }
+INSTR(opSlt)  { cpu.regs[d.rd] = (int32_t)cpu.regs[d.rs1] < (int32_t)cpu.regs[d.rs2]; }
+INSTR(opSltu) { cpu.regs[d.rd] = cpu.regs[d.rs1] < cpu.regs[d.rs2]; }
+INSTR(opXor)  { cpu.regs[d.rd] = cpu.regs[d.rs1] ^ cpu.regs[d.rs2]; }
+INSTR(opSrl)  { cpu.regs[d.rd] = cpu.regs[d.rs1] >> (cpu.regs[d.rs2] & 0x1F); }
+INSTR(opSra)  { cpu.regs[d.rd] = (int32_t)cpu.regs[d.rs1] >> (cpu.regs[d.rs2] & 0x1F); }
+INSTR(opOr)   { cpu.regs[d.rd] = cpu.regs[d.rs1] | cpu.regs[d.rs2]; }
+INSTR(opAnd)  { cpu.regs[d.rd] = cpu.regs[d.rs1] & cpu.regs[d.rs2]; }
+
+INSTR(opMul)    { cpu.regs[d.rd] = cpu.regs[d.rs1] * cpu.regs[d.rs2]; }
+INSTR(opMulh)   { cpu.regs[d.rd] = ((int64_t)(int32_t)cpu.regs[d.rs1] * (int64_t)(int32_t)cpu.regs[d.rs2]) >> 32; }
+INSTR(opMulhsu) { cpu.regs[d.rd] = ((int64_t)(int32_t)cpu.regs[d.rs1] * (int64_t)(uint32_t)cpu.regs[d.rs2]) >> 32; }
+INSTR(opMulhu)  { cpu.regs[d.rd] = ((int64_t)(uint32_t)cpu.regs[d.rs1] * (int64_t)(uint32_t)cpu.regs[d.rs2]) >> 32; }
+// clang-format on
+
+INSTR(opDiv) {
+    int32_t dividend = cpu.regs[d.rs1];
+    int32_t divisor  = cpu.regs[d.rs2];
+    if (dividend == (int32_t)0x80000000 && divisor == -1) {
+        cpu.regs[d.rd] = dividend;
+    } else if (divisor == 0) {
+        cpu.regs[d.rd] = 0xFFFFFFFF;
+    } else {
+        cpu.regs[d.rd] = dividend / divisor;
+    }
+}
 
-    this->trap     = TRAP_NONE;
-    uint32_t curpc = this->pc;
-    uint32_t newpc = curpc + 4;
-    uint32_t instr = instrRead(curpc & ~3);
+INSTR(opDivu) {
+    uint32_t dividend = cpu.regs[d.rs1];
+    uint32_t divisor  = cpu.regs[d.rs2];
+    if (divisor == 0) {
+        cpu.regs[d.rd] = 0xFFFFFFFF;
+    } else {
+        cpu.regs[d.rd] = dividend / divisor;
+    }
+}
 
-    if (!this->trap) {
-        uint32_t rd_val = 0;
-        uint32_t rd_idx = (instr >> 7) & 0x1F;
-
-        switch (instr & 0x7f) {
-            case 0b0110111: rd_val = (instr & 0xFFFFF000); break;         // LUI
-            case 0b0010111: rd_val = curpc + (instr & 0xFFFFF000); break; // AUIPC
-            case 0b1101111: {                                             // JAL
-                int32_t imm =
-                    ((instr & 0x80000000) >> 11) | ((instr & 0x7FE00000) >> 20) | ((instr & 0x00100000) >> 9) | ((instr & 0x000FF000));
-                if (imm & 0x00100000)
-                    imm |= 0xFFE00000;
-
-                rd_val = curpc + 4;
-                newpc  = curpc + imm;
-                break;
-            }
+INSTR(opRem) {
+    int32_t dividend = cpu.regs[d.rs1];
+    int32_t divisor  = cpu.regs[d.rs2];
+    if (dividend == (int32_t)0x80000000 && divisor == -1) {
+        cpu.regs[d.rd] = 0;
+    } else if (divisor == 0) {
+        cpu.regs[d.rd] = dividend;
+    } else {
+        cpu.regs[d.rd] = dividend % divisor;
+    }
+}
 
-            case 0b1100111: { // JALR
-                int32_t imm = instr >> 20;
-                if (imm & 0x800)
-                    imm |= 0xFFFFF000;
+INSTR(opRemu) {
+    uint32_t dividend = cpu.regs[d.rs1];
+    uint32_t divisor  = cpu.regs[d.rs2];
+    if (divisor == 0) {
+        cpu.regs[d.rd] = dividend;
+    } else {
+        cpu.regs[d.rd] = dividend % divisor;
+    }
+}
 
-                rd_val = curpc + 4;
-                newpc  = (this->regs[(instr >> 15) & 0x1F] + imm) & ~3;
+INSTR(opSystem) {
+    uint32_t instr  = d.instr;
+    unsigned funct3 = (instr >> 12) & 7;
+
+    if (funct3 == 0b000) {
+        switch (instr >> 20) {
+            case 0b000000000000: cpu.trap = TRAP_ECALL_M; break;
+            case 0b000000000001: cpu.trap = TRAP_BREAKPOINT; break;
+            case 0b000100000101: cpu.wfi = true; break; // WFI
+            case 0b001100000010: { // MRET
+                newpc            = cpu.mepc;
+                cpu.mstatus_mie  = cpu.mstatus_mpie;
+                cpu.mstatus_mpie = true;
+                if (cpu.getCallTracking())
+                    cpu.popTrap();
                 break;
             }
+            default: cpu.trap = TRAP_INSTR_ILLEGAL; break;
+        }
+        return;
+    }
 
-            case 0b1100011: { // Branch
-                int32_t imm = ((instr & 0xF00) >> 7) | ((instr & 0x7E000000) >> 20) | ((instr & 0x80) << 4) | ((instr >> 31) << 12);
-                if (imm & 0x1000)
-                    imm |= 0xFFFFE000;
-
-                int32_t  rs1       = this->regs[(instr >> 15) & 0x1F];
-                int32_t  rs2       = this->regs[(instr >> 20) & 0x1F];
-                uint32_t target_pc = curpc + imm;
-                rd_idx             = 0;
-
-                // clang-format off
-                    switch ((instr >> 12) & 0x7) {
-                        case 0b000: if (          rs1 ==           rs2) newpc = target_pc; break; // BEQ
-                        case 0b001: if (          rs1 !=           rs2) newpc = target_pc; break; // BNE
-                        case 0b100: if (          rs1 <            rs2) newpc = target_pc; break; // BLT
-                        case 0b101: if (          rs1 >=           rs2) newpc = target_pc; break; // BGE
-                        case 0b110: if ((uint32_t)rs1 <  (uint32_t)rs2) newpc = target_pc; break; // BLTU
-                        case 0b111: if ((uint32_t)rs1 >= (uint32_t)rs2) newpc = target_pc; break; // BGEU
-                        default: this->trap = TRAP_INSTR_ILLEGAL; break;
-                    }
-                // clang-format on
+    // CSR instructions
+    unsigned csr = instr >> 20;
 
-                break;
+    // Read from CSR
+    uint32_t rd_val = 0;
+
+    switch (csr) {
+        case 0x300: {
+            rd_val = 0;
+            if (cpu.mstatus_mie)
+                rd_val |= (1 << 3);
+            if (cpu.mstatus_mpie)
+                rd_val |= (1 << 7);
+            break;
+        }
+        case 0x304: rd_val = cpu.mie; break;
+        case 0x305: rd_val = cpu.mtvec; break;
+        case 0x340: rd_val = cpu.mscratch; break;
+        case 0x341: rd_val = cpu.mepc; break;
+        case 0x342: rd_val = cpu.mcause; break;
+        case 0x343: rd_val = cpu.mtval; break;
+        case 0x344: rd_val = cpu.mip; break;
+        case 0xC00:
+        case 0xB00: rd_val = cpu.mcycle & 0xFFFFFFFF; break;
+        case 0xC80:
+        case 0xB80: rd_val = cpu.mcycle >> 32; break;
+        case 0xC02:
+        case 0xB02: rd_val = cpu.minstret & 0xFFFFFFFF; break;
+        case 0xC82:
+        case 0xB82: rd_val = cpu.minstret >> 32; break;
+        case 0xC01: rd_val = cpu.mtime & 0xFFFFFFFF; break;
+        case 0xC81: rd_val = cpu.mtime >> 32; break;
+    }
+
+    // Determine new CSR value
+    uint32_t newcsr = 0;
+    uint32_t val    = (funct3 & 4) ? d.rs1 : cpu.regs[d.rs1];
+    switch (funct3 & 3) {
+        case 0b01: newcsr = val; break;           // CSRRW(I) - Atomic Read/Write
+        case 0b10: newcsr = rd_val | val; break;  // CSRRS(I) - Atomic Read and Set Bits
+        case 0b11: newcsr = rd_val & ~val; break; // CSRRC(I) - Atomic Read and Clear Bits
+    }
+
+    // Write CSR
+    switch (csr) {
+        case 0x300: {
+            cpu.mstatus_mie  = (newcsr & (1 << 3)) != 0;
+            cpu.mstatus_mpie = (newcsr & (1 << 7)) != 0;
+            break;
+        }
+        case 0x304: cpu.mie = newcsr; break;
+        case 0x305: cpu.mtvec = newcsr; break;
+        case 0x340: cpu.mscratch = newcsr; break;
+        case 0x341: cpu.mepc = newcsr; break;
+        case 0x342: cpu.mcause = newcsr; break;
+        case 0x343: cpu.mtval = newcsr; break;
+        case 0x344: cpu.mip = newcsr; break;
+        case 0xC00:
+        case 0xB00: cpu.mcycle = (cpu.mcycle & ~(uint64_t)0xFFFFFFFFUL) | newcsr; break;
+        case 0xC80:
+        case 0xB80: cpu.mcycle = (cpu.mcycle & (uint64_t)0xFFFFFFFFUL) | ((uint64_t)newcsr << 32U); break;
+        case 0xB02: cpu.minstret = (cpu.minstret & ~(uint64_t)0xFFFFFFFFUL) | newcsr; break;
+        case 0xB82: cpu.minstret = (cpu.minstret & (uint64_t)0xFFFFFFFFUL) | ((uint64_t)newcsr << 32U); break;
+    }
+
+    cpu.regs[d.rd] = rd_val;
+}
+
+void riscv::decode(DecodedInstr &d, uint32_t instr) {
+    d.instr   = instr;
+    d.handler = opIllegal;
+    d.rd      = (instr >> 7) & 0x1F;
+    d.rs1     = (instr >> 15) & 0x1F;
+    d.rs2     = (instr >> 20) & 0x1F;
+    d.imm     = (int32_t)instr >> 20;
+
+    unsigned funct3 = (instr >> 12) & 7;
+
+    switch (instr & 0x7f) {
+        case 0b0110111: d.handler = opLui; d.imm = instr & 0xFFFFF000; break;   // LUI
+        case 0b0010111: d.handler = opAuipc; d.imm = instr & 0xFFFFF000; break; // AUIPC
+        case 0b1101111: {                                                       // JAL
+            int32_t imm =
+                ((instr & 0x80000000) >> 11) | ((instr & 0x7FE00000) >> 20) | ((instr & 0x00100000) >> 9) | ((instr & 0x000FF000));
+            if (imm & 0x00100000)
+                imm |= 0xFFE00000;
+
+            d.handler = opJal;
+            d.imm     = imm;
+            if (callTracking && (d.rd == 1 || d.rd == 5))
+                d.handler = opJalCall;
+            break;
+        }
+
+        case 0b1100111: { // JALR
+            d.handler = opJalr;
+            if (callTracking) {
+                if (d.rd == 1 || d.rd == 5)
+                    d.handler = opJalrCall;
+                else if (d.rs1 == 1 || d.rs1 == 5)
+                    d.handler = opJalrRet;
             }
+            break;
+        }
 
-            case 0b0000011: { // Load
-                mcycle += 1;
-                int32_t imm = instr >> 20;
-                if (imm & 0x800)
-                    imm |= 0xFFFFF000;
-
-                uint32_t rs1  = this->regs[(instr >> 15) & 0x1F];
-                uint32_t addr = rs1 + imm;
-
-                switch ((instr >> 12) & 0x7) {
-                    case 0b000: rd_val = (int8_t)dataRead8(addr); break;   // LB
-                    case 0b001: rd_val = (int16_t)dataRead16(addr); break; // LH
-                    case 0b010: rd_val = dataRead32(addr); break;          // LW
-                    case 0b100: rd_val = dataRead8(addr); break;           // LBU
-                    case 0b101: rd_val = dataRead16(addr); break;          // LHU
-                    default: this->trap = TRAP_INSTR_ILLEGAL; break;
-                }
-                break;
+        case 0b1100011: { // Branch
+            int32_t imm = ((instr & 0xF00) >> 7) | ((instr & 0x7E000000) >> 20) | ((instr & 0x80) << 4) | ((instr >> 31) << 12);
+            if (imm & 0x1000)
+                imm |= 0xFFFFE000;
+
+            d.imm = imm;
+            switch (funct3) {
+                case 0b000: d.handler = opBeq; break;
+                case 0b001: d.handler = opBne; break;
+                case 0b100: d.handler = opBlt; break;
+                case 0b101: d.handler = opBge; break;
+                case 0b110: d.handler = opBltu; break;
+                case 0b111: d.handler = opBgeu; break;
             }
+            break;
+        }
 
-            case 0b0100011: { // Store
-                mcycle += 1;
-                int32_t imm = ((instr >> 7) & 0x1F) | ((instr & 0xFE000000) >> 20);
-                if (imm & 0x800)
-                    imm |= 0xFFFFF000;
-
-                uint32_t rs1  = this->regs[(instr >> 15) & 0x1F];
-                uint32_t rs2  = this->regs[(instr >> 20) & 0x1F];
-                uint32_t addr = rs1 + imm;
-                rd_idx        = 0;
-
-                switch ((instr >> 12) & 0x7) {
-                    case 0b000: dataWrite8(addr, rs2); break;  // SB
-                    case 0b001: dataWrite16(addr, rs2); break; // SH
-                    case 0b010: dataWrite32(addr, rs2); break; // SW
-                    default: this->trap = TRAP_INSTR_ILLEGAL; break;
-                }
-                break;
+        case 0b0000011: { // Load
+            switch (funct3) {
+                case 0b000: d.handler = memHandlers.lb; break;
+                case 0b001: d.handler = memHandlers.lh; break;
+                case 0b010: d.handler = memHandlers.lw; break;
+                case 0b100: d.handler = memHandlers.lbu; break;
+                case 0b101: d.handler = memHandlers.lhu; break;
             }
+            break;
+        }
 
-            case 0b0010011:   // ALU immediate
-            case 0b0110011: { // ALU register
-                uint32_t imm = instr >> 20;
-                if (imm & 0x800)
-                    imm |= 0xFFFFF000;
-
-                uint32_t rs1    = this->regs[(instr >> 15) & 0x1F];
-                bool     is_reg = (instr & 0b0100000) != 0;
-                uint32_t rs2    = is_reg ? this->regs[imm & 0x1F] : imm;
-
-                if (is_reg && (instr >> 25) == 1) {
-                    switch ((instr >> 12) & 7) {
-                        case 0b000: rd_val = rs1 * rs2; break;                                               // MUL
-                        case 0b001: rd_val = ((int64_t)(int32_t)rs1 * (int64_t)(int32_t)rs2) >> 32; break;   // MULH
-                        case 0b010: rd_val = ((int64_t)(int32_t)rs1 * (int64_t)(uint32_t)rs2) >> 32; break;  // MULHSU
-                        case 0b011: rd_val = ((int64_t)(uint32_t)rs1 * (int64_t)(uint32_t)rs2) >> 32; break; // MULHU
-                        case 0b100: {                                                                        // DIV
-                            int32_t dividend = rs1;
-                            int32_t divisor  = rs2;
-                            if (dividend == (int32_t)0x80000000 && divisor == -1) {
-                                rd_val = dividend;
-                            } else if (divisor == 0) {
-                                rd_val = 0xFFFFFFFF;
-                            } else {
-                                rd_val = dividend / divisor;
-                            }
-                            break;
-                        }
-                        case 0b101: { // DIVU
-                            uint32_t dividend = rs1;
-                            uint32_t divisor  = rs2;
-                            if (divisor == 0) {
-                                rd_val = 0xFFFFFFFF;
-                            } else {
-                                rd_val = dividend / divisor;
-                            }
-                            break;
-                        }
-                        case 0b110: { // REM
-                            int32_t dividend = rs1;
-                            int32_t divisor  = rs2;
-                            if (dividend == (int32_t)0x80000000 && divisor == -1) {
-                                rd_val = 0;
-                            } else if (divisor == 0) {
-                                rd_val = dividend;
-                            } else {
-                                rd_val = dividend % divisor;
-                            }
-                            break;
-                        }
-                        case 0b111: { // REMU
-                            uint32_t dividend = rs1;
-                            uint32_t divisor  = rs2;
-                            if (divisor == 0) {
-                                rd_val = dividend;
-                            } else {
-                                rd_val = dividend % divisor;
-                            }
-                            break;
-                        }
-                    }
+        case 0b0100011: { // Store
+            d.imm = ((instr >> 7) & 0x1F) | (((int32_t)instr >> 20) & ~0x1F);
+            switch (funct3) {
+                case 0b000: d.handler = memHandlers.sb; break;
+                case 0b001: d.handler = memHandlers.sh; break;
+                case 0b010: d.handler = memHandlers.sw; break;
+            }
+            break;
+        }
 
-                } else {
-                    switch ((instr >> 12) & 7) {
-                        case 0b000: rd_val = (is_reg && (instr & 0x40000000)) ? (rs1 - rs2) : (rs1 + rs2); break;  // ADDI/ADD/SUB
-                        case 0b001: rd_val = rs1 << rs2; break;                                                    // SLL
-                        case 0b010: rd_val = (int32_t)rs1 < (int32_t)rs2; break;                                   // SLT/SLTI
-                        case 0b011: rd_val = rs1 < rs2; break;                                                     // SLTU/SLTIU
-                        case 0b100: rd_val = rs1 ^ rs2; break;                                                     // XOR/XORI
-                        case 0b101: rd_val = (instr & 0x40000000) ? (((int32_t)rs1) >> rs2) : (rs1 >> rs2); break; // SRL/SRA
-                        case 0b110: rd_val = rs1 | rs2; break;                                                     // OR/ORI
-                        case 0b111: rd_val = rs1 & rs2; break;                                                     // AND/ANDI
-                    }
+        case 0b0010011: { // ALU immediate
+            switch (funct3) {
+                case 0b000: d.handler = opAddi; break;
+                case 0b001: d.handler = opSlli; d.imm &= 0x1F; break;
+                case 0b010: d.handler = opSlti; break;
+                case 0b011: d.handler = opSltiu; break;
+                case 0b100: d.handler = opXori; break;
+                case 0b101: d.handler = (instr & 0x40000000) ? opSrai : opSrli; d.imm &= 0x1F; break;
+                case 0b110: d.handler = opOri; break;
+                case 0b111: d.handler = opAndi; break;
+            }
+            break;
+        }
+
+        case 0b0110011: { // ALU register
+            if ((instr >> 25) == 1) {
+                static void (*const mulDiv[8])(riscv &, const DecodedInstr &, uint32_t, uint32_t &) = {
+                    opMul, opMulh, opMulhsu, opMulhu, opDiv, opDivu, opRem, opRemu};
+                d.handler = mulDiv[funct3];
+            } else {
+                switch (funct3) {
+                    case 0b000: d.handler = (instr & 0x40000000) ? opSub : opAdd; break;
+                    case 0b001: d.handler = opSll; break;
+                    case 0b010: d.handler = opSlt; break;
+                    case 0b011: d.handler = opSltu; break;
+                    case 0b100: d.handler = opXor; break;
+                    case 0b101: d.handler = (instr & 0x40000000) ? opSra : opSrl; break;
+                    case 0b110: d.handler = opOr; break;
+                    case 0b111: d.handler = opAnd; break;
                 }
-                break;
             }
+            break;
+        }
 
-            case 0b0001111: // FENCE, ignore
-                rd_idx = 0;
-                break;
+        case 0b0001111: d.handler = opFence; break;  // FENCE, ignore
+        case 0b1110011: d.handler = opSystem; break; // SYSTEM
+    }
 
-            case 0b1110011: { // SYSTEM
-                unsigned funct3 = (instr >> 12) & 7;
-
-                if (funct3 == 0b000) {
-                    switch (instr >> 20) {
-                        case 0b000000000000: this->trap = TRAP_ECALL_M; break;
-                        case 0b000000000001: this->trap = TRAP_BREAKPOINT; break;
-                        case 0b001100000010: { // MRET
-                            newpc        = this->mepc;
-                            mstatus_mie  = mstatus_mpie;
-                            mstatus_mpie = true;
-                            break;
-                        }
-                        default: this->trap = TRAP_INSTR_ILLEGAL; break;
-                    }
-                    break;
+    unsigned opcode = instr & 0x7f;
+    d.endsBlock     = d.handler == opIllegal || opcode == 0b1101111 || opcode == 0b1100111 || opcode == 0b1100011 || opcode == 0b1110011;
+}
 
-                } else {
-                    // CSR instructions
-                    unsigned csr = instr >> 20;
-
-                    // Read from CSR
-                    rd_val = 0;
-
-                    switch (csr) {
-                        case 0x300: {
-                            rd_val = 0;
-                            if (mstatus_mie)
-                                rd_val |= (1 << 3);
-                            if (mstatus_mpie)
-                                rd_val |= (1 << 7);
-                            break;
-                        }
-                        case 0x304: rd_val = this->mie; break;
-                        case 0x305: rd_val = this->mtvec; break;
-                        case 0x340: rd_val = this->mscratch; break;
-                        case 0x341: rd_val = this->mepc; break;
-                        case 0x342: rd_val = this->mcause; break;
-                        case 0x343: rd_val = this->mtval; break;
-                        case 0x344: rd_val = this->mip; break;
-                        case 0xC00:
-                        case 0xB00: rd_val = this->mcycle & 0xFFFFFFFF; break;
-                        case 0xC80:
-                        case 0xB80: rd_val = this->mcycle >> 32; break;
-                        case 0xC01: rd_val = this->mtime & 0xFFFFFFFF; break;
-                        case 0xC81: rd_val = this->mtime >> 32; break;
-                    }
-
-                    // Determine new CSR value
-                    uint32_t newcsr = 0;
-                    uint32_t val    = (funct3 & 4) ? ((instr >> 15) & 0x1F) : this->regs[(instr >> 15) & 0x1F];
-                    switch (funct3 & 3) {
-                        case 0b01: newcsr = val; break;           // CSRRW(I) - Atomic Read/Write
-                        case 0b10: newcsr = rd_val | val; break;  // CSRRS(I) - Atomic Read and Set Bits
-                        case 0b11: newcsr = rd_val & ~val; break; // CSRRC(I) - Atomic Read and Clear Bits
-                    }
-
-                    // Write CSR
-                    switch (csr) {
-                        case 0x300: {
-                            mstatus_mie  = (newcsr & (1 << 3)) != 0;
-                            mstatus_mpie = (newcsr & (1 << 7)) != 0;
-                            break;
-                        }
-                        case 0x304: this->mie = newcsr; break;
-                        case 0x305: this->mtvec = newcsr; break;
-                        case 0x340: this->mscratch = newcsr; break;
-                        case 0x341: this->mepc = newcsr; break;
-                        case 0x342: this->mcause = newcsr; break;
-                        case 0x343: this->mtval = newcsr; break;
-                        case 0x344: this->mip = newcsr; break;
-                        case 0xC00:
-                        case 0xB00: this->mcycle = (this->mcycle & ~(uint64_t)0xFFFFFFFFUL) | newcsr; break;
-                        case 0xC80:
-                        case 0xB80: this->mcycle = (this->mcycle & (uint64_t)0xFFFFFFFFUL) | ((uint64_t)newcsr << 32U); break;
-                    }
-                }
-                break;
-            }
+riscv::MemHandlers riscv::functionMemHandlers() {
+    return {opLb, opLh, opLw, opLbu, opLhu, opSb, opSh, opSw, nullptr};
+}
+
+void riscv::addCodeRegion(uint32_t base, uint32_t size) {
+    codeRegions.push_back({base, size, std::vector<bool>((size + granuleSize - 1) / granuleSize)});
+    flushInstrCache();
+}
+
+void riscv::flushInstrCache() {
+    for (auto &d : icache)
+        d.pc = ~0U;
+    for (auto &b : blocks)
+        b.pc = ~0U;
+    for (auto &region : codeRegions)
+        region.blockGranules.assign(region.blockGranules.size(), false);
+}
+
+void riscv::setCallTracking(bool enable) {
+    callTracking = enable;
+    callDepth    = 0;
 
-            default: this->trap = TRAP_INSTR_ILLEGAL; break; // Fault: Invalid opcode.
+    // Cached instructions use the handlers for the previous setting
+    flushInstrCache();
+}
+
+void riscv::popCall(uint32_t target) {
+    // Usually the top entry, searching further down recovers from returns that skipped frames (longjmp)
+    for (unsigned i = callDepth; i > 0; i--) {
+        if (callStack[i - 1] == target) {
+            callDepth = i - 1;
+            return;
         }
+        if (callStack[i - 1] & 1)
+            return;
+    }
+}
 
-        if (this->trap) {
-            rd_idx = 0;
+void riscv::popTrap() {
+    for (unsigned i = callDepth; i > 0; i--) {
+        if (callStack[i - 1] & 1) {
+            callDepth = i - 1;
+            return;
         }
+    }
+}
 
-        if (rd_idx != 0)
-            this->regs[rd_idx] = rd_val;
+void riscv::setBlockMode(bool enable) {
+    if (enable == getBlockMode())
+        return;
 
-        if (this->trap == 0) {
-            uint32_t pending = this->mip & this->mie;
-            if (pending != 0 && mstatus_mie) {
-                unsigned irq_num = 31 - __builtin_clz(pending);
-                this->trap       = TRAP_INTERRUPT | irq_num;
-            }
+    if (enable) {
+        blocks.resize(blockEntries);
+    } else {
+        blocks.clear();
+        blocks.shrink_to_fit();
+    }
+    flushInstrCache();
+}
+
+bool riscv::translate(Block &b, uint32_t addr) {
+    if (addr & 3)
+        return false;
+
+    for (auto &region : codeRegions) {
+        uint32_t offset = addr - region.base;
+        if (offset >= region.size)
+            continue;
+
+        unsigned maxInstrs = std::min<uint32_t>(maxBlockInstrs, (region.size - offset) / 4);
+
+        b.numInstrs = 0;
+        b.numLoads  = 0;
+        b.hasStores = false;
+        while (b.numInstrs < maxInstrs) {
+            auto &d = b.instrs[b.numInstrs];
+            decode(d, fetch(addr + b.numInstrs * 4));
+            d.pc = addr + b.numInstrs * 4;
+            b.numInstrs++;
+
+            unsigned opcode = d.instr & 0x7F;
+            if (opcode == 0b0000011)
+                b.numLoads++;
+            if (opcode == 0b0100011)
+                b.hasStores = true;
+            if (d.endsBlock)
+                break;
+        }
+        if (b.numInstrs == 0)
+            return false;
+
+        for (unsigned i = offset / granuleSize; i <= (offset + b.numInstrs * 4 - 1) / granuleSize; i++)
+            region.blockGranules[i] = true;
+
+        b.code = jitArena ? compile(b) : nullptr;
+        b.pc   = addr;
+        icacheMisses += b.numInstrs;
+        return true;
+    }
+    return false;
+}
+
+void riscv::invalidateBlocks(uint32_t addr) {
+    for (auto &region : codeRegions) {
+        uint32_t offset = addr - region.base;
+        if (offset >= region.size)
+            continue;
+
+        unsigned granule = offset / granuleSize;
+        if (!region.blockGranules[granule])
+            return;
+        region.blockGranules[granule] = false;
+
+        // Invalidate all blocks overlapping this granule
+        uint32_t start = granule * granuleSize;
+        uint32_t first = start > (maxBlockInstrs - 1) * 4 ? start - (maxBlockInstrs - 1) * 4 : 0;
+        for (uint32_t blockOffset = first; blockOffset < start + granuleSize; blockOffset += 4) {
+            auto &b = blocks[((region.base + blockOffset) >> 2) & (blockEntries - 1)];
+            if (b.pc == region.base + blockOffset && blockOffset + b.numInstrs * 4 > start)
+                b.pc = ~0U;
+        }
+        exitBlock = true;
+        return;
+    }
+}
+
+uint32_t riscv::enterTrap(uint32_t curpc, uint32_t newpc, uint32_t instr) {
+    if (this->trap == 0) {
+        uint32_t pending = this->mip & this->mie;
+        if (pending != 0 && mstatus_mie) {
+            unsigned irq_num = 31 - __builtin_clz(pending);
+            this->trap       = TRAP_INTERRUPT | irq_num;
         }
     }
 
@@ -306,9 +473,233 @@ void riscv::emulate() {
         this->mepc   = (this->trap & TRAP_INTERRUPT) ? newpc : curpc;
         newpc        = this->mtvec;
 
+        if (callTracking)
+            pushCall(this->mepc | 1);
+
         // fprintf(stderr, "Trap @ PC:%08X\n", this->pc);
         // abort();
     }
+    return newpc;
+}
+
+void riscv::emulate() {
+    mcycle += 2;
+
+    if (wfi) {
+        if ((mip & mie) == 0) {
+            idleSteps++;
+            return;
+        }
+        wfi = false;
+    }
+
+    this->trap     = TRAP_NONE;
+    uint32_t curpc = this->pc;
+    uint32_t newpc = curpc + 4;
+
+    DecodedInstr *d = &icache[(curpc >> 2) & (icacheEntries - 1)];
+    if (d->pc == curpc) {
+        icacheHits++;
+    } else {
+        icacheMisses++;
+
+        bool cacheable = false;
+        for (auto &region : codeRegions) {
+            if (curpc - region.base < region.size) {
+                cacheable = true;
+                break;
+            }
+        }
+        if (!cacheable)
+            d = &uncachedInstr;
+
+        uint32_t instr = fetch(curpc & ~3);
+        decode(*d, instr);
+        d->pc = (cacheable && !this->trap) ? curpc : ~0U;
+    }
+
+    if (!this->trap) {
+        d->handler(*this, *d, curpc, newpc);
+        this->regs[0] = 0;
+    }
+    if (!this->trap || (this->trap & TRAP_INTERRUPT))
+        minstret++;
 
-    this->pc = newpc;
+    this->pc = enterTrap(curpc, newpc, d->instr);
+}
+
+void riscv::setBreakpoints(const std::vector<uint32_t> &addrs) {
+    bpAddrs = addrs;
+    std::sort(bpAddrs.begin(), bpAddrs.end());
+
+    memset(bpPageBits, 0, sizeof(bpPageBits));
+    for (auto addr : bpAddrs) {
+        unsigned page = (addr / breakpointPageSize) & (breakpointPages - 1);
+        bpPageBits[page / 64] |= 1ULL << (page % 64);
+    }
+}
+
+bool riscv::hasBreakpoint(const Block &b) const {
+    uint32_t last = b.pc + (b.numInstrs - 1) * 4;
+    for (uint32_t page = b.pc / breakpointPageSize; page <= last / breakpointPageSize; page++) {
+        unsigned idx = page & (breakpointPages - 1);
+        if (bpPageBits[idx / 64] & (1ULL << (idx % 64)))
+            return true;
+    }
+    return false;
+}
+
+bool riscv::waitForInterrupt(unsigned &remaining) {
+    if (!wfi)
+        return false;
+    if (mip & mie) {
+        wfi = false;
+        return false;
+    }
+
+    // Nothing can wake up the CPU before the caller pends an interrupt, skip the remaining steps
+    mcycle += 2 * remaining;
+    idleSteps += remaining;
+    remaining = 0;
+    return true;
+}
+
+unsigned riscv::run(unsigned numInstrs) {
+    unsigned remaining = numInstrs;
+
+    if (blocks.empty()) {
+        // A loop iteration runs from the target of a backward jump or branch to the next one back to it. An
+        // iteration that loads without storing or load side effects and ends with the registers it started with
+        // keeps doing so until the next event, like an idle block below. Skip its remaining iterations.
+        uint32_t loopPc        = ~0U;
+        unsigned loopRemaining = 0;
+        unsigned loopStores    = 0;
+        uint64_t loopCycles    = 0;
+        bool     loopIdle      = false; // Previous iteration was load-only, 'loopRegs' holds its registers
+        unsigned loopBackoff   = 0;     // Backward jumps to let pass after a load-only loop that kept running
+        uint32_t loopRegs[32];
+
+        while (remaining > 0 && !waitForInterrupt(remaining)) {
+            uint32_t curpc = this->pc;
+            emulate();
+            remaining--;
+            if (!bpAddrs.empty() && isBreakpoint(this->pc))
+                break;
+            if (this->pc > curpc || this->trap)
+                continue;
+            if (loopBackoff > 0) {
+                loopBackoff--;
+                loopPc   = ~0U;
+                loopIdle = false;
+                continue;
+            }
+
+            unsigned steps  = loopRemaining - remaining;
+            uint64_t cycles = mcycle - loopCycles;
+            if (this->pc == loopPc && numStores == loopStores && !loadSideEffect && cycles > 2 * steps) {
+                if (loopIdle && memcmp(loopRegs, regs, sizeof(regs)) == 0) {
+                    unsigned iterations = remaining / steps;
+                    mcycle += iterations * cycles;
+                    minstret += (uint64_t)iterations * steps;
+                    idleSteps += iterations * steps;
+                    remaining -= iterations * steps;
+                } else if (loopIdle) {
+                    loopBackoff = 64;
+                } else {
+                    loopIdle = true;
+                    memcpy(loopRegs, regs, sizeof(regs));
+                }
+            } else {
+                loopIdle = false;
+            }
+            loopPc         = this->pc;
+            loopRemaining  = remaining;
+            loopStores     = numStores;
+            loopCycles     = mcycle;
+            loadSideEffect = false;
+        }
+        return numInstrs - remaining;
+    }
+
+    // Within a block only SYSTEM instructions (which end a block) and pendInterrupt() can make an interrupt
+    // pending, so interrupts are checked between blocks. One that is already pending is taken after the next
+    // instruction, just like emulate() does.
+    if (remaining > 0 && (mip & mie) && mstatus_mie) {
+        idlePc = ~0U;
+        emulate();
+        remaining--;
+        if (!bpAddrs.empty() && isBreakpoint(this->pc))
+            return numInstrs - remaining;
+    }
+
+    bool breakpoints = !bpAddrs.empty();
+    while (remaining > 0 && !waitForInterrupt(remaining)) {
+        uint32_t curpc = this->pc;
+        Block   &b     = blocks[(curpc >> 2) & (blockEntries - 1)];
+        if ((b.pc != curpc && !translate(b, curpc)) || (breakpoints && hasBreakpoint(b))) {
+            // Outside of the code regions or near a breakpoint, single step
+            idlePc = ~0U;
+            emulate();
+            remaining--;
+            if (breakpoints && isBreakpoint(this->pc))
+                break;
+            continue;
+        }
+        if (b.pc != idlePc)
+            idlePc = ~0U;
+
+        unsigned count = std::min(b.numInstrs, remaining);
+        unsigned idx   = 0;
+        uint32_t newpc;
+
+        this->trap     = TRAP_NONE;
+        exitBlock      = false;
+        loadSideEffect = false;
+        if (b.code && count == b.numInstrs) {
+            uint64_t result = b.code(this);
+            newpc           = (uint32_t)result;
+            idx             = (unsigned)(result >> 32);
+            curpc           = b.pc + (idx - 1) * 4;
+        } else {
+            while (true) {
+                auto &d = b.instrs[idx++];
+                newpc   = curpc + 4;
+                d.handler(*this, d, curpc, newpc);
+                this->regs[0] = 0;
+                if (idx == count || exitBlock)
+                    break;
+                curpc = newpc;
+            }
+        }
+
+        mcycle += 2 * idx;
+        minstret += (this->trap && !(this->trap & TRAP_INTERRUPT)) ? idx - 1 : idx;
+        icacheHits += idx;
+        remaining -= idx;
+
+        // Most blocks end without a trap or an enabled pending interrupt, keep enterTrap() off that path
+        if (this->trap || ((mip & mie) && mstatus_mie))
+            this->pc = enterTrap(curpc, newpc, b.instrs[idx - 1].instr);
+        else
+            this->pc = newpc;
+
+        if (this->pc == b.pc && idx == b.numInstrs && !this->trap && !exitBlock && !b.hasStores && b.numLoads > 0 && !loadSideEffect) {
+            // A polling loop that ends an iteration with the same registers it started with, without storing
+            // anything or popping a FIFO, keeps doing so until the next event. Skip its remaining iterations.
+            if (idlePc == b.pc && memcmp(idleRegs, regs, sizeof(regs)) == 0) {
+                unsigned iterations = remaining / b.numInstrs;
+                mcycle += (uint64_t)iterations * (2 * b.numInstrs + b.numLoads);
+                minstret += (uint64_t)iterations * b.numInstrs;
+                idleSteps += iterations * b.numInstrs;
+                remaining -= iterations * b.numInstrs;
+            } else {
+                idlePc = b.pc;
+                memcpy(idleRegs, regs, sizeof(regs));
+            }
+        }
+
+        if (breakpoints && isBreakpoint(this->pc))
+            break;
+    }
+    return numInstrs - remaining;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Common.h"
+#include <algorithm>
 
 enum trap {
     TRAP_NONE               = 0,
@@ -22,6 +23,52 @@ enum trap {
 };
 
 struct riscv {
+    struct DecodedInstr;
+    using Handler = void (*)(riscv &cpu, const DecodedInstr &d, uint32_t curpc, uint32_t &newpc);
+
+    // Host code compiled from a block, returns the next PC in the low and the number of executed instructions
+    // in the high 32 bits
+    using BlockCode = uint64_t (*)(riscv *cpu);
+
+    // Decoded instruction, cached per PC in a direct-mapped instruction cache
+    struct DecodedInstr {
+        Handler handler = nullptr;
+
+        uint32_t pc    = ~0U; // Tag, ~0 when invalid
+        uint32_t instr = 0;
+        int32_t  imm   = 0;
+        uint8_t  rd        = 0;
+        uint8_t  rs1       = 0;
+        uint8_t  rs2       = 0;
+        bool     endsBlock = false; // Control transfer, SYSTEM or illegal instruction
+    };
+    static constexpr unsigned icacheEntries = 16384;
+
+    // Straight-line run of decoded instructions, executed by run() when block mode is enabled
+    static constexpr unsigned blockEntries   = 2048;
+    static constexpr unsigned maxBlockInstrs = 32;
+    static constexpr unsigned granuleSize    = 64; // Granularity of code write tracking for blocks
+
+    // Executable memory for compiled blocks, all blocks are translated again when it runs out
+    static constexpr size_t jitArenaSize     = 8 << 20;
+    static constexpr size_t maxBlockCodeSize = 4096;
+
+    // Depth of the call stack tracked for the profiler
+    static constexpr unsigned maxCallDepth = 64;
+
+    // Breakpoint addresses are hashed into a bitmap of pages, only pages with a breakpoint need a lookup
+    static constexpr unsigned breakpointPageSize = 256;
+    static constexpr unsigned breakpointPages    = 4096;
+
+    struct Block {
+        uint32_t     pc        = ~0U; // Start address, ~0 when invalid
+        unsigned     numInstrs = 0;
+        unsigned     numLoads  = 0;
+        bool         hasStores = false;
+        BlockCode    code      = nullptr; // Set when the JIT is enabled
+        DecodedInstr instrs[maxBlockInstrs];
+    };
+
     uint32_t regs[32]; // Registers
     uint32_t pc;       // Program counter
 
@@ -36,16 +83,74 @@ struct riscv {
     uint32_t mtval;        // 0x343 (MRW) Machine bad address or instruction
     uint32_t mip;          // 0x344 (MRW) Machine interrupt pending
     uint64_t mcycle;       // 0xB00/0xB80 and 0xC00/0xC80
+    uint64_t minstret;     // 0xB02/0xB82 and 0xC02/0xC82
     uint64_t mtime;        // 0xC01/0xC81
     uint64_t mtimecmp;
 
     // Internal state
     uint32_t trap;
+    bool     wfi = false; // Waiting for interrupt
 
     void emulate();
     void dumpRegs();
 
-    void pendInterrupt(uint32_t mask) { mip |= mask; }
+    // Execute up to 'numInstrs' instructions, by whole blocks when block mode is enabled. Stops early when
+    // the PC reaches a breakpoint, returns the number of instructions executed.
+    unsigned run(unsigned numInstrs);
+    void     setBlockMode(bool enable);
+    bool     getBlockMode() const { return !blocks.empty(); }
+
+    // Compile blocks to host code (x86-64 only), used when block mode is enabled
+    static bool jitSupported();
+    void        setJit(bool enable);
+    bool        getJit() const { return jitArena != nullptr; }
+
+    void setBreakpoints(const std::vector<uint32_t> &addrs);
+    bool isBreakpoint(uint32_t addr) const {
+        unsigned page = (addr / breakpointPageSize) & (breakpointPages - 1);
+        if ((bpPageBits[page / 64] & (1ULL << (page % 64))) == 0)
+            return false;
+        return std::binary_search(bpAddrs.begin(), bpAddrs.end(), addr);
+    }
+
+    // Only instructions fetched from these regions are cached, others are decoded on every fetch
+    void addCodeRegion(uint32_t base, uint32_t size);
+    void flushInstrCache();
+    void invalidateInstr(uint32_t addr) {
+        numStores++;
+        auto &d = icache[(addr >> 2) & (icacheEntries - 1)];
+        if ((d.pc & ~3) == (addr & ~3))
+            d.pc = ~0U;
+        if (!blocks.empty())
+            invalidateBlocks(addr);
+    }
+
+    uint64_t icacheHits   = 0;
+    uint64_t icacheMisses = 0;
+    uint64_t idleSteps    = 0; // Steps skipped while waiting in WFI or in an idle loop
+
+    // Set by the bus on loads with side effects (popping a FIFO). A loop doing those is never skipped as idle,
+    // even when its registers come back the same.
+    bool loadSideEffect = false;
+
+    // When call tracking is enabled, calls (jal/jalr with ra or t0 as link register) push their return address
+    // and returns pop it. Traps push the address they interrupted with bit 0 set, MRET pops up to and
+    // including it. Calls beyond maxCallDepth are not tracked.
+    uint32_t callStack[maxCallDepth];
+    unsigned callDepth = 0;
+    void     setCallTracking(bool enable);
+    bool     getCallTracking() const { return callTracking; }
+    void     popCall(uint32_t target);
+    void     popTrap();
+    void     pushCall(uint32_t retAddr) {
+        if (callDepth < maxCallDepth)
+            callStack[callDepth++] = retAddr;
+    }
+
+    void pendInterrupt(uint32_t mask) {
+        mip |= mask;
+        exitBlock = true;
+    }
     void clearInterrupt(uint32_t mask) { mip &= ~mask; }
 
     std::function<void(uint32_t vaddr, uint8_t val)>  dataWrite8;
@@ -55,8 +160,94 @@ struct riscv {
     std::function<uint16_t(uint32_t vaddr)>           dataRead16;
     std::function<uint32_t(uint32_t vaddr)>           dataRead32;
     std::function<uint32_t(uint32_t vaddr)>           instrRead;
+
+    // Bind loads, stores and instruction fetches directly to the _memRead8/16/32, _memWrite8/16/32 and memRead
+    // accessors of 'bus', so they are inlined into the instruction handlers instead of going through the
+    // std::function members above. Those stay available for the debugger and other tools.
+    template <class Bus>
+    void bindBus(Bus *bus);
+
+private:
+    // Load and store handlers and instruction fetch, the defaults call the std::function members
+    struct MemHandlers {
+        Handler lb, lh, lw, lbu, lhu, sb, sh, sw;
+        uint32_t (*fetch)(void *bus, uint32_t addr);
+    };
+    template <class Bus>
+    struct BusHandlers;
+
+    struct CodeRegion {
+        uint32_t          base;
+        uint32_t          size;
+        std::vector<bool> blockGranules; // Granules containing translated blocks
+    };
+
+    std::vector<DecodedInstr> icache = std::vector<DecodedInstr>(icacheEntries);
+    std::vector<Block>        blocks;
+    std::vector<CodeRegion>   codeRegions;
+    DecodedInstr              uncachedInstr;
+    bool                      exitBlock    = false; // Leave the current block after this instruction
+    bool                      callTracking = false;
+    uint32_t                  idlePc    = ~0U;   // Self-looping block executed last, with its registers after that
+    uint32_t                  idleRegs[32];
+    unsigned                  numStores = 0; // Memory writes, counted by invalidateInstr()
+    std::vector<uint32_t>     bpAddrs;           // Sorted breakpoint addresses
+    uint64_t                  bpPageBits[breakpointPages / 64] = {};
+    MemHandlers               memHandlers = functionMemHandlers();
+    void                     *bus         = nullptr; // Bound by bindBus()
+
+    std::unique_ptr<uint8_t, void (*)(uint8_t *)> jitArena{nullptr, freeJitArena}; // Set when the JIT is enabled
+    size_t                                        jitUsed = 0;
+
+    void      decode(DecodedInstr &d, uint32_t instr);
+    bool      translate(Block &b, uint32_t addr);
+    BlockCode compile(Block &b);
+    bool      hasBreakpoint(const Block &b) const;
+    bool      waitForInterrupt(unsigned &remaining);
+    void      invalidateBlocks(uint32_t addr);
+    uint32_t  enterTrap(uint32_t curpc, uint32_t newpc, uint32_t instr);
+    uint32_t  fetch(uint32_t addr) { return memHandlers.fetch ? memHandlers.fetch(bus, addr) : instrRead(addr); }
+
+    static MemHandlers functionMemHandlers();
+    static void        freeJitArena(uint8_t *p);
 };
 
+template <class Bus>
+struct riscv::BusHandlers {
+    // clang-format off
+    static void lb (riscv &cpu, const DecodedInstr &d, uint32_t, uint32_t &) { cpu.mcycle += 1; cpu.regs[d.rd] = (int8_t)static_cast<Bus *>(cpu.bus)->_memRead8(cpu.regs[d.rs1] + d.imm); }
+    static void lh (riscv &cpu, const DecodedInstr &d, uint32_t, uint32_t &) { cpu.mcycle += 1; cpu.regs[d.rd] = (int16_t)static_cast<Bus *>(cpu.bus)->_memRead16(cpu.regs[d.rs1] + d.imm); }
+    static void lw (riscv &cpu, const DecodedInstr &d, uint32_t, uint32_t &) { cpu.mcycle += 1; cpu.regs[d.rd] = static_cast<Bus *>(cpu.bus)->_memRead32(cpu.regs[d.rs1] + d.imm); }
+    static void lbu(riscv &cpu, const DecodedInstr &d, uint32_t, uint32_t &) { cpu.mcycle += 1; cpu.regs[d.rd] = static_cast<Bus *>(cpu.bus)->_memRead8(cpu.regs[d.rs1] + d.imm); }
+    static void lhu(riscv &cpu, const DecodedInstr &d, uint32_t, uint32_t &) { cpu.mcycle += 1; cpu.regs[d.rd] = static_cast<Bus *>(cpu.bus)->_memRead16(cpu.regs[d.rs1] + d.imm); }
+
+    static void sb(riscv &cpu, const DecodedInstr &d, uint32_t, uint32_t &) { cpu.mcycle += 1; uint32_t addr = cpu.regs[d.rs1] + d.imm; static_cast<Bus *>(cpu.bus)->_memWrite8(addr, cpu.regs[d.rs2]); cpu.invalidateInstr(addr); }
+    static void sh(riscv &cpu, const DecodedInstr &d, uint32_t, uint32_t &) { cpu.mcycle += 1; uint32_t addr = cpu.regs[d.rs1] + d.imm; static_cast<Bus *>(cpu.bus)->_memWrite16(addr, cpu.regs[d.rs2]); cpu.invalidateInstr(addr); }
+    static void sw(riscv &cpu, const DecodedInstr &d, uint32_t, uint32_t &) { cpu.mcycle += 1; uint32_t addr = cpu.regs[d.rs1] + d.imm; static_cast<Bus *>(cpu.bus)->_memWrite32(addr, cpu.regs[d.rs2]); cpu.invalidateInstr(addr); }
+    // clang-format on
+
+    static uint32_t fetch(void *bus, uint32_t addr) { return (uint32_t) static_cast<Bus *>(bus)->memRead(addr); }
+};
+
+template <class Bus>
+void riscv::bindBus(Bus *bus) {
+    this->bus   = bus;
+    memHandlers = {
+        BusHandlers<Bus>::lb,
+        BusHandlers<Bus>::lh,
+        BusHandlers<Bus>::lw,
+        BusHandlers<Bus>::lbu,
+        BusHandlers<Bus>::lhu,
+        BusHandlers<Bus>::sb,
+        BusHandlers<Bus>::sh,
+        BusHandlers<Bus>::sw,
+        BusHandlers<Bus>::fetch,
+    };
+
+    // Cached instructions still refer to the previous handlers
+    flushInstrCache();
+}
+
 std::string instrToString(uint32_t instruction, uint32_t pc);
 
 //    3                   2                   1
@@ -0,0 +1,353 @@
+#include "riscv.h"
+
+// Compiles blocks to x86-64 code. ALU instructions, jumps and branches are translated to host instructions
+// operating on cpu.regs, the others (loads, stores, division, SYSTEM) call their handler. The generated
+// code does what the block loop in riscv::run() does with the same instructions: it stops after a load or
+// store that sets exitBlock and returns the next PC and the number of instructions executed. run() does
+// the rest (cycle counting, traps, interrupts).
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define RISCV_JIT
+#endif
+
+#ifdef RISCV_JIT
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+#ifdef RISCV_JIT
+namespace {
+
+enum { EAX = 0, ECX = 1, EDX = 2, RBX = 3 };
+
+// Offset of the stack slot passed to handlers as 'newpc', above the shadow space of the Windows x64 ABI
+static constexpr uint8_t newPcSlot = 32;
+
+struct Emitter {
+    uint8_t *p;
+
+    void u8(uint8_t val) { *p++ = val; }
+    void u32(uint32_t val) {
+        memcpy(p, &val, 4);
+        p += 4;
+    }
+    void u64(uint64_t val) {
+        memcpy(p, &val, 8);
+        p += 8;
+    }
+    void bytes(std::initializer_list<uint8_t> vals) {
+        for (auto val : vals)
+            u8(val);
+    }
+
+    // ModRM operand [rbx + disp32], rbx holds the riscv pointer
+    void mem(int reg, int32_t disp) {
+        u8(0x80 | (reg << 3) | RBX);
+        u32(disp);
+    }
+
+    // Patch a rel32 operand ending at 'end' to jump to the current position
+    void patch(uint8_t *end) {
+        int32_t rel = (int32_t)(p - end);
+        memcpy(end - 4, &rel, 4);
+    }
+};
+
+} // namespace
+#endif
+
+bool riscv::jitSupported() {
+#ifdef RISCV_JIT
+    return true;
+#else
+    return false;
+#endif
+}
+
+void riscv::freeJitArena(uint8_t *p) {
+#ifdef RISCV_JIT
+#ifdef _WIN32
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, jitArenaSize);
+#endif
+#endif
+}
+
+void riscv::setJit(bool enable) {
+    if (enable == getJit() || (enable && !jitSupported()))
+        return;
+
+    // Blocks are compiled when translated, translate them again with the new setting
+    flushInstrCache();
+
+#ifdef RISCV_JIT
+    if (enable) {
+#ifdef _WIN32
+        void *p = VirtualAlloc(nullptr, jitArenaSize, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+        if (p == nullptr)
+            return;
+#else
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_JIT
+        flags |= MAP_JIT;
+#endif
+        void *p = mmap(nullptr, jitArenaSize, PROT_READ | PROT_WRITE | PROT_EXEC, flags, -1, 0);
+        if (p == MAP_FAILED)
+            return;
+#endif
+        jitArena.reset(static_cast<uint8_t *>(p));
+        jitUsed = 0;
+        return;
+    }
+#endif
+    jitArena.reset();
+}
+
+riscv::BlockCode riscv::compile(Block &b) {
+#ifndef RISCV_JIT
+    return nullptr;
+#else
+    if (jitUsed + maxBlockCodeSize > jitArenaSize) {
+        // Start over, the blocks compiled so far are translated again when they are executed next
+        for (auto &other : blocks)
+            other.pc = ~0U;
+        jitUsed = 0;
+    }
+
+    uint8_t *start      = jitArena.get() + jitUsed;
+    Emitter  e          = {start};
+    int32_t  exitOffset = (int32_t)((uint8_t *)&exitBlock - (uint8_t *)this);
+    auto     reg        = [this](unsigned r) { return (int32_t)((uint8_t *)&regs[r] - (uint8_t *)this); };
+
+    // Prologue, keeps the stack 16 byte aligned for the handler calls
+    e.u8(0x53);                        // push rbx
+    e.bytes({0x48, 0x83, 0xEC, 0x30}); // sub rsp, 48
+#ifdef _WIN32
+    e.bytes({0x48, 0x89, 0xCB}); // mov rbx, rcx
+#else
+    e.bytes({0x48, 0x89, 0xFB}); // mov rbx, rdi
+#endif
+
+    // Early exits after loads and stores, patched to jump to a stub returning their next PC
+    struct Exit {
+        uint8_t *jump;
+        uint32_t newpc;
+        unsigned count;
+    };
+    Exit     exits[maxBlockInstrs];
+    unsigned numExits = 0;
+    bool     ended    = false; // eax holds the next PC
+
+    for (unsigned i = 0; i < b.numInstrs; i++) {
+        const auto &d      = b.instrs[i];
+        uint32_t    curpc  = d.pc;
+        unsigned    opcode = d.instr & 0x7F;
+        unsigned    funct3 = (d.instr >> 12) & 7;
+        bool        alt    = (d.instr & 0x40000000) != 0;
+        bool        native = true;
+
+        switch (opcode) {
+            case 0b0110111: // LUI
+            case 0b0010111: // AUIPC
+                if (d.rd != 0) {
+                    e.u8(0xC7); // mov dword [rd], imm32
+                    e.mem(0, reg(d.rd));
+                    e.u32(opcode == 0b0110111 ? d.imm : curpc + d.imm);
+                }
+                break;
+
+            case 0b1101111: // JAL
+            case 0b1100111: // JALR
+                if (callTracking) {
+                    native = false;
+                    break;
+                }
+                if (opcode == 0b1100111) {
+                    e.u8(0x8B); // mov eax, [rs1]
+                    e.mem(EAX, reg(d.rs1));
+                    e.u8(0x05); // add eax, imm32
+                    e.u32(d.imm);
+                    e.u8(0x25); // and eax, ~3
+                    e.u32(~3U);
+                } else {
+                    e.u8(0xB8); // mov eax, imm32
+                    e.u32(curpc + d.imm);
+                }
+                if (d.rd != 0) {
+                    e.u8(0xC7); // mov dword [rd], imm32
+                    e.mem(0, reg(d.rd));
+                    e.u32(curpc + 4);
+                }
+                ended = true;
+                break;
+
+            case 0b1100011: { // Branch
+                static const uint8_t conditions[8] = {0x4, 0x5, 0, 0, 0xC, 0xD, 0x2, 0x3}; // e, ne, l, ge, b, ae
+                if (funct3 == 0b010 || funct3 == 0b011) {
+                    native = false;
+                    break;
+                }
+                e.u8(0x8B); // mov eax, [rs1]
+                e.mem(EAX, reg(d.rs1));
+                e.u8(0x3B); // cmp eax, [rs2]
+                e.mem(EAX, reg(d.rs2));
+                e.u8(0xB8); // mov eax, curpc + 4
+                e.u32(curpc + 4);
+                e.u8(0xB9); // mov ecx, curpc + imm
+                e.u32(curpc + d.imm);
+                e.bytes({0x0F, (uint8_t)(0x40 | conditions[funct3]), 0xC1}); // cmovcc eax, ecx
+                ended = true;
+                break;
+            }
+
+            case 0b0010011: // ALU immediate
+                if (d.rd == 0)
+                    break;
+                e.u8(0x8B); // mov eax, [rs1]
+                e.mem(EAX, reg(d.rs1));
+                // clang-format off
+                switch (funct3) {
+                    case 0b000: e.u8(0x05); e.u32(d.imm); break;                           // add eax, imm32
+                    case 0b001: e.bytes({0xC1, 0xE0, (uint8_t)d.imm}); break;              // shl eax, imm8
+                    case 0b010: e.u8(0x3D); e.u32(d.imm); e.bytes({0x0F, 0x9C, 0xC0}); break; // cmp eax, imm32; setl al
+                    case 0b011: e.u8(0x3D); e.u32(d.imm); e.bytes({0x0F, 0x92, 0xC0}); break; // cmp eax, imm32; setb al
+                    case 0b100: e.u8(0x35); e.u32(d.imm); break;                           // xor eax, imm32
+                    case 0b101: e.bytes({0xC1, (uint8_t)(alt ? 0xF8 : 0xE8), (uint8_t)d.imm}); break; // sar/shr eax, imm8
+                    case 0b110: e.u8(0x0D); e.u32(d.imm); break;                           // or eax, imm32
+                    case 0b111: e.u8(0x25); e.u32(d.imm); break;                           // and eax, imm32
+                }
+                // clang-format on
+                if (funct3 == 0b010 || funct3 == 0b011)
+                    e.bytes({0x0F, 0xB6, 0xC0}); // movzx eax, al
+                e.u8(0x89); // mov [rd], eax
+                e.mem(EAX, reg(d.rd));
+                break;
+
+            case 0b0110011: // ALU register
+                if ((d.instr >> 25) == 1 && funct3 >= 0b100) {
+                    // Division and remainder
+                    native = false;
+                    break;
+                }
+                if (d.rd == 0)
+                    break;
+                e.u8(0x8B); // mov eax, [rs1]
+                e.mem(EAX, reg(d.rs1));
+                // clang-format off
+                if ((d.instr >> 25) == 1) {
+                    switch (funct3) {
+                        case 0b000: e.bytes({0x0F, 0xAF}); e.mem(EAX, reg(d.rs2)); break; // imul eax, [rs2]
+                        case 0b001: e.u8(0xF7); e.mem(5, reg(d.rs2)); break;              // imul dword [rs2]
+                        case 0b011: e.u8(0xF7); e.mem(4, reg(d.rs2)); break;              // mul dword [rs2]
+                        case 0b010:
+                            e.bytes({0x48, 0x63}); // movsxd rax, [rs1]
+                            e.mem(EAX, reg(d.rs1));
+                            e.u8(0x8B); // mov ecx, [rs2]
+                            e.mem(ECX, reg(d.rs2));
+                            e.bytes({0x48, 0x0F, 0xAF, 0xC1}); // imul rax, rcx
+                            e.bytes({0x48, 0xC1, 0xE8, 0x20}); // shr rax, 32
+                            break;
+                    }
+                    if (funct3 == 0b001 || funct3 == 0b011)
+                        e.bytes({0x89, 0xD0}); // mov eax, edx
+                } else {
+                    switch (funct3) {
+                        case 0b000: e.u8(alt ? 0x2B : 0x03); e.mem(EAX, reg(d.rs2)); break; // sub/add eax, [rs2]
+                        case 0b010: e.u8(0x3B); e.mem(EAX, reg(d.rs2)); e.bytes({0x0F, 0x9C, 0xC0, 0x0F, 0xB6, 0xC0}); break; // setl
+                        case 0b011: e.u8(0x3B); e.mem(EAX, reg(d.rs2)); e.bytes({0x0F, 0x92, 0xC0, 0x0F, 0xB6, 0xC0}); break; // setb
+                        case 0b100: e.u8(0x33); e.mem(EAX, reg(d.rs2)); break; // xor eax, [rs2]
+                        case 0b110: e.u8(0x0B); e.mem(EAX, reg(d.rs2)); break; // or eax, [rs2]
+                        case 0b111: e.u8(0x23); e.mem(EAX, reg(d.rs2)); break; // and eax, [rs2]
+                        case 0b001:
+                        case 0b101:
+                            e.u8(0x8B); // mov ecx, [rs2]
+                            e.mem(ECX, reg(d.rs2));
+                            e.bytes({0xD3, (uint8_t)(funct3 == 0b001 ? 0xE0 : alt ? 0xF8 : 0xE8)}); // shl/sar/shr eax, cl
+                            break;
+                    }
+                }
+                // clang-format on
+                e.u8(0x89); // mov [rd], eax
+                e.mem(EAX, reg(d.rd));
+                break;
+
+            case 0b0001111: break; // FENCE, ignore
+
+            default: native = false; break;
+        }
+        if (native)
+            continue;
+
+        // Call the handler like the block loop does
+        e.bytes({0xC7, 0x44, 0x24, newPcSlot}); // mov dword [rsp + newPcSlot], curpc + 4
+        e.u32(curpc + 4);
+#ifdef _WIN32
+        e.bytes({0x48, 0x89, 0xD9}); // mov rcx, rbx
+        e.bytes({0x48, 0xBA});       // mov rdx, &d
+        e.u64((uintptr_t)&d);
+        e.bytes({0x41, 0xB8}); // mov r8d, curpc
+        e.u32(curpc);
+        e.bytes({0x4C, 0x8D, 0x4C, 0x24, newPcSlot}); // lea r9, [rsp + newPcSlot]
+#else
+        e.bytes({0x48, 0x89, 0xDF}); // mov rdi, rbx
+        e.bytes({0x48, 0xBE});       // mov rsi, &d
+        e.u64((uintptr_t)&d);
+        e.u8(0xBA); // mov edx, curpc
+        e.u32(curpc);
+        e.bytes({0x48, 0x8D, 0x4C, 0x24, newPcSlot}); // lea rcx, [rsp + newPcSlot]
+#endif
+        e.bytes({0x48, 0xB8}); // mov rax, handler
+        e.u64((uintptr_t)d.handler);
+        e.bytes({0xFF, 0xD0}); // call rax
+
+        if (d.rd == 0) {
+            e.u8(0xC7); // mov dword [x0], 0
+            e.mem(0, reg(0));
+            e.u32(0);
+        }
+        if (d.endsBlock) {
+            e.bytes({0x8B, 0x44, 0x24, newPcSlot}); // mov eax, [rsp + newPcSlot]
+            ended = true;
+        } else if ((opcode == 0b0000011 || opcode == 0b0100011) && i + 1 < b.numInstrs) {
+            // A store to code in this block or an interrupt pended by the bus ends the block
+            e.u8(0x80); // cmp byte [exitBlock], 0
+            e.mem(7, exitOffset);
+            e.u8(0);
+            e.bytes({0x0F, 0x85, 0, 0, 0, 0}); // jne exit
+            exits[numExits++] = {e.p, curpc + 4, i + 1};
+        }
+    }
+
+    if (!ended) {
+        e.u8(0xB8); // mov eax, next PC
+        e.u32(b.instrs[b.numInstrs - 1].pc + 4);
+    }
+    e.u8(0xBA); // mov edx, count
+    e.u32(b.numInstrs);
+
+    uint8_t *epilogue = e.p;
+    e.bytes({0x48, 0xC1, 0xE2, 0x20}); // shl rdx, 32
+    e.bytes({0x48, 0x09, 0xD0});       // or rax, rdx
+    e.bytes({0x48, 0x83, 0xC4, 0x30}); // add rsp, 48
+    e.u8(0x5B);                        // pop rbx
+    e.u8(0xC3);                        // ret
+
+    for (unsigned i = 0; i < numExits; i++) {
+        e.patch(exits[i].jump);
+        e.u8(0xB8); // mov eax, newpc
+        e.u32(exits[i].newpc);
+        e.u8(0xBA); // mov edx, count
+        e.u32(exits[i].count);
+        e.u8(0xE9); // jmp epilogue
+        e.u32((uint32_t)(epilogue - (e.p + 4)));
+    }
+
+    jitUsed = (jitUsed + (e.p - start) + 15) & ~(size_t)15;
+    return reinterpret_cast<BlockCode>(start);
+#endif
+}
@@ -100,21 +100,22 @@ public:
         renderOverlay(pixels, pitch);
     }
 
-    void spiTx(const void *data, size_t length) override {
-        EmuState::spiTx(data, length);
-        if (!spiSelected || txBuf.empty())
-            return;
-
-        switch (txBuf[0]) {
+    void spiCommand(uint8_t cmd, const uint8_t *data, size_t length, uint8_t *rxBuf, size_t rxLength) override {
+        switch (cmd) {
             case CMD_SET_KEYB_MATRIX: {
-                if (txBuf.size() == 1 + 8) {
-                    memcpy(&keybMatrix, &txBuf[1], 8);
+                if (length == 8) {
+                    memcpy(&keybMatrix, data, 8);
                 }
                 break;
             }
+
+            default: EmuState::spiCommand(cmd, data, length, rxBuf, rxLength); break;
         }
     }
 
+    // No keyboard buffer on this core, so there is nothing to type into
+    void pasteText(const std::string &str) override {}
+
     uint8_t memRead(uint16_t addr) {
         if (startupMode) {
             if (addr < 0x4000) {
@@ -236,6 +237,8 @@ public:
     }
 
     void emulateFrame(int16_t *audioBuf, unsigned numSamples) override {
+        std::lock_guard lock(mutex);
+        beginFrame();
         z80Core.setEnableDebugger(enableDebugger);
 
         int lineHalfCycles   = 0; // Half-cycles for this line
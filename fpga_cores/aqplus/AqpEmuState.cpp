@@ -25,6 +25,14 @@
 #define HCYCLES_PER_LINE   (455)
 #define HCYCLES_PER_SAMPLE (162)
 
+// T-states per byte of the ROM style ESP read loop replaced by the fast path, with the byte already available:
+// ld a,d (4) / or e (4) / call (17) / in (11) / and (7) / jr z (7) / in (11) / ret (10) / ld (hl),a (7) / inc hl (6) /
+// dec de (6) / jr (12). The not taken ret z (5) or jr z (7) of the count check comes on top.
+#define ESP_HLE_TSTATES_PER_BYTE (4 + 4 + 17 + 11 + 7 + 7 + 11 + 10 + 7 + 6 + 6 + 12)
+
+// Bytes copied per fast path call, keeps interrupts and video lines from being held off for more than a few lines
+#define ESP_HLE_MAX_BYTES (16)
+
 class AqpEmuState : public EmuState {
 public:
     Z80Core             z80Core;
@@ -36,8 +44,6 @@ public:
     uint8_t             videoMode         = 0;
     DCBlock             dcBlockLeft;
     DCBlock             dcBlockRight;
-    std::string         typeInStr;
-    std::mutex          mutexTypeInStr;
     uint8_t             mainRam[512 * 1024];
     uint8_t             cartRom[16 * 1024];
 
@@ -63,6 +69,8 @@ public:
     bool    soundOutput           = false; // $FC<1>: Cassette/Sound output
     bool    cpmRemap              = false; // $FD<1>: Remap memory for CP/M
     bool    forceTurbo            = false;
+    bool    busAcquired           = false; // CPU stalled for ESP memory/IO access
+    bool    espReadHle            = false; // Fast path for ESP read loops
 
     AqpEmuState() {
         coreType         = 1;
@@ -122,6 +130,7 @@ public:
         showMemEdit      = getBoolValue(root, "showMemEdit", false);
         memEditMemSelect = getIntValue(root, "memEditMemSelect", 0);
         showIoRegsWindow = getBoolValue(root, "showIoRegsWindow", false);
+        setEspReadHle(getBoolValue(root, "espReadHle", false));
 
         z80Core.loadConfig(root);
         cJSON_Delete(root);
@@ -132,6 +141,7 @@ public:
         cJSON_AddBoolToObject(root, "showMemEdit", showMemEdit);
         cJSON_AddNumberToObject(root, "memEditMemSelect", memEditMemSelect);
         cJSON_AddBoolToObject(root, "showIoRegsWindow", showIoRegsWindow);
+        cJSON_AddBoolToObject(root, "espReadHle", espReadHle);
 
         z80Core.saveConfig(root);
         Config::instance()->saveConfigFile("aqplus.json", root);
@@ -158,57 +168,81 @@ public:
         renderOverlay(pixels, pitch);
     }
 
-    void spiTx(const void *data, size_t length) override {
-        EmuState::spiTx(data, length);
-        if (!spiSelected || txBuf.empty())
-            return;
-
-        switch (txBuf[0]) {
+    void spiCommand(uint8_t cmd, const uint8_t *data, size_t length, uint8_t *rxBuf, size_t rxLength) override {
+        switch (cmd) {
             case CMD_SET_KEYB_MATRIX: {
-                if (txBuf.size() == 1 + 8) {
-                    memcpy(&keybMatrix, &txBuf[1], 8);
+                if (length == 8) {
+                    memcpy(&keybMatrix, data, 8);
                 }
                 break;
             }
 
             case CMD_SET_HCTRL: {
-                if (txBuf.size() == 1 + 2) {
-                    ay1.portRdData[0] = txBuf[1];
-                    ay1.portRdData[1] = txBuf[2];
+                if (length == 2) {
+                    ay1.portRdData[0] = data[0];
+                    ay1.portRdData[1] = data[1];
                 }
                 break;
             }
 
             case CMD_SET_VIDMODE: {
-                if (txBuf.size() == 1 + 1) {
-                    videoMode = txBuf[1];
+                if (length == 1) {
+                    videoMode = data[0];
                 }
                 break;
             }
 
             case CMD_FORCE_TURBO: {
-                if (txBuf.size() == 1 + 1) {
-                    forceTurbo = txBuf[1];
+                if (length == 1) {
+                    forceTurbo = data[0];
                 }
                 break;
             }
 
             case CMD_WRITE_KBBUF: {
-                if (txBuf.size() == 1 + 1 && kbBuf.size() < kbBufSize) {
-                    kbBuf.push_back(txBuf[1]);
+                if (length == 1 && kbBuf.size() < kbBufSize) {
+                    kbBuf.push_back(data[0]);
+                }
+                break;
+            }
+
+            case CMD_BUS_ACQUIRE: busAcquired = true; break;
+            case CMD_BUS_RELEASE: busAcquired = false; break;
+
+            case CMD_MEM_WRITE: {
+                if (length == 3) {
+                    memWrite(data[0] | (data[1] << 8), data[2]);
+                }
+                break;
+            }
+            case CMD_MEM_READ: {
+                if (length == 2 && rxLength >= 2) {
+                    rxBuf[1] = memRead(data[0] | (data[1] << 8));
                 }
                 break;
             }
+            case CMD_IO_WRITE: {
+                if (length == 3) {
+                    ioWrite(data[0] | (data[1] << 8), data[2]);
+                }
+                break;
+            }
+            case CMD_IO_READ: {
+                if (length == 2 && rxLength >= 2) {
+                    rxBuf[1] = ioRead(data[0] | (data[1] << 8));
+                }
+                break;
+            }
+
+            default: EmuState::spiCommand(cmd, data, length, rxBuf, rxLength); break;
         }
     }
 
-    void pasteText(const std::string &str) override {
-        std::lock_guard lock(mutexTypeInStr);
-        typeInStr = str;
+    unsigned typeInSpace() override {
+        return kbBufSize - (unsigned)kbBuf.size();
     }
-    bool pasteIsDone() override {
-        std::lock_guard lock(mutexTypeInStr);
-        return typeInStr.empty();
+    void typeInKey(uint8_t ch) override {
+        spiCommand(CMD_WRITE_KBBUF, &ch, 1, nullptr, 0);
     }
 
     uint8_t memRead(uint16_t addr) {
@@ -414,6 +448,8 @@ public:
     }
 
     void emulateFrame(int16_t *audioBuf, unsigned numSamples) override {
+        std::lock_guard lock(mutex);
+        beginFrame();
         z80Core.setEnableDebugger(enableDebugger);
 
         int lineHalfCycles   = 0; // Half-cycles for this line
@@ -427,14 +463,16 @@ public:
 
             // Emulate for the duration of one audio sample
             while (sampleHalfCycles < hcyclesPerSample) {
-                int halfCycles = z80Core.emulate() * 2;
+                // While the ESP holds the bus the CPU is stalled
+                int halfCycles = busAcquired ? 8 : z80Core.emulate() * 2;
                 lineHalfCycles += halfCycles;
                 sampleHalfCycles += halfCycles;
 
                 // Render video line
-                if (lineHalfCycles >= hcyclesPerLine) {
+                while (lineHalfCycles >= hcyclesPerLine) {
                     lineHalfCycles -= hcyclesPerLine;
                     video.drawLine(video.videoLine++);
+                    spiDrain();
                     irqStatus |= video.isOnVideoIrqLine() ? (1 << 1) : 0;
                     irqStatus |= video.isOnStartOfVBlank() ? (1 << 0) : 0;
                 }
@@ -509,15 +547,6 @@ public:
         return true;
     }
 
-    void keyboardTypeIn() {
-        std::lock_guard lock(mutexTypeInStr);
-        if (kbBuf.size() < kbBufSize && !typeInStr.empty()) {
-            char ch = typeInStr.front();
-            typeInStr.erase(typeInStr.begin());
-            Keyboard::instance()->pressKey(ch);
-        }
-    }
-
     void fileMenu() override {
         if (ImGui::MenuItem("Load cartridge ROM...", "")) {
             char const *lFilterPatterns[1] = {"*.rom"};
@@ -532,9 +561,90 @@ public:
             cartridgeInserted = false;
             reset(true);
         }
+        bool fastReads = espReadHle;
+        if (ImGui::MenuItem("Fast ESP file reads (not timing accurate)", "", &fastReads))
+            setEspReadHle(fastReads);
         ImGui::Separator();
     }
 
+    // The hook is only installed while enabled, the Z80 core skips it entirely otherwise
+    void setEspReadHle(bool enable) {
+        espReadHle      = enable;
+        z80Core.hleHook = nullptr;
+        if (enable)
+            z80Core.hleHook = [this] { return espReadLoopHle(); };
+    }
+
+    // High-level emulation of the ROM style ESP read loop:
+    //   loop: ld a,d / or e / ret z (or jr z,nn) / call get_byte / ld (hl),a / inc hl / dec de / jr loop
+    // with get_byte: in a,($F4) / and 1 / jr z,get_byte / in a,($F5) / ret
+    // BC may be used as counter instead of DE. Copies the bytes already pending in the ESP
+    // response buffer straight into memory, leaving PC at the loop start.
+    int espReadLoopHle() {
+        auto up = UartProtocol::instance();
+        if ((up->getStatus() & 1) == 0)
+            return 0;
+
+        uint16_t pc = z80Core.getPC();
+        uint8_t  code[12];
+        for (unsigned i = 0; i < sizeof(code); i++)
+            code[i] = memRead(pc + i);
+
+        bool useDE;
+        if (code[0] == 0x7A && code[1] == 0xB3) {
+            useDE = true;
+        } else if (code[0] == 0x78 && code[1] == 0xB1) {
+            useDE = false;
+        } else {
+            return 0;
+        }
+
+        unsigned idx = 2;
+        int      countCheckTStates;
+        if (code[idx] == 0xC8) {
+            idx += 1;
+            countCheckTStates = 5;
+        } else if (code[idx] == 0x28) {
+            idx += 2;
+            countCheckTStates = 7;
+        } else {
+            return 0;
+        }
+
+        if (code[idx] != 0xCD ||
+            code[idx + 3] != 0x77 ||
+            code[idx + 4] != 0x23 ||
+            code[idx + 5] != (useDE ? 0x1B : 0x0B) ||
+            code[idx + 6] != 0x18 ||
+            (uint16_t)(pc + idx + 8 + (int8_t)code[idx + 7]) != pc)
+            return 0;
+
+        static const uint8_t getByte[] = {0xDB, 0xF4, 0xE6, 0x01, 0x28, 0xFA, 0xDB, 0xF5, 0xC9};
+        uint16_t             getAddr   = code[idx + 1] | (code[idx + 2] << 8);
+        for (unsigned i = 0; i < sizeof(getByte); i++) {
+            if (memRead(getAddr + i) != getByte[i])
+                return 0;
+        }
+
+        // Copy straight from the response buffer, the rest of the data follows on the next call
+        size_t length;
+        auto   span = up->readSpan(&length);
+
+        auto     &regs  = z80Core.getRegs();
+        uint16_t &count = useDE ? regs.wr.DE : regs.wr.BC;
+        length          = std::min({length, (size_t)count, (size_t)ESP_HLE_MAX_BYTES});
+        if (length == 0)
+            return 0;
+
+        for (size_t i = 0; i < length; i++)
+            memWrite(regs.wr.HL++, span[i]);
+
+        count -= (uint16_t)length;
+        regs.br.A = span[length - 1];
+        up->readConsume(length);
+        return (int)length * (ESP_HLE_TSTATES_PER_BYTE + countCheckTStates);
+    }
+
     void dbgMenu() override {
         if (!enableDebugger)
             return;
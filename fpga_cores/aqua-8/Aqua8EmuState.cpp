@@ -3,10 +3,12 @@
 #include "UartProtocol.h"
 #include "FPGA.h"
 #include "../aq32/cpu/riscv.h"
+#include "../aq32/cpu/RiscvProfiler.h"
 #include "Config.h"
 #include "bootrom.h"
 #include "imgui.h"
 #include "Keyboard.h"
+#include "MemoryPages.h"
 #include <chrono>
 
 #ifndef WIN32
@@ -93,20 +95,24 @@ static uint64_t now_ms() {
 class Aqua8EmuState : public EmuState {
 public:
     riscv                cpu;
+    RiscvProfiler        profiler;
     uint64_t             keybMatrix = 0;
     uint64_t             gamePad1   = 0;
     uint64_t             gamePad2   = 0;
     uint16_t             handCtrl   = 0xFFFF;
     std::deque<uint16_t> kbBuf;
     const unsigned       kbBufSize  = 16;
+    uint32_t             irqLevel   = 0; // Level-triggered interrupt sources (keyboard buffer, ESP UART)
+    float                hostMips   = 0;
+    float                icacheHits = 0; // Percentage of instructions served from the instruction cache
+    float                cpuIdle    = 0; // Percentage of steps skipped while the CPU was idle
     unsigned             audioLeft  = 0;
     unsigned             audioRight = 0;
     DCBlock              dcBlockLeft;
     DCBlock              dcBlockRight;
-    std::string          typeInStr;
-    std::recursive_mutex mutex;
     uint32_t             mainRam[512 * 1024 / 4];
     uint32_t             bootRom[0x800 / 4];
+    MemoryPages<20, 11>  pages;
     int                  curLineStepsRemaining = 0;
     uint64_t             mtimecmp              = 0;
     uint64_t             mtimeDiff             = 0;
@@ -144,6 +150,7 @@ public:
     bool showBreakpoints   = false;
     bool showIoRegsWindow  = false;
     bool showMemEdit       = false;
+    bool showProfiler      = false;
     int  memEditMemSelect  = 0;
     bool enableBreakpoints = false;
 
@@ -171,6 +178,7 @@ public:
         cpu.dataRead16  = [this](uint32_t addr) { return _memRead16(addr); };
         cpu.dataRead32  = [this](uint32_t addr) { return _memRead32(addr); };
         cpu.instrRead   = [this](uint32_t addr) { return (uint32_t)memRead(addr); };
+        cpu.bindBus(this);
 
         memset(&keybMatrix, 0xFF, sizeof(keybMatrix));
         memcpy(bootRom, bootrom_bin, bootrom_bin_len);
@@ -181,6 +189,13 @@ public:
         video.clip_y1 = 0;
         video.clip_y2 = 163;
 
+        // Memory accessed directly, the other pages are handled by ioRead/ioWrite
+        pages.map(BASE_BOOTROM, sizeof(bootRom), bootRom, false);
+        pages.map(BASE_VRAM, sizeof(video.vram), video.vram, true);
+        pages.map(BASE_MAINRAM, sizeof(mainRam), mainRam, true);
+        cpu.addCodeRegion(BASE_BOOTROM, sizeof(bootRom));
+        cpu.addCodeRegion(BASE_MAINRAM, sizeof(mainRam));
+
         loadConfig();
         reset();
 
@@ -221,10 +236,20 @@ public:
         cpu.mtval        = 0;
         cpu.mip          = 0;
         cpu.trap         = 0;
+        cpu.wfi          = false;
+        cpu.callDepth    = 0;
+        cpu.flushInstrCache();
         setMtime(0);
         mtimecmp = 0;
 
         kbBuf.clear();
+        updateIrqLevel();
+    }
+
+    void updateIrqLevel() {
+        irqLevel = (kbBuf.empty() ? 0 : (1 << 19)) |
+                   ((UartProtocol::instance()->getStatus() & 1) ? (1 << 20) : 0);
+        cpu.pendInterrupt(irqLevel);
     }
 
     void loadConfig() {
@@ -234,6 +259,11 @@ public:
         showCpuState     = getBoolValue(root, "showCpuState", false);
         showBreakpoints  = getBoolValue(root, "showBreakpoints", false);
         showIoRegsWindow = getBoolValue(root, "showIoRegsWindow", false);
+        cpu.setBlockMode(getBoolValue(root, "cpuBlockMode", false));
+        cpu.setJit(getBoolValue(root, "cpuJit", false));
+        showProfiler = getBoolValue(root, "showProfiler", false);
+        profiler.setEnabled(cpu, getBoolValue(root, "profilerEnabled", false));
+        profiler.symbols.load(getStringValue(root, "profilerElfPath", ""));
 
         cJSON_Delete(root);
     }
@@ -245,18 +275,21 @@ public:
         cJSON_AddBoolToObject(root, "showCpuState", showCpuState);
         cJSON_AddBoolToObject(root, "showBreakpoints", showBreakpoints);
         cJSON_AddBoolToObject(root, "showIoRegsWindow", showIoRegsWindow);
+        cJSON_AddBoolToObject(root, "cpuBlockMode", cpu.getBlockMode());
+        cJSON_AddBoolToObject(root, "cpuJit", cpu.getJit());
+        cJSON_AddBoolToObject(root, "showProfiler", showProfiler);
+        cJSON_AddBoolToObject(root, "profilerEnabled", profiler.isEnabled());
+        cJSON_AddStringToObject(root, "profilerElfPath", profiler.symbols.getPath().c_str());
 
         Config::instance()->saveConfigFile("aqua-8.json", root);
     }
 
     void getVideoSize(int &w, int &h) override {
-        std::lock_guard lock(mutex);
         w = 640;
         h = 480;
     }
 
     void getPixels(void *pixels, int pitch) override {
-        std::lock_guard lock(mutex);
         memset(pixels, 0, 480 * pitch);
 
         for (int y = 0; y < 160; y++) {
@@ -273,57 +306,54 @@ public:
         renderOverlay(pixels, pitch);
     }
 
-    void spiTx(const void *data, size_t length) override {
-        std::lock_guard lock(mutex);
-        EmuState::spiTx(data, length);
-        if (!spiSelected || txBuf.empty())
-            return;
-
-        switch (txBuf[0]) {
+    void spiCommand(uint8_t cmd, const uint8_t *data, size_t length, uint8_t *rxBuf, size_t rxLength) override {
+        switch (cmd) {
             case CMD_SET_KEYB_MATRIX: {
-                if (txBuf.size() == 1 + 8) {
-                    memcpy(&keybMatrix, &txBuf[1], 8);
+                if (length == 8) {
+                    memcpy(&keybMatrix, data, 8);
                 }
                 break;
             }
 
             case CMD_SET_HCTRL: {
-                if (txBuf.size() == 1 + 2) {
-                    memcpy(&handCtrl, &txBuf[1], 2);
+                if (length == 2) {
+                    memcpy(&handCtrl, data, 2);
                 }
                 break;
             }
 
             case CMD_WRITE_KBBUF16: {
-                if (txBuf.size() == 1 + 2 && kbBuf.size() < kbBufSize) {
-                    kbBuf.push_back(txBuf[1] | (txBuf[2] << 8));
+                if (length == 2 && kbBuf.size() < kbBufSize) {
+                    kbBuf.push_back(data[0] | (data[1] << 8));
+                    updateIrqLevel();
                 }
                 break;
             }
 
             case CMD_WRITE_GAMEPAD1: {
-                if (txBuf.size() == 1 + 8) {
-                    memcpy(&gamePad1, &txBuf[1], 8);
+                if (length == 8) {
+                    memcpy(&gamePad1, data, 8);
                 }
                 break;
             }
 
             case CMD_WRITE_GAMEPAD2: {
-                if (txBuf.size() == 1 + 8) {
-                    memcpy(&gamePad2, &txBuf[1], 8);
+                if (length == 8) {
+                    memcpy(&gamePad2, data, 8);
                 }
                 break;
             }
+
+            default: EmuState::spiCommand(cmd, data, length, rxBuf, rxLength); break;
         }
     }
 
-    void pasteText(const std::string &str) override {
-        std::lock_guard lock(mutex);
-        typeInStr = str;
+    unsigned typeInSpace() override {
+        return kbBufSize - (unsigned)kbBuf.size();
     }
-    bool pasteIsDone() override {
-        std::lock_guard lock(mutex);
-        return typeInStr.empty();
+    void typeInKey(uint8_t ch) override {
+        uint8_t data[2] = {ch, 0};
+        spiCommand(CMD_WRITE_KBBUF16, data, sizeof(data), nullptr, 0);
     }
 
     void setPixel(int x, int y, unsigned color) {
@@ -437,26 +467,45 @@ public:
     }
 
     int64_t memRead(uint32_t addr, bool allow_side_effect = true) {
-        if (/* addr >= BASE_BOOTROM && */ addr < (BASE_BOOTROM + sizeof(bootRom))) {
-            return bootRom[(addr & 0x7FF) / 4];
-        } else if (addr == REG_ESPCTRL) {
+        if (auto p = pages.readPtr(addr))
+            return *p;
+        return ioRead(addr, allow_side_effect);
+    }
+
+    void memWrite(uint32_t addr, uint32_t val, uint32_t mask) {
+        if (auto p = pages.writePtr(addr)) {
+            *p = (*p & ~mask) | (val & mask);
+            return;
+        }
+        ioWrite(addr, val, mask);
+    }
+
+    int64_t ioRead(uint32_t addr, bool allow_side_effect) {
+        if (addr == REG_ESPCTRL) {
             if (allow_side_effect)
                 return UartProtocol::instance()->readCtrl();
             else
                 return 0;
         } else if (addr == REG_ESPDATA) {
-            if (allow_side_effect)
-                return UartProtocol::instance()->readData();
-            else
+            if (allow_side_effect) {
+                uint8_t result = UartProtocol::instance()->readData();
+                updateIrqLevel();
+                cpu.loadSideEffect = true;
+                return result;
+            } else {
                 return 0;
+            }
         } else if (addr == REG_KEYBUF) {
             uint32_t result = 0;
             if (kbBuf.empty()) {
                 result = 1U << 31;
             } else {
                 result = kbBuf.front();
-                if (allow_side_effect)
+                if (allow_side_effect) {
                     kbBuf.pop_front();
+                    updateIrqLevel();
+                    cpu.loadSideEffect = true;
+                }
             }
             return result;
         } else if (addr == REG_HCTRL) {
@@ -498,9 +547,6 @@ public:
             return 0;
         } else if (addr == BASE_REG_PAGE) {
             return video.page;
-        } else if (addr >= BASE_VRAM && addr < (BASE_VRAM + sizeof(video.vram))) {
-            // Video RAM (8/16/32b)
-            return reinterpret_cast<uint32_t *>(video.vram)[(addr & (sizeof(video.vram) - 1)) / 4];
         } else if (addr >= BASE_VRAM4BIT && addr < (BASE_VRAM4BIT + 2 * sizeof(video.vram))) {
             // Video RAM (8/16/32b)
             uint16_t val16 = reinterpret_cast<uint16_t *>(video.vram)[(addr & (2 * sizeof(video.vram) - 1)) / 4];
@@ -509,14 +555,11 @@ public:
                              ((val16 & 0x00F0) << 4) |
                              (val16 & 0x000F);
             return val32;
-
-        } else if (addr >= BASE_MAINRAM && addr < (BASE_MAINRAM + sizeof(mainRam))) {
-            return mainRam[(addr & (sizeof(mainRam) - 1)) / 4];
         }
         return -1;
     }
 
-    void memWrite(uint32_t addr, uint32_t val, uint32_t mask) {
+    void ioWrite(uint32_t addr, uint32_t val, uint32_t mask) {
         if (addr == REG_ESPCTRL) {
             UartProtocol::instance()->writeCtrl(val & 0xFF);
         } else if (addr == REG_ESPDATA) {
@@ -525,8 +568,10 @@ public:
             } else {
                 UartProtocol::instance()->writeData(val & 0xFF);
             }
+            updateIrqLevel();
         } else if (addr == REG_KEYBUF) {
             kbBuf.clear();
+            updateIrqLevel();
         } else if (addr >= BASE_PALETTE && addr < (BASE_PALETTE + sizeof(video.palette))) {
             // Palette (16b)
             unsigned idx       = (addr & (sizeof(video.palette) - 1)) / 2;
@@ -568,10 +613,6 @@ public:
 
         } else if (addr == BASE_REG_PAGE) {
             video.page = val;
-        } else if (addr >= BASE_VRAM && addr < (BASE_VRAM + sizeof(video.vram))) {
-            // Video RAM (8/16/32b)
-            auto p = &reinterpret_cast<uint32_t *>(video.vram)[(addr & (sizeof(video.vram) - 1)) / 4];
-            *p     = (*p & ~mask) | (val & mask);
         } else if (addr >= BASE_VRAM4BIT && addr < (BASE_VRAM4BIT + 2 * sizeof(video.vram))) {
             uint16_t *p     = &reinterpret_cast<uint16_t *>(video.vram)[(addr & (2 * sizeof(video.vram) - 1)) / 4];
             uint16_t  val16 = *p;
@@ -588,43 +629,61 @@ public:
                 ((val32 & 0x00000F00) >> 4) |
                 (val32 & 0x0000000F);
             *p = val16;
+        }
+    }
 
-        } else if (addr >= BASE_MAINRAM && addr < (BASE_MAINRAM + sizeof(mainRam))) {
-            auto p = &mainRam[(addr & (sizeof(mainRam) - 1)) / 4];
-            *p     = (*p & ~mask) | (val & mask);
+    void syncBreakpoints() {
+        std::vector<uint32_t> addrs;
+        if (enableDebugger && enableBreakpoints) {
+            for (auto &bp : breakpoints) {
+                if (bp.enabled)
+                    addrs.push_back(bp.addr);
+            }
         }
+        cpu.setBreakpoints(addrs);
     }
 
     void emulateFrame(int16_t *audioBuf, unsigned numSamples) override {
         std::lock_guard lock(mutex);
+        beginFrame();
+        syncBreakpoints();
 
         if (emuMode != Em_Halted) {
+            auto     tStart        = std::chrono::steady_clock::now();
             unsigned stepsPerFrame = 10000000 / 60;
-            while (emuMode != Em_Halted && stepsPerFrame--) {
-                if (!kbBuf.empty())
-                    cpu.pendInterrupt(1 << 19);
-                if (UartProtocol::instance()->readCtrl() & 1)
-                    cpu.pendInterrupt(1 << 20);
+            unsigned steps         = 0;
+            uint64_t startHits     = cpu.icacheHits;
+            uint64_t startIdle     = cpu.idleSteps;
 
-                cpu.emulate();
+            while (emuMode != Em_Halted && steps < stepsPerFrame) {
+                spiDrain();
+
+                // The ESP status can be changed by the asynchronous I/O thread at any time
+                updateIrqLevel();
+                if ((irqLevel & (1 << 19)) == 0)
+                    keyboardTypeIn();
 
-                if (enableDebugger && enableBreakpoints) {
-                    for (auto &bp : breakpoints) {
-                        if (bp.enabled && bp.addr == cpu.pc) {
-                            emuMode = Em_Halted;
+                // Run in slices, the CPU stops early on a breakpoint or profiler sample
+                unsigned sliceSteps = cpu.run(emuMode == Em_Step ? 1 : profiler.limitSteps(std::min(stepsPerFrame - steps, 1000U)));
+                steps += sliceSteps;
+                profiler.sample(cpu, sliceSteps);
+
+                if (enableDebugger && enableBreakpoints && cpu.isBreakpoint(cpu.pc)) {
+                    emuMode = Em_Halted;
 #ifdef GDB_ENABLE
-                            gdbBreakpointHit();
+                    gdbBreakpointHit();
 #endif
-                            break;
-                        }
-                    }
                 }
                 if (emuMode == Em_Step)
                     emuMode = Em_Halted;
             }
 
             cpu.pendInterrupt(1 << 16);
-            keyboardTypeIn();
+
+            auto us  = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count();
+            hostMips   = us > 0 ? (float)steps / us : 0;
+            icacheHits = steps > 0 ? 100.0f * (cpu.icacheHits - startHits) / steps : 0;
+            cpuIdle    = steps > 0 ? 100.0f * (cpu.idleSteps - startIdle) / steps : 0;
         }
 
         if (audioBuf != nullptr) {
@@ -632,12 +691,17 @@ public:
         }
     }
 
-    void keyboardTypeIn() {
-        if (kbBuf.size() < kbBufSize && !typeInStr.empty()) {
-            char ch = typeInStr.front();
-            typeInStr.erase(typeInStr.begin());
-            Keyboard::instance()->pressKey(ch);
+    void fileMenu() override {
+        std::lock_guard lock(mutex);
+        bool            enable = cpu.getBlockMode();
+        if (ImGui::MenuItem("Execute CPU code in blocks", "", &enable))
+            cpu.setBlockMode(enable);
+        if (riscv::jitSupported()) {
+            enable = cpu.getJit();
+            if (ImGui::MenuItem("Compile CPU blocks to host code", "", &enable, cpu.getBlockMode()))
+                cpu.setJit(enable);
         }
+        ImGui::Separator();
     }
 
     void dbgMenu() override {
@@ -649,6 +713,7 @@ public:
         ImGui::MenuItem("Breakpoints", "", &showBreakpoints);
         ImGui::MenuItem("Memory editor", "", &showMemEdit);
         ImGui::MenuItem("IO Registers", "", &showIoRegsWindow);
+        ImGui::MenuItem("Profiler", "", &showProfiler);
     }
 
     void dbgWindows() override {
@@ -665,6 +730,8 @@ public:
             dbgWndMemEdit(&showMemEdit);
         if (showIoRegsWindow)
             dbgWndIoRegs(&showIoRegsWindow);
+        if (showProfiler)
+            profiler.drawWindow(cpu, &showProfiler);
     }
 
     void dbgWndIoRegs(bool *p_open) {
@@ -745,6 +812,8 @@ public:
             ImGui::PopStyleColor();
             ImGui::EndDisabled();
 
+            ImGui::Text("Host speed: %.1f MIPS, instruction cache hits: %.1f%%", hostMips, icacheHits);
+            ImGui::Text("CPU idle: %.1f%%", cpuIdle);
             ImGui::Separator();
 
             {
@@ -904,6 +973,7 @@ public:
                 };
                 memEdit.writeFn = [this](ImU8 *data, size_t off, ImU8 d) {
                     memWrite((uint32_t)off, d | (d << 8) | (d << 16) | (d << 24), 0xFF << (off & 3) * 8);
+                    cpu.invalidateInstr((uint32_t)off);
 
                     // memWrite((uint16_t)off, d);
                 };
@@ -1088,6 +1158,7 @@ public:
                 endAddr = BASE_MAINRAM + sizeof(mainRam);
 
             memcpy(((uint8_t *)mainRam) + addr, data.data(), endAddr - addr);
+            cpu.flushInstrCache();
 
         } else {
             printf("Write memory %08lX: ", addr);
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+// Unbounded lock-free multi-producer single-consumer queue.
+// push() may be called from any thread, pop()/empty() only from the consumer.
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue()
+        : head(&stub), tail(&stub) {}
+
+    ~MpscQueue() {
+        T tmp;
+        while (pop(tmp)) {
+        }
+        if (tail != &stub)
+            delete tail;
+    }
+
+    MpscQueue(const MpscQueue &)            = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    void push(T &&value) {
+        auto node = new Node(std::move(value));
+        auto prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    bool pop(T &value) {
+        Node *cur  = tail;
+        Node *next = cur->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+            return false;
+
+        value = std::move(next->value);
+        tail  = next;
+        if (cur != &stub)
+            delete cur;
+        return true;
+    }
+
+    bool empty() const {
+        return tail->next.load(std::memory_order_acquire) == nullptr;
+    }
+
+private:
+    struct Node {
+        Node() = default;
+        Node(T &&_value)
+            : value(std::move(_value)) {}
+
+        std::atomic<Node *> next{nullptr};
+        T                   value;
+    };
+
+    Node                stub;
+    std::atomic<Node *> head;
+    Node               *tail;
+};
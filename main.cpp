@@ -44,7 +44,7 @@ int main(int argc, char *argv[]) {
     int  opt;
     bool paramsOk = true;
     bool showHelp = false;
-    while ((opt = getopt(argc, argv, "hu:t:")) != -1) {
+    while ((opt = getopt(argc, argv, "hu:t:V")) != -1) {
         if (opt == '?' || opt == ':') {
             paramsOk = false;
             break;
@@ -67,6 +67,7 @@ int main(int argc, char *argv[]) {
 #endif
                 break;
             }
+            case 'V': config->espVirtualTime = true; break;
             case 't': {
                 const char *p = optarg;
                 while (*p) {
@@ -92,8 +93,9 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Usage: %s <options>\n\n", argv[0]);
         fprintf(stderr, "Options:\n");
         fprintf(stderr, "-h          This help screen\n");
-        fprintf(stderr, "-u <path>   SD card base path (default: %s)\n", config->sdCardPath.c_str());
+        fprintf(stderr, "-u <path>   SD card base path or FAT disk image (default: %s)\n", config->sdCardPath.c_str());
         fprintf(stderr, "-t <string> Type in string.\n");
+        fprintf(stderr, "-V          Run the ESP side on emulated instead of wall-clock time.\n");
         fprintf(stderr, "\n");
         exit(1);
     }
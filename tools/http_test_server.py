@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""Loopback HTTP server for exercising HttpVFS without network access.
+
+Serves the files in a directory with the features HttpVFS depends on:
+- keep-alive (HTTP/1.1)
+- HEAD
+- single range requests (206, 416)
+- ETag/Last-Modified validation (304)
+- redirects: /redirect/<path> answers 302 to /<path>
+
+Usage: http_test_server.py [-p PORT] [-d DIR] [--no-ranges] [--chunked]
+
+Then open e.g. http://127.0.0.1:8936/file.bin from the emulator. Per-request
+statistics are shown in the emulator's HTTP statistics window.
+"""
+
+import argparse
+import email.utils
+import http.server
+import os
+import re
+import sys
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, fmt, *args):
+        if not self.server.quiet:
+            sys.stderr.write("%s %s\n" % (self.command, fmt % args))
+
+    def do_HEAD(self):
+        self.handle_request(False)
+
+    def do_GET(self):
+        self.handle_request(True)
+
+    def send_empty(self, status, headers=()):
+        self.send_response(status)
+        for name, value in headers:
+            self.send_header(name, value)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def handle_request(self, send_body):
+        path = self.path.split("?", 1)[0]
+        if path.startswith("/redirect/"):
+            self.send_empty(302, [("Location", path[len("/redirect"):])])
+            return
+
+        fs_path = os.path.realpath(os.path.join(self.server.root, path.lstrip("/")))
+        if not fs_path.startswith(self.server.root + os.sep) or not os.path.isfile(fs_path):
+            self.send_empty(404)
+            return
+
+        with open(fs_path, "rb") as f:
+            data = f.read()
+        mtime = os.path.getmtime(fs_path)
+        etag = '"%x-%x"' % (int(mtime * 1000), len(data))
+        validators = [("ETag", etag), ("Last-Modified", email.utils.formatdate(mtime, usegmt=True))]
+
+        if self.headers.get("If-None-Match") == etag:
+            self.send_empty(304, validators)
+            return
+
+        status = 200
+        headers = list(validators)
+        rng = self.headers.get("Range")
+        if rng and not self.server.no_ranges:
+            m = re.fullmatch(r"bytes=(\d*)-(\d*)", rng.strip())
+            if m and (m[1] or m[2]):
+                if m[1]:
+                    first = int(m[1])
+                    last = min(int(m[2]), len(data) - 1) if m[2] else len(data) - 1
+                else:
+                    first = max(len(data) - int(m[2]), 0)
+                    last = len(data) - 1
+                if first >= len(data) or first > last:
+                    self.send_empty(416, [("Content-Range", "bytes */%d" % len(data))])
+                    return
+                status = 206
+                headers.append(("Content-Range", "bytes %d-%d/%d" % (first, last, len(data))))
+                data = data[first:last + 1]
+        if not self.server.no_ranges:
+            headers.append(("Accept-Ranges", "bytes"))
+
+        self.send_response(status)
+        for name, value in headers:
+            self.send_header(name, value)
+        if self.server.chunked and send_body:
+            self.send_header("Transfer-Encoding", "chunked")
+            self.end_headers()
+            for i in range(0, len(data), 4096):
+                chunk = data[i:i + 4096]
+                self.wfile.write(b"%x\r\n%s\r\n" % (len(chunk), chunk))
+            self.wfile.write(b"0\r\n\r\n")
+            return
+
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        if send_body:
+            self.wfile.write(data)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Loopback HTTP server for testing HttpVFS")
+    parser.add_argument("-p", "--port", type=int, default=8936)
+    parser.add_argument("-d", "--dir", default=".", help="directory to serve (default: current directory)")
+    parser.add_argument("--no-ranges", action="store_true", help="ignore Range headers, like some servers do")
+    parser.add_argument("--chunked", action="store_true", help="send GET bodies with chunked transfer encoding")
+    parser.add_argument("-q", "--quiet", action="store_true", help="don't log requests")
+    args = parser.parse_args()
+
+    server = http.server.ThreadingHTTPServer(("127.0.0.1", args.port), Handler)
+    server.root = os.path.realpath(args.dir)
+    server.no_ranges = args.no_ranges
+    server.chunked = args.chunked
+    server.quiet = args.quiet
+    print("Serving %s on http://127.0.0.1:%d/" % (server.root, args.port))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""Loopback TCP server for exercising TcpVFS without network access.
+
+Modes:
+- echo: sends back everything it receives (default)
+- file: sends the contents of a file on connect, then closes the connection
+
+--delay holds back each response, to try out the read and connect timeouts.
+
+Usage: tcp_test_server.py [-p PORT] [--file PATH] [--delay MS]
+
+Then open e.g. tcp://127.0.0.1:8937 (or tcp://localhost:8937 to go through the
+resolver) from the emulator. Counters are shown in the emulator's TCP
+statistics.
+"""
+
+import argparse
+import socketserver
+import sys
+import time
+
+
+class EchoHandler(socketserver.BaseRequestHandler):
+    def handle(self):
+        while True:
+            data = self.request.recv(65536)
+            if not data:
+                break
+            time.sleep(self.server.delay)
+            self.request.sendall(data)
+
+
+class FileHandler(socketserver.BaseRequestHandler):
+    def handle(self):
+        with open(self.server.path, "rb") as f:
+            data = f.read()
+        time.sleep(self.server.delay)
+        self.request.sendall(data)
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Loopback TCP server for testing TcpVFS")
+    parser.add_argument("-p", "--port", type=int, default=8937)
+    parser.add_argument("--file", help="send this file on connect instead of echoing")
+    parser.add_argument("--delay", type=int, default=0, help="milliseconds to wait before each response")
+    args = parser.parse_args()
+
+    server = Server(("127.0.0.1", args.port), FileHandler if args.file else EchoHandler)
+    server.path = args.file
+    server.delay = args.delay / 1000
+    print("%s server on tcp://127.0.0.1:%d" % ("File" if args.file else "Echo", args.port))
+    sys.stdout.flush()
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()